@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
 #include <span>
+#include <vector>
 #include "EngineBase.h"
 
 #if defined(_WIN32)
@@ -17,12 +19,33 @@
 namespace qvw {
 
 class LlamaEngine;
+class LlamaCtx;
 
 struct LlamaEngineLoadParams : public EngineLoadParams {
+    enum class KvType {
+        Auto,   // f16, quantized when memory is tight
+        F16,
+        Q8_0,
+        Q4_0
+    };
+
+    enum class FlashAttn {
+        Auto,   // llama.cpp decides, enabled for a quantized KV cache
+        Off,
+        On
+    };
+
     int threads{-1};
     int ctx_size{4096};        // typical default; tune as you like
     int n_gpu_layers{0};       // keep 0 for CPU-only wrapper
-    bool flash_attn{false};    // optional
+    FlashAttn flash_attn{FlashAttn::Auto};
+    KvType kv_type{KvType::Auto};
+    int n_ubatch{0};           // tokens per compute pass. 0 for 512, less when memory is tight.
+    bool offload_kqv{true};    // keep the KV cache on the GPU with the offloaded layers
+    float defrag_thold{-1.0f}; // defragment the KV cache above this fraction of holes. <= 0 to disable.
+    size_t prefix_cache_bytes{256 * 1024 * 1024}; // KV snapshots of shared prompt prefixes. 0 to disable.
+    int max_idle_contexts{2};  // llama contexts kept for reuse by later prompts. 0 to disable.
+    size_t memory_budget{0};   // bytes for the KV caches and work buffers of all the model's contexts. 0 to use what is available.
 };
 
 class QVW_LLAMA_WRAP_API LlamaSessionCtx : public SessionCtx {
@@ -34,6 +57,8 @@ public:
         float top_p{0.95f};
         float repeat_penalty{1.1f};
         bool  continue_conversation{false};
+        bool  use_prefix_cache{true}; // reuse the KV cache of a prompt prefix seen before
+        int   prompt_lookup_tokens{0};  // draft up to this many tokens by copying from the prompt. 0 to disable.
         std::vector<std::string> stop;
 
         // -------------------------
@@ -72,6 +97,17 @@ public:
             // Slightly discourage repetition loops, but not enough to rephrase
             p.repeat_penalty = 1.15f;
 
+            // Names, numbers and markup are mostly copied from the source
+            p.prompt_lookup_tokens = 10;
+
+            return p;
+        }
+
+        /// Cleanup/rewrite of a transcript. Most of the output is copied from the prompt.
+        static Params Rewrite(int maxTokens = 256) {
+            Params p;
+            p.max_tokens           = maxTokens;
+            p.prompt_lookup_tokens = 10;
             return p;
         }
 
@@ -137,6 +173,16 @@ public:
     };
 
 
+    //! Accounting for speculative decoding
+    struct SpeculativeStats {
+        uint64_t rounds{};    // batches that verified drafted tokens
+        uint64_t drafted{};
+        uint64_t accepted{};
+    };
+
+    //! The text of one sequence of promptFanOut() so far
+    using sequence_text_cb_t = std::function<void(size_t index, const std::string& text)>;
+
     LlamaSessionCtx();
     ~LlamaSessionCtx() override;
 
@@ -147,18 +193,111 @@ public:
     // Llama API
     QVW_LLAMA_WRAP_API bool prompt(std::string_view text, const Params& params);
 
+    /*! True if the output of the last prompt() was cut short.
+     *
+     *  That is, generation stopped because the context or the output budget
+     *  ran out, before the model ended the output itself. prompt() still
+     *  succeeds and returns what was generated.
+     */
+    QVW_LLAMA_WRAP_API bool truncated() const;
+
+    /*! Saves the conversation held by the session (its KV cache) to a file.
+     *
+     *  loadState() restores it in a session for the same model, so that the
+     *  conversation can continue without evaluating its history again.
+     *  The file is replaced atomically.
+     */
+    QVW_LLAMA_WRAP_API bool saveState(const std::filesystem::path& path) const;
+
+    //! Replaces the conversation in the session with the one saved in the file
+    QVW_LLAMA_WRAP_API bool loadState(const std::filesystem::path& path);
+
+    /*! Speculative decoding with a smaller model from the same family.
+     *
+     *  The draft model proposes up to draftTokens tokens, and this model
+     *  verifies them in one batch. The tokens are still sampled from this
+     *  model, so only the speed changes. Fails if the vocabularies don't
+     *  match. An empty pointer turns it off.
+     */
+    QVW_LLAMA_WRAP_API bool setDraftModel(std::shared_ptr<LlamaCtx> draft, int draftTokens = 8);
+    QVW_LLAMA_WRAP_API SpeculativeStats speculativeStats() const;
+
+    /*! Completes several prompts that start with the same text.
+     *
+     *  For example one document translated to several languages: the prefix
+     *  is the document and each suffix asks for one language. The prefix is
+     *  evaluated once and shared by one sequence per suffix, and then all the
+     *  sequences are decoded together, one batch per token.
+     *
+     *  results[i] is the output for suffixes[i]. It uses its own context, so
+     *  the conversation held by the session is not affected.
+     */
+    QVW_LLAMA_WRAP_API bool promptFanOut(std::string_view prefix,
+                                         std::span<const std::string> suffixes,
+                                         const Params& params,
+                                         std::vector<std::string>& results);
+
+    //! Called by promptFanOut() as the sequences make progress, and when each of them ends
+    QVW_LLAMA_WRAP_API void setOnSequenceTextCallback(sequence_text_cb_t cb);
+
+    //! The indexes of the results of the last promptFanOut() that were cut short, like truncated()
+    QVW_LLAMA_WRAP_API std::vector<size_t> truncatedSequences() const;
+
 protected:
     virtual void setOnPartialTextCallbackImpl(std::function<void(const std::string&)>) = 0;
     virtual std::string getFullTextResultImpl() const = 0;
 
     // Llama API
     virtual bool promptImpl(std::string_view text, const Params& params) = 0;
+    virtual bool saveStateImpl(const std::filesystem::path& path) const = 0;
+    virtual bool loadStateImpl(const std::filesystem::path& path) = 0;
+    virtual bool setDraftModelImpl(std::shared_ptr<LlamaCtx> draft, int draftTokens) = 0;
+    virtual SpeculativeStats speculativeStatsImpl() const = 0;
+    virtual bool truncatedImpl() const = 0;
+    virtual std::vector<size_t> truncatedSequencesImpl() const = 0;
+    virtual bool promptFanOutImpl(std::string_view prefix, std::span<const std::string> suffixes,
+                                  const Params& params, std::vector<std::string>& results) = 0;
+    virtual void setOnSequenceTextCallbackImpl(sequence_text_cb_t cb) = 0;
 };
 
 class QVW_LLAMA_WRAP_API LlamaCtx : public ModelCtx {
 public:
+    /*! Accounting for the prompt prefix cache.
+     *
+     *  When new prompts start with the same tokens (like a long system prompt),
+     *  the KV cache for those tokens is saved once and restored for the next
+     *  prompts, so only the rest of the prompt has to be evaluated.
+     */
+    struct PrefixCacheStats {
+        int entries{};
+        size_t bytes{};
+        size_t max_bytes{};
+        uint64_t hits{};
+        uint64_t misses{};
+        uint64_t reused_tokens{};  // prefill tokens saved by hits
+        uint64_t evictions{};
+    };
+
     LlamaCtx();
     ~LlamaCtx() override;
+
+    QVW_LLAMA_WRAP_API PrefixCacheStats prefixCacheStats() const;
+
+    //! Drops all the cached prefixes
+    QVW_LLAMA_WRAP_API void clearPrefixCache();
+
+    /*! The largest context that fits in the memory that is available now.
+     *
+     *  New contexts quantize the KV cache, or get smaller than asked for,
+     *  when memory is tight. Prompts that don't fit at all fail, so larger
+     *  work should be split to fit this. 0 if there is no known limit.
+     */
+    QVW_LLAMA_WRAP_API int maxContextTokens() const;
+
+protected:
+    virtual PrefixCacheStats prefixCacheStatsImpl() const = 0;
+    virtual void clearPrefixCacheImpl() = 0;
+    virtual int maxContextTokensImpl() const = 0;
 };
 
 class QVW_LLAMA_WRAP_API LlamaEngine : public EngineBase {
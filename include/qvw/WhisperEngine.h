@@ -1,7 +1,11 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <optional>
 #include <span>
+#include <string_view>
+#include <vector>
 
 #include "EngineBase.h"
 
@@ -26,6 +30,8 @@ struct WhisperEngineLoadParams : public EngineLoadParams {
     bool flash_attn{};
     int gpu_device{};
     int threads{-1};
+    int max_idle_states{1}; // whisper states kept for reuse when sessions end
+    size_t max_idle_state_bytes{}; // 0 for no limit
 };
 
 /*! Session context for Whisper model sessions.
@@ -37,8 +43,28 @@ struct WhisperEngineLoadParams : public EngineLoadParams {
 class QVW_WHISPER_WRAP_API WhisperSessionCtx : public SessionCtx {
 public:
     struct WhisperFullParams {
+        enum class Sampling {
+            Greedy,
+            BeamSearch
+        };
+
+        // Order in which the engine's scheduler admits concurrent calls
+        enum class Priority {
+            Background,
+            Normal,
+            Live
+        };
+
         std::string language; // empty for auto
-        int threads{-1}; // -1 for using default
+        int threads{-1}; // -1 for the share given by the scheduler. Capped by the free threads.
+
+        /*! Scheduling. Calls from all sessions share the engine's threads.
+         *
+         *  Waiting calls are admitted by priority, then by the earliest deadline.
+         *  A deadline is not enforced, but a missed deadline is counted.
+         */
+        Priority priority{Priority::Normal};
+        std::optional<std::chrono::steady_clock::time_point> deadline;
         std::optional<int> max_len;
         std::optional<int> offset_ms;
         std::optional<bool> token_timestamps;
@@ -48,6 +74,95 @@ public:
         std::optional<bool> print_timestamps;
         std::optional<bool> print_realtime;
         std::string vocabulary;
+
+        // Decoding. Unset values use whisper.cpp's defaults for the sampling strategy.
+        Sampling sampling{Sampling::Greedy};
+        std::optional<int> best_of;           // candidates when sampling with temperature > 0
+        std::optional<int> beam_size;         // BeamSearch only
+        std::optional<float> temperature;
+        std::optional<float> temperature_inc; // fallback step on failed decodes. 0 disables fallback
+        std::optional<float> entropy_thold;   // fallback when the entropy is below this
+        std::optional<float> logprob_thold;   // fallback when the avg log-probability is below this
+        std::optional<float> no_speech_thold;
+        std::optional<bool> no_timestamps;
+        std::optional<bool> suppress_blank;
+        std::optional<bool> suppress_nst;     // suppress non-speech tokens ([MUSIC], ...)
+
+        /*! Encoder context in frames (50 per second of audio). 0 for the full 30 s window.
+         *
+         *  Shorter contexts make the encoder proportionally cheaper, but
+         *  audio beyond the context is not seen by the model.
+         */
+        std::optional<int> audio_ctx;
+
+        /*! Size audio_ctx from the length of the input.
+         *
+         *  Only used for input shorter than 30 s. If the output looks
+         *  degraded, the input is decoded again with the full context.
+         *  After repeated fallbacks the session stops truncating.
+         */
+        bool fit_audio_ctx{false};
+        int min_audio_ctx{256}; // lower bound when fitting
+
+        bool collect_tokens{false}; // fill Transcript::tokens
+
+        /*! With `language` empty (auto), detect the language once, on the first
+         *  input of at least `min_detect_ms`, and use it for the rest of the session.
+         *
+         *  Saves the detection pass in each call, and keeps short inputs from
+         *  flipping the language. The language is only detected again when the
+         *  output has low confidence.
+         */
+        bool pin_language{false};
+        int min_detect_ms{1500};
+        float min_detect_p{0.5f}; // minimum probability to pin a detected language
+
+        /// One greedy pass without temperature fallback. For live transcription.
+        static WhisperFullParams LiveFast() {
+            WhisperFullParams p;
+            p.sampling        = Sampling::Greedy;
+            p.best_of         = 1;
+            p.temperature     = 0.0f;
+            p.temperature_inc = 0.0f;
+            p.suppress_nst    = true;
+            return p;
+        }
+
+        /// whisper.cpp's defaults: greedy with temperature fallback
+        static WhisperFullParams Balanced() {
+            WhisperFullParams p;
+            p.sampling = Sampling::Greedy;
+            return p;
+        }
+
+        /// Beam search with temperature fallback. Slowest, most accurate.
+        static WhisperFullParams ArchivalAccurate() {
+            WhisperFullParams p;
+            p.sampling        = Sampling::BeamSearch;
+            p.beam_size       = 5;
+            p.best_of         = 5;
+            p.temperature     = 0.0f;
+            p.temperature_inc = 0.2f;
+            p.suppress_nst    = true;
+            return p;
+        }
+
+        /*! Returns the preset with the given name.
+         *
+         *  Names: "live-fast", "balanced", "archival-accurate".
+         */
+        static std::optional<WhisperFullParams> Preset(std::string_view name) {
+            if (name == "live-fast") {
+                return LiveFast();
+            }
+            if (name == "balanced") {
+                return Balanced();
+            }
+            if (name == "archival-accurate") {
+                return ArchivalAccurate();
+            }
+            return std::nullopt;
+        }
     };
 
     struct Segment {
@@ -56,20 +171,73 @@ public:
         std::string text;
 
         // optional extras
-        float avg_logprob = 0.0f;
+        float avg_logprob = 0.0f;           // mean log-probability of the text tokens
         float no_speech_prob = 0.0f;
         int   speaker = -1;                 // if you ever add diarization
+
+        // Range in Transcript::tokens, if collected
+        uint32_t first_token = 0;
+        uint32_t token_count = 0;
+    };
+
+    /*! A text token. Special tokens (timestamps, language, ...) are not included.
+     *
+     *  The times are only meaningful with `token_timestamps`.
+     */
+    struct Token {
+        int32_t id = 0;
+        float p = 0.0f;                     // probability
+        float plog = 0.0f;                  // log-probability
+        int64_t t0_ms = 0;
+        int64_t t1_ms = 0;
+        uint32_t text_offset = 0;           // in Transcript::token_text
+        uint32_t text_size = 0;
     };
 
     struct Transcript {
         std::vector<Segment> segments;
         std::string full_text;              // convenience (can be derived)
         std::string language;               // detected or forced
+        int audio_ctx = 0;                  // encoder context used, 0 for the full window
+        bool audio_ctx_fallback = false;    // a fitted context was rejected by the quality guard
+
+        // Scheduling
+        double queue_ms = 0.0;              // waiting for the scheduler
+        double run_ms = 0.0;
+        int threads = 0;                    // threads given by the scheduler
+
+        // The tokens of all segments, in order, with their text in one string
+        std::vector<Token> tokens;
+        std::string token_text;
+
+        std::span<const Token> segmentTokens(const Segment& segment) const noexcept {
+            return std::span<const Token>{tokens}.subspan(segment.first_token, segment.token_count);
+        }
+
+        std::string_view tokenText(const Token& token) const noexcept {
+            return std::string_view{token_text}.substr(token.text_offset, token.text_size);
+        }
     };
 
+    using segment_cb_t = std::function<void(const Segment& segment)>;
+    using progress_cb_t = std::function<void(int percent)>;
+
     WhisperSessionCtx();
     virtual ~WhisperSessionCtx();
 
+    /*! Called from whisperFull() with each segment, as soon as it is decoded.
+     *
+     *  The partial text callback gets the text of the call so far.
+     *
+     *  The callbacks run on the thread that called whisperFull(). If a quality
+     *  check rejects a decode, the input is decoded again and its segments
+     *  are sent again. The returned Transcript is the result.
+     */
+    virtual void setOnSegmentCallback(segment_cb_t callback) = 0;
+
+    //! Called from whisperFull() with the progress of the call, in percent
+    virtual void setOnProgressCallback(progress_cb_t callback) = 0;
+
     /*! Processes the full audio data using the Whisper model.
      *
      * @param data Audio data as a span of floats.
@@ -81,6 +249,22 @@ public:
                              const WhisperFullParams& params,
                              Transcript& out) = 0;
 
+    //! The language pinned by `pin_language`, or empty.
+    virtual std::string pinnedLanguage() const = 0;
+
+    /*! Appends audio for whisperFullStreamed().
+     *
+     *  The log-mel spectrogram is computed here, as the audio arrives, so
+     *  whisperFullStreamed() only has to run the encoder and decoder.
+     */
+    virtual void streamAppend(std::span<const float> data) = 0;
+
+    //! Like whisperFull(), for the audio appended since the last call or streamReset()
+    virtual bool whisperFullStreamed(const WhisperFullParams& params, Transcript& out) = 0;
+
+    //! Drops the appended audio
+    virtual void streamReset() = 0;
+
 };
 
 /*! Context for a loaded Whisper model.
@@ -88,9 +272,46 @@ public:
  */
 class QVW_WHISPER_WRAP_API WhisperCtx : public ModelCtx {
 public:
+    /*! Accounting for the pool of whisper states.
+     *
+     *  Each session owns a whisper state (KV caches and compute buffers) while
+     *  it lives. When the session ends, the state goes back to the pool, so the
+     *  next session can start without allocating it again.
+     *
+     *  The byte counts are estimated from the model's KV cache sizes. The
+     *  compute buffers are not included.
+     */
+    struct StatePoolStats {
+        int idle{};
+        int in_use{};
+        uint64_t created{};
+        uint64_t reused{};
+        size_t state_bytes{}; // estimated size of one state
+    };
+
+    /*! How the model was loaded.
+     *
+     *  `blocks_read` counts the blocks read from storage (512 bytes on Linux).
+     *  It is close to 0 when the file was in the page cache. It is counted for
+     *  the loading thread where the platform supports it (Linux), else for the
+     *  whole process. 0 where it is not known.
+     */
+    struct LoadStats {
+        double seconds{};
+        uint64_t file_bytes{};
+        long blocks_read{};
+    };
+
     WhisperCtx();
     virtual ~WhisperCtx();
 
+    virtual StatePoolStats statePoolStats() const = 0;
+
+    virtual LoadStats loadStats() const = 0;
+
+    //! Frees the idle states
+    virtual void releaseIdleStates() = 0;
+
     virtual whisper_context *ctx() noexcept = 0;
     virtual const whisper_context *ctx() const noexcept = 0;
 };
@@ -103,7 +324,29 @@ public:
     QVW_WHISPER_WRAP_API WhisperEngine();
     QVW_WHISPER_WRAP_API virtual ~WhisperEngine();
 
-    struct WhisperCreateParams{};
+    /*! Threads shared by all the Whisper sessions of the engine.
+     *
+     *  At most `max_parallel_jobs` whisperFull() calls run at the same time.
+     *  The rest wait for their turn, so concurrent sessions don't oversubscribe the CPU.
+     */
+    struct WhisperCreateParams{
+        int threads{-1}; // total, -1 for EngineBase::getThreads()
+        int max_parallel_jobs{2};
+        int min_job_threads{2}; // a call is not started with fewer threads
+    };
+
+    struct SchedulerStats {
+        int total_threads{};
+        int free_threads{};
+        int running{};
+        int queued{};
+        uint64_t jobs{};            // completed
+        uint64_t missed_deadlines{};
+        double queue_ms{};          // total, for all completed jobs
+        double run_ms{};
+    };
+
+    virtual SchedulerStats schedulerStats() const = 0;
 
 
     /*! Creates a new Whisper engine instance.
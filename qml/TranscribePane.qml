@@ -31,7 +31,14 @@ Item {
                 model: [
                     qsTr("Microphone")
                     , qsTr("File")
+                    , qsTr("Batch")
                 ]
+                currentIndex: appEngine.transcribeSource
+
+                onCurrentIndexChanged: {
+                    if (currentIndex !== appEngine.transcribeSource)
+                        appEngine.transcribeSource = currentIndex
+                }
             }
 
             ComboBox {
@@ -61,6 +68,41 @@ Item {
                 }
             }
 
+            Button {
+                Layout.fillWidth: true
+                text: qsTr("Add Audio Files...")
+                visible: inputSource.currentIndex === AppEngine.Batch
+                enabled: root.canChangeSettings
+
+                onClicked: {
+                    batchFilesDialog.open()
+                }
+            }
+
+            Button {
+                text: qsTr("Output Folder...")
+                visible: inputSource.currentIndex === AppEngine.Batch
+                enabled: root.canChangeSettings
+                ToolTip.visible: hovered
+                ToolTip.text: appEngine.batchOutputFolder.toString() !== ""
+                              ? appEngine.batchOutputFolder.toString()
+                              : qsTr("Next to each audio file")
+
+                onClicked: {
+                    batchOutputDialog.open()
+                }
+            }
+
+            Button {
+                text: qsTr("Clear")
+                visible: inputSource.currentIndex === AppEngine.Batch
+                enabled: root.canChangeSettings && appEngine.batchJobs.count > 0
+
+                onClicked: {
+                    appEngine.batchJobs.clear()
+                }
+            }
+
 
             Label {
                 text: qsTr("Language")
@@ -324,6 +366,13 @@ Item {
                     case AppEngine.File:
                         appEngine.transcribeFile()
                         break;
+                    case AppEngine.Batch:
+                        if (appEngine.canStop) {
+                            appEngine.cancelBatch()
+                        } else if (appEngine.canStart) {
+                            appEngine.transcribeBatch()
+                        }
+                        break;
                 }
             }
         }
@@ -342,6 +391,42 @@ Item {
         //     }
         // }
 
+        // Files in the batch, with their progress
+        ListView {
+            Layout.fillWidth: true
+            Layout.preferredHeight: Math.min(contentHeight, 160)
+            visible: inputSource.currentIndex === AppEngine.Batch
+            clip: true
+            model: appEngine.batchJobs
+
+            delegate: RowLayout {
+                required property string name
+                required property string statusText
+                required property string path
+                width: ListView.view.width
+                spacing: 8
+
+                Label {
+                    Layout.fillWidth: true
+                    text: name
+                    elide: Text.ElideMiddle
+                    ToolTip.visible: nameArea.containsMouse
+                    ToolTip.text: path
+
+                    MouseArea {
+                        id: nameArea
+                        anchors.fill: parent
+                        hoverEnabled: true
+                    }
+                }
+
+                Label {
+                    text: statusText
+                    opacity: 0.7
+                }
+            }
+        }
+
         MessagesView {
             Layout.fillWidth: true
             Layout.fillHeight: true
@@ -354,6 +439,7 @@ Item {
             Button {
                 text: qsTr("Save Audio")
                 enabled: appEngine.state == AppEngine.Done
+                         && inputSource.currentIndex !== AppEngine.Batch
 
                 onClicked: {
                     saveAudioDialog.open()
@@ -391,7 +477,7 @@ Item {
         id: srcFileDialog
         title: qsTr("Select Audio File")
         fileMode: FileDialog.ExistingFile
-        nameFilters: ["Audio Files (*.wav *.mp3 *.flac *.m4a)", "All Files (*)"]
+        nameFilters: ["Audio Files (*.wav *.mp3 *.flac *.m4a *.pcm *.raw)", "All Files (*)"]
 
         onAccepted: {
             console.log("Selected audio file:", selectedFile)
@@ -399,4 +485,24 @@ Item {
             appEngine.setInputAudioFile(selectedFile)
         }
     }
+
+    FileDialog {
+        id: batchFilesDialog
+        title: qsTr("Add Audio Files")
+        fileMode: FileDialog.OpenFiles
+        nameFilters: srcFileDialog.nameFilters
+
+        onAccepted: {
+            appEngine.batchJobs.addFiles(selectedFiles)
+        }
+    }
+
+    FolderDialog {
+        id: batchOutputDialog
+        title: qsTr("Select Output Folder")
+
+        onAccepted: {
+            appEngine.batchOutputFolder = selectedFolder
+        }
+    }
 }
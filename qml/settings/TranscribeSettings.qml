@@ -21,7 +21,22 @@ ScrollView {
         return Number.isFinite(parsed) ? parsed : fallback
     }
 
+    // Whisper decoding presets, from fastest to most accurate
+    readonly property var decodingPresets: ["live-fast", "balanced", "archival-accurate"]
+    readonly property var decodingPresetNames: [
+        qsTr("Live, fast"),
+        qsTr("Balanced"),
+        qsTr("Archival, accurate")
+    ]
+
+    function presetIndex(name, fallback) {
+        const ix = decodingPresets.indexOf(name)
+        return ix >= 0 ? ix : decodingPresets.indexOf(fallback)
+    }
+
     function commit() {
+        settings.setValue("transcribe.live.preset", decodingPresets[livePreset.currentIndex])
+        settings.setValue("transcribe.post.preset", decodingPresets[postPreset.currentIndex])
         settings.setValue("transcribe.vad.enabled", vadEnabled.checked)
         settings.setValue("transcribe.vad.speech_margin_db", numberOrDefault(vadSpeechMargin.text, 10.0))
         settings.setValue("transcribe.vad.min_speech_ms", intOrDefault(vadMinSpeechMs.text, 120))
@@ -32,6 +47,8 @@ ScrollView {
         settings.setValue("transcribe.vad.postroll_ms", intOrDefault(vadPostrollMs.text, 180))
         settings.setValue("transcribe.live.max_latency_ms", intOrDefault(liveMaxLatencyMs.text, 1500))
         settings.setValue("transcribe.post.skip_silence", postSkipSilence.checked)
+        settings.setValue("transcribe.post.selective", postSelective.checked)
+        settings.setValue("transcribe.post.selective.min_avg_logprob", numberOrDefault(postSelectiveMinLogprob.text, -1.0))
         settings.sync()
     }
 
@@ -102,6 +119,22 @@ ScrollView {
             text: settings.value("transcribe.vad.postroll_ms", 180).toString()
         }
 
+        Label { text: qsTr("Live decoding")}
+        ComboBox {
+            id: livePreset
+            Layout.fillWidth: true
+            model: root.decodingPresetNames
+            currentIndex: root.presetIndex(settings.value("transcribe.live.preset", "live-fast"), "live-fast")
+        }
+
+        Label { text: qsTr("Post decoding")}
+        ComboBox {
+            id: postPreset
+            Layout.fillWidth: true
+            model: root.decodingPresetNames
+            currentIndex: root.presetIndex(settings.value("transcribe.post.preset", "balanced"), "balanced")
+        }
+
         Label { text: qsTr("Live max latency (ms)")}
         TextField {
             id: liveMaxLatencyMs
@@ -116,6 +149,21 @@ ScrollView {
             checked: settings.value("transcribe.post.skip_silence", true)
         }
 
+        Item {}
+        CheckBox {
+            id: postSelective
+            text: qsTr("Only re-transcribe uncertain parts of the live transcript")
+            checked: settings.value("transcribe.post.selective", false)
+        }
+
+        Label { text: qsTr("Min avg log-probability")}
+        TextField {
+            id: postSelectiveMinLogprob
+            Layout.fillWidth: true
+            enabled: postSelective.checked
+            text: settings.value("transcribe.post.selective.min_avg_logprob", -1.0).toString()
+        }
+
         Item {
             Layout.fillHeight: true
         }
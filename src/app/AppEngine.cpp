@@ -1,7 +1,9 @@
 
+#include <algorithm>
 #include <array>
 #include <format>
 #include <ranges>
+#include <optional>
 
 #include <QStringLiteral>
 #include <QDir>
@@ -12,6 +14,7 @@
 #include <QClipboard>
 #include <QGuiApplication>
 #include <QTextStream>
+#include <QSaveFile>
 
 #include "AppEngine.h"
 #include "AudioRecorder.h"
@@ -22,6 +25,8 @@
 #include "ChatConversation.h"
 #include "ScopedTimer.h"
 #include "AudioImport.h"
+#include "BatchJobsModel.h"
+#include "DocumentChunker.h"
 
 #include "logging.h"
 
@@ -111,24 +116,43 @@ TARGET LANGUAGE:
 %1
 )";
 
+// The user text of a chunk that continues an earlier one
+constexpr string_view document_chunk_prompt =
+    R"(The text below continues an earlier part of the same document. The end of the earlier part is included for context only.
+
+Earlier part (do NOT include it in the output):
+%1
+
+Text:
+%2)";
+
+constexpr string_view consolidate_document_prompt =
+    R"(You are an editor.
+
+The document below was processed in parts, separated by blank lines.
+Where two parts meet, a sentence may be repeated, cut off, or not connect well.
+
+Your task:
+- Fix the transitions between the parts, so the document reads as one text.
+- Remove sentences that are repeated where two parts meet.
+- Do NOT change anything else. Keep the language, wording, tone, and formatting.
+
+Output ONLY the document.)";
+
+// Stands for the user text when the formatted prompt is split around it
+constexpr string_view document_marker = "@@QVW_DOCUMENT@@";
+
 
 #include <QFile>
 #include <QDataStream>
 #include <QtEndian>
 
-static bool writeWavFromRawPcm16(
-    const QString& pcmPath,
+static bool writeWavPcm16(
+    const QByteArray& pcm,
     const QString& wavPath,
     int sampleRate = 16000,
     int channels = 1
     ) {
-    QFile in(pcmPath);
-    if (!in.open(QIODevice::ReadOnly))
-        return false;
-
-    const QByteArray pcm = in.readAll();
-    in.close();
-
     const quint16 bitsPerSample = 16;
     const quint16 blockAlign = channels * (bitsPerSample / 8);
     const quint32 byteRate = sampleRate * blockAlign;
@@ -181,6 +205,37 @@ static bool writeWavFromRawPcm16(
     return out.flush();
 }
 
+static bool writeWavFromRawPcm16(
+    const QString& pcmPath,
+    const QString& wavPath,
+    int sampleRate = 16000,
+    int channels = 1
+    ) {
+    QFile in(pcmPath);
+    if (!in.open(QIODevice::ReadOnly))
+        return false;
+
+    const QByteArray pcm = in.readAll();
+    in.close();
+
+    return writeWavPcm16(pcm, wavPath, sampleRate, channels);
+}
+
+static bool writeWavFromFloat(
+    std::span<const float> samples,
+    const QString& wavPath,
+    int sampleRate = 16000
+    ) {
+    QByteArray pcm;
+    pcm.resize(static_cast<qsizetype>(samples.size() * sizeof(int16_t)));
+    auto *dst = reinterpret_cast<int16_t *>(pcm.data());
+    for (size_t i = 0; i < samples.size(); ++i) {
+        dst[i] = static_cast<int16_t>(std::lrint(std::clamp(samples[i], -1.0f, 1.0f) * 32767.0f));
+    }
+
+    return writeWavPcm16(pcm, wavPath, sampleRate, 1);
+}
+
 
 template <typename T>
 constexpr bool is_one_of(T value, std::initializer_list<T> list)
@@ -229,7 +284,8 @@ std::ostream& operator << (std::ostream& os, AppEngine::Mode mode) {
 std::ostream& operator << (std::ostream& os, AppEngine::TranscribeSource source) {
     constexpr auto sources = to_array<string_view>({
         "Mic",
-        "File"
+        "File",
+        "Batch"
     });
     return os << sources.at(static_cast<size_t>(source));
 }
@@ -285,7 +341,8 @@ void AppEngine::prepareForTranscribe()
         startPrepareForRecording();
     }
 
-    if (transcribe_source_ == TranscribeSource::File) {
+    if (transcribe_source_ == TranscribeSource::File
+        || transcribe_source_ == TranscribeSource::Batch) {
         startPrepareForTranscribeFile();
     }
 }
@@ -364,10 +421,30 @@ QCoro::Task<bool> AppEngine::sendChatPrompt(QString prompt)
 
     assert(current_conversation);
     current_conversation->addMessage(make_shared<ChatMessage>(PromptRole::User, prompt.toStdString()));
-    auto formatted_prompt = chat_model_->modelInfo().formatPrompt(chat_conversation_->getLastMessageAsView()); //getMessages());
 
     setState(State::Processing);
 
+    // The chat session holds the KV cache of one conversation. If that is another
+    // conversation, restore the snapshot of this one, or replay it from the start.
+    auto params = qvw::LlamaSessionCtx::Params::Chat(true);
+    auto messages = current_conversation->getLastMessageAsView();
+    vector<const ChatMessage *> history;
+    if (chat_session_conversation_ != current_conversation->id()) {
+        const auto& snapshot = current_conversation->kvSnapshot();
+        if (!snapshot.isEmpty() && co_await chat_model_->loadState(snapshot)) {
+            LOG_DEBUG_N << "Resumed chat conversation " << current_conversation->name()
+                        << " from its KV snapshot " << snapshot;
+        } else {
+            history = current_conversation->getMessages();
+            messages = history;
+            params.continue_conversation = false;
+            LOG_DEBUG_N << "Replaying " << history.size() << " messages of chat conversation "
+                        << current_conversation->name();
+        }
+        chat_session_conversation_ = current_conversation->id();
+    }
+    auto formatted_prompt = chat_model_->modelInfo().formatPrompt(messages);
+
     // Handle partial updates
     auto msg = make_shared<ChatMessage>(PromptRole::Assistant, "");
     msg->model_used = chat_model_->modelInfo().id;
@@ -380,11 +457,9 @@ QCoro::Task<bool> AppEngine::sendChatPrompt(QString prompt)
         }
     });
 
-    // TODO: Handle replay of the full conversation if we resumed an existing one from storage.
     // Conversation continuation is handled by the model context params.
     ScopedTimer timer;
-    auto result = co_await chat_model_->prompt(std::move(formatted_prompt),
-                                               qvw::LlamaSessionCtx::Params::Chat(true));
+    auto result = co_await chat_model_->prompt(std::move(formatted_prompt), params);
     msg->duration_seconds = timer.elapsed();
     assert(current_conversation);
     assert(chat_model_);
@@ -397,6 +472,19 @@ QCoro::Task<bool> AppEngine::sendChatPrompt(QString prompt)
     current_conversation->updateLastMessage(chat_model_->finalText());
     current_conversation->finalizeLastMessage();
     setState(State::Ready);
+
+    if (!result) {
+        // We don't know what the session holds now. Replay the conversation next time.
+        chat_session_conversation_.clear();
+        discardChatSnapshot(*current_conversation);
+    } else if (QSettings{}.value("chat.kv_snapshots", true).toBool()) {
+        // Written in the model's thread while the UI is ready for the next prompt
+        const auto path = chatSnapshotPath(*current_conversation);
+        if (!path.isEmpty() && co_await chat_model_->saveState(path)) {
+            current_conversation->setKvSnapshot(path);
+        }
+    }
+
     co_return result;
 }
 
@@ -533,6 +621,9 @@ void AppEngine::reset()
 void AppEngine::startChatConversation(const QString &name)
 {
     LOG_INFO_N << "Starting chat conversation: " << name.toStdString();
+    if (chat_conversation_) {
+        discardChatSnapshot(*chat_conversation_);
+    }
     chat_conversation_ = make_shared<ChatConversation>(name);
     chat_conversation_->setModel(&chat_messages_model_);
     chat_conversation_->addMessage(make_shared<ChatMessage>(PromptRole::System, getChatSystemPrompt()));
@@ -670,8 +761,51 @@ void AppEngine::transcribeFile()
     startTransribeFile(transcribe_from_file_path_);
 }
 
+void AppEngine::transcribeBatch()
+{
+    if (!canStart()) {
+        LOG_WARN_N << "Cannot start batch transcription in current state";
+        return;
+    }
+    runBatch();
+}
+
+void AppEngine::cancelBatch()
+{
+    LOG_INFO_N << "Cancelling batch transcription after the files in progress";
+    batch_cancel_ = true;
+}
+
+QUrl AppEngine::batchOutputFolder() const
+{
+    return batch_output_folder_.isEmpty() ? QUrl{} : QUrl::fromLocalFile(batch_output_folder_);
+}
+
+void AppEngine::setBatchOutputFolder(const QUrl &folder)
+{
+    const auto path = folder.toLocalFile();
+    if (path != batch_output_folder_) {
+        batch_output_folder_ = path;
+        QSettings{}.setValue("transcribe.batch.output_folder", path);
+        emit batchOutputFolderChanged();
+    }
+}
+
 void AppEngine::saveAudioToFile(const QUrl &path)
 {
+    if (transcribe_source_ == TranscribeSource::File && imported_pcm_) {
+        const auto local_path = path.toLocalFile();
+        if (local_path.isEmpty()) {
+            failed(tr("No output path selected."));
+            return;
+        }
+        LOG_INFO_N << "Saving imported audio to: " << local_path;
+        if (!writeWavFromFloat(*imported_pcm_, local_path)) {
+            failed(tr("Failed to save WAV file to: %1").arg(local_path));
+        }
+        return;
+    }
+
     // Check if PCM file exists pcm_file_path_
     if (!QFile::exists(pcm_file_path_)) {
         LOG_WARN_N << "No recorded PCM file to save. Expected \"" << pcm_file_path_
@@ -736,6 +870,10 @@ AppEngine::AppEngine() {
         transcribe_post_model_name_ = lookup_name(settings.value("transcribe.post-model", "base").toString(), ModelKind::WHISPER);
     }
 
+    batch_output_folder_ = settings.value("transcribe.batch.output_folder", "").toString();
+
+    connect(&batch_jobs_, &BatchJobsModel::countChanged, this, &AppEngine::stateFlagsChanged);
+
     const QString baseDir =
         QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
     QDir().mkpath(baseDir);
@@ -802,6 +940,7 @@ AppEngine::AppEngine() {
             this,
             &AppEngine::stateFlagsChanged);
 
+    removeStaleChatSnapshots();
 }
 
 QStringList AppEngine::microphones() const
@@ -864,6 +1003,14 @@ bool AppEngine::canPrepareForTranscribe() const
         }
     }
 
+    if (transcribe_source_ == TranscribeSource::Batch) {
+        // Batches are transcribed by the post transcriber
+        if (batch_jobs_.count() == 0 || !post_transcribe_models_.hasSelection()) {
+            LOG_TRACE_N << "No batch files or no post transcription model";
+            return false;
+        }
+    }
+
     return state() == State::Idle && have_selection;
 }
 
@@ -1052,6 +1199,7 @@ QCoro::Task<void> AppEngine::startPrepareForChat(QString id)
     }
 
     assert(mi);
+    chat_session_conversation_.clear();
     if (chat_model_ = co_await prepareGeneralModel(
         "chat-model",
         *mi,
@@ -1308,43 +1456,28 @@ QCoro::Task<void> AppEngine::startTransribeFile(const QString &path)
 
     setState(State::Processing, tr("Decoding audio file..."));
 
-    AudioImport import;
-
-    if (!co_await import.decodeMediaFile(path)) {
-        failed(tr("Failed to decode audio file"));
-        LOG_ERROR_N << "Failed to decode audio file: " << path.toStdString()
-                    << ": " << import.errorMessage();
-        co_return;
-    }
-
-    // TODO: Pass the imported format to the transcribers directly instead of
-    //       converting to the PCM format used by live recording.
-    const auto in = import.mono16kData();
+    // Decoded audio and transcripts are cached by the content of the file
+    recording_audio_key_ = co_await transcript_cache_.audioKey(path);
+    imported_pcm_ = co_await transcript_cache_.loadPcm(recording_audio_key_);
 
-    std::vector<int16_t> out;
-    out.reserve(in.size());
+    if (!imported_pcm_) {
+        AudioImport import;
 
-    for (float s : in) {
-        // clamp to [-1, 1]
-        if (s > 1.0f) s = 1.0f;
-        if (s < -1.0f) s = -1.0f;
+        if (!co_await import.decodeMediaFile(path)) {
+            failed(tr("Failed to decode audio file"));
+            LOG_ERROR_N << "Failed to decode audio file: " << path.toStdString()
+                        << ": " << import.errorMessage();
+            co_return;
+        }
 
-        // scale (use 32767 for symmetric range)
-        const int v = int(std::lrint(s * 32767.0f));
-        out.push_back(int16_t(std::clamp(v, -32768, 32767)));
+        imported_pcm_ = import.takeMono16kData();
+        transcript_cache_.storePcm(recording_audio_key_, imported_pcm_);
     }
 
-    QFile f(pcm_file_path_);
-    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
-        failed(tr("Cannot open temporary PCM file: %1").arg(pcm_file_path_));
-        co_return;
+    // The decoded buffer goes straight to the transcriber. No PCM file round trip.
+    if (post_transcriber_ && imported_pcm_) {
+        post_transcriber_->setRecordingSource({std::span<const float>(*imported_pcm_), imported_pcm_});
     }
-    const auto bytes = qint64(out.size() * sizeof(int16_t));
-    if (f.write(reinterpret_cast<const char*>(out.data()), bytes) != bytes || !f.flush()) {
-        failed(tr("Failed to write decoded PCM data to: %1").arg(pcm_file_path_));
-        co_return;
-    }
-    f.close();
 
     setStateText(tr("Transcribing audio file..."));
     co_await onRecordingDone();
@@ -1458,6 +1591,7 @@ QCoro::Task<void> AppEngine::onRecordingDone()
     LOG_DEBUG_N << "Recording done, starting post-processing transcription if needed";
 
     QString final_text;
+    Transcriber::scored_segments_t live_segments;
     // Each step adds their own agent messages to the conversation.
 
     setState(State::Processing, tr("Starting post-processing..."));
@@ -1474,17 +1608,16 @@ QCoro::Task<void> AppEngine::onRecordingDone()
         }
 
         co_await rec_transcriber_->stop();
+        live_segments = rec_transcriber_->scoredSegments();
         rec_transcriber_.reset();
     }
 
     if (post_transcriber_) {
         setStateText(tr("Running post-processing transcription..."));
         assert(post_transcriber_->haveModel());
-        if (!post_transcriber_->isLoaded()) {
-            co_await post_transcriber_->loadModel();
-        }
 
         post_transcriber_->setVocabulary(transcribe_vocabulary_.toStdString());
+        post_transcriber_->setPriorSegments(std::move(live_segments));
 
         auto msg = make_shared<ChatMessage>(PromptRole::Assistant, "",
                                             false,
@@ -1492,14 +1625,37 @@ QCoro::Task<void> AppEngine::onRecordingDone()
         msg->model_used = post_transcriber_->modelInfo().id;
         transcribe_conversation_->addMessage(msg);
         ScopedTimer timer;
-        if (!co_await post_transcriber_->transcribeRecording()) {
-            failed(tr("Post-processing transcription failed"));
-            co_return;
+
+        // Only files have a cache key. Recordings are never the same twice.
+        const auto cache_key = TranscriptCache::transcriptKey(recording_audio_key_,
+                                                              post_transcriber_->modelInfo().id,
+                                                              post_transcriber_->recordingSignature());
+        if (auto cached = co_await transcript_cache_.loadTranscript(cache_key)) {
+            LOG_INFO_N << "Using cached transcript with " << cached->segments.size() << " segments";
+            final_text = QString::fromStdString(cached->text);
+        } else {
+            if (!post_transcriber_->isLoaded()) {
+                co_await post_transcriber_->loadModel();
+            }
+
+            const auto progress = connect(post_transcriber_.get(), &Model::progressChanged,
+                                          this, [this](int percent) {
+                setStateText(tr("Running post-processing transcription... %1%").arg(percent));
+            });
+            const auto ok = co_await post_transcriber_->transcribeRecording();
+            disconnect(progress);
+            if (!ok) {
+                failed(tr("Post-processing transcription failed"));
+                co_return;
+            }
+
+            final_text = QString::fromStdString(post_transcriber_->finalText());
+            transcript_cache_.storeTranscript(cache_key, {post_transcriber_->finalText(),
+                                                          post_transcriber_->recordingLanguage(),
+                                                          post_transcriber_->recordingSegments()});
         }
         msg->duration_seconds = timer.elapsed();
 
-        final_text = QString::fromStdString(post_transcriber_->finalText());
-
         transcribe_conversation_->updateLastMessage(final_text.toStdString());
         transcribe_conversation_->finalizeLastMessage();
     }
@@ -1521,24 +1677,6 @@ QCoro::Task<void> AppEngine::onRecordingDone()
 
         setStateText(tr("Rewriting document..."));
 
-        string formatted_prompt;
-        {
-            string fromLng;
-            if (auto lngix = languageIndex(); lngix > 0) {
-                fromLng = languageList_.at(size_t(language_index_)).name.toStdString();
-            }
-            const auto prompt = rewrite_style_.makePrompt(fromLng, transcribe_vocabulary_);
-
-            const array<ChatMessage, 2> msgs = {ChatMessage{PromptRole::System, prompt.toStdString()},
-                                          {PromptRole::User, final_text.toStdString()}};
-
-            array<const ChatMessage*, 2> message_ptrs = {&msgs[0], &msgs[1]};
-
-            formatted_prompt = doc_prepare_model_->modelInfo().formatPrompt(message_ptrs);
-
-            LOG_TRACE_N << "Document rewrite formatted prompt: " << formatted_prompt;
-        }
-
         auto msg = make_shared<ChatMessage>(PromptRole::Assistant, "",
                                             false,
                                             tr("Rewrite").toStdString());
@@ -1546,15 +1684,14 @@ QCoro::Task<void> AppEngine::onRecordingDone()
         transcribe_conversation_->addMessage(msg);
         ScopedTimer timer;
 
-        auto result = co_await doc_prepare_model_->prompt(std::move(formatted_prompt),
-                                                          qvw::LlamaSessionCtx::Params::Balanced());
+        auto result = co_await promptDocument(DocStage::Rewrite, final_text);
 
         if (!result) {
             failed("Rewrite failed.");
             co_return;
         }
 
-        final_text = QString::fromStdString(doc_prepare_model_->finalText());
+        final_text = std::move(*result);
 
         msg->duration_seconds = timer.elapsed();
         transcribe_conversation_->updateLastMessage(final_text.toStdString());
@@ -1578,28 +1715,13 @@ QCoro::Task<void> AppEngine::onRecordingDone()
 
         setStateText(tr("Translating..."));
 
-        string formatted_prompt;
-        {
-            const auto prompt = QString::fromUtf8(translate_document_prompt)
-                                     .arg(doc_translate_languages_model_.selectedName());
-            const array<ChatMessage, 2> msgs = {ChatMessage{PromptRole::System, prompt.toStdString()},
-                                                {PromptRole::User, final_text.toStdString()}};
-
-            array<const ChatMessage*, 2> message_ptrs = {&msgs[0], &msgs[1]};
-
-            formatted_prompt = doc_translate_model_->modelInfo().formatPrompt(message_ptrs);
-
-            LOG_TRACE_N << "Document rewrite formatted prompt: " << formatted_prompt;
-        }
-
         auto msg = make_shared<ChatMessage>(PromptRole::Assistant, "",
                                             false,
                                             tr("Translate").toStdString());
         msg->model_used = doc_translate_model_->modelInfo().id;
         transcribe_conversation_->addMessage(msg);
         ScopedTimer timer;
-        auto result = co_await doc_translate_model_->prompt(std::move(formatted_prompt),
-                                                          qvw::LlamaSessionCtx::Params::TranslateStrict());
+        auto result = co_await promptDocument(DocStage::Translate, final_text);
         msg->duration_seconds = timer.elapsed();
 
         if (!result) {
@@ -1607,7 +1729,7 @@ QCoro::Task<void> AppEngine::onRecordingDone()
             co_return;
         }
 
-        final_text = QString::fromStdString(doc_translate_model_->finalText());
+        final_text = std::move(*result);
 
         transcribe_conversation_->updateLastMessage(final_text.toStdString());
         transcribe_conversation_->finalizeLastMessage();
@@ -1626,6 +1748,463 @@ QCoro::Task<void> AppEngine::onRecordingDone()
     setState(State::Done);
 }
 
+std::string AppEngine::makeRewritePrompt(const QString &text) const
+{
+    assert(doc_prepare_model_);
+    string fromLng;
+    if (auto lngix = languageIndex(); lngix > 0) {
+        fromLng = languageList_.at(size_t(language_index_)).name.toStdString();
+    }
+    const auto prompt = rewrite_style_.makePrompt(fromLng, transcribe_vocabulary_);
+
+    const array<ChatMessage, 2> msgs = {ChatMessage{PromptRole::System, prompt.toStdString()},
+                                        {PromptRole::User, text.toStdString()}};
+
+    array<const ChatMessage*, 2> message_ptrs = {&msgs[0], &msgs[1]};
+
+    auto formatted_prompt = doc_prepare_model_->modelInfo().formatPrompt(message_ptrs);
+
+    LOG_TRACE_N << "Document rewrite formatted prompt: " << formatted_prompt;
+    return formatted_prompt;
+}
+
+std::string AppEngine::makeTranslatePrompt(const QString &text) const
+{
+    assert(doc_translate_model_);
+    const auto prompt = QString::fromUtf8(translate_document_prompt)
+                            .arg(doc_translate_languages_model_.selectedName());
+    const array<ChatMessage, 2> msgs = {ChatMessage{PromptRole::System, prompt.toStdString()},
+                                        {PromptRole::User, text.toStdString()}};
+
+    array<const ChatMessage*, 2> message_ptrs = {&msgs[0], &msgs[1]};
+
+    auto formatted_prompt = doc_translate_model_->modelInfo().formatPrompt(message_ptrs);
+
+    LOG_TRACE_N << "Document translate formatted prompt: " << formatted_prompt;
+    return formatted_prompt;
+}
+
+QCoro::Task<std::optional<QString>> AppEngine::promptDocument(DocStage stage, QString text)
+{
+    const bool rewrite = stage == DocStage::Rewrite;
+    auto model = rewrite ? doc_prepare_model_ : doc_translate_model_;
+    assert(model);
+    const auto params = rewrite ? qvw::LlamaSessionCtx::Params::Rewrite()
+                                : qvw::LlamaSessionCtx::Params::TranslateStrict();
+    const auto makePrompt = [this, rewrite](const QString& userText) {
+        return rewrite ? makeRewritePrompt(userText) : makeTranslatePrompt(userText);
+    };
+
+    DocumentChunker chunker;
+    chunker.fitContext(model->maxContextTokens());
+    const auto formatted = makePrompt(QString::fromUtf8(document_marker));
+    const auto at = formatted.find(document_marker);
+    vector<DocumentChunker::Chunk> chunks;
+    if (!chunker.needsChunking(text) || at == string::npos) {
+        if (at == string::npos) {
+            LOG_WARN_N << "Cannot find the document in the prompt for " << model->modelInfo().id
+                       << ". Processing it in one piece.";
+        }
+        const bool ok = co_await model->prompt(makePrompt(text), params);
+        if (ok && !model->truncated()) {
+            co_return QString::fromStdString(model->finalText());
+        }
+
+        // Too large for the memory, or the output was cut short. Try smaller pieces.
+        chunks = chunker.split(DocumentChunker::Chunk{.text = text});
+        if (at == string::npos || chunks.size() < 2) {
+            LOG_WARN_N << (ok ? "The output was cut short" : "Failed") << " processing a document of "
+                       << text.size() << " characters with " << model->modelInfo().id;
+            co_return nullopt;
+        }
+    } else {
+        chunks = chunker.split(text);
+    }
+
+    // The chunks share everything before the user text, like the system prompt
+    auto prefix = formatted.substr(0, at);
+    auto tail = formatted.substr(at + document_marker.size());
+    LOG_INFO_N << "Processing a document of " << text.size() << " characters in " << chunks.size()
+               << " chunks, " << chunker.parallel() << " at a time, with " << model->modelInfo().id;
+
+    const auto parts = co_await promptChunks(stage, std::move(prefix), std::move(tail), chunks, chunker);
+    if (!parts) {
+        co_return nullopt;
+    }
+
+    auto stitched = DocumentChunker::stitch(chunks, *parts);
+    if (!chunker.consolidate()) {
+        co_return stitched;
+    }
+
+    if (!chunker.canConsolidate(stitched)) {
+        LOG_INFO_N << "Skipping the consolidation pass. The document is too large ("
+                   << stitched.size() << " characters).";
+        co_return stitched;
+    }
+
+    setStateText(tr("Consolidating the document..."));
+    const array<ChatMessage, 2> msgs = {ChatMessage{PromptRole::System, string{consolidate_document_prompt}},
+                                        {PromptRole::User, stitched.toStdString()}};
+    array<const ChatMessage*, 2> message_ptrs = {&msgs[0], &msgs[1]};
+    if (!co_await model->prompt(model->modelInfo().formatPrompt(message_ptrs),
+                                qvw::LlamaSessionCtx::Params::Rewrite())) {
+        LOG_WARN_N << "The consolidation pass failed. Using the stitched document.";
+        co_return stitched;
+    }
+    co_return QString::fromStdString(model->finalText());
+}
+
+QCoro::Task<std::optional<QStringList>> AppEngine::promptChunks(DocStage stage, std::string prefix, std::string tail,
+                                                                std::vector<DocumentChunker::Chunk> chunks,
+                                                                DocumentChunker chunker, int depth)
+{
+    // Each split about halves the chunks
+    constexpr int max_splits = 3;
+
+    const bool rewrite = stage == DocStage::Rewrite;
+    auto model = rewrite ? doc_prepare_model_ : doc_translate_model_;
+    assert(model);
+    const auto params = rewrite ? qvw::LlamaSessionCtx::Params::Rewrite()
+                                : qvw::LlamaSessionCtx::Params::TranslateStrict();
+
+    QStringList parts;
+    const auto count = static_cast<int>(chunks.size());
+    for (int first = 0; first < count; first += chunker.parallel()) {
+        const auto last = std::min(count, first + chunker.parallel());
+        if (depth == 0) {
+            setStateText(tr("Processing part %1-%2 of %3...").arg(first + 1).arg(last).arg(count));
+        }
+
+        vector<string> suffixes;
+        for (int i = first; i < last; ++i) {
+            const auto& chunk = chunks[static_cast<size_t>(i)];
+            const auto user_text = chunk.context.isEmpty()
+                ? chunk.text
+                : QString::fromUtf8(document_chunk_prompt).arg(chunk.context, chunk.text);
+            suffixes.push_back(user_text.toStdString() + tail);
+        }
+
+        const auto results = co_await model->promptFanOut(prefix, std::move(suffixes), params);
+        const bool group_failed = results.size() != last - first;
+        const auto truncated = model->truncatedSequences();
+        for (int i = first; i < last; ++i) {
+            const auto ix = static_cast<size_t>(i - first);
+            if (!group_failed && !std::ranges::binary_search(truncated, ix)) {
+                parts.append(results[i - first]);
+                continue;
+            }
+
+            auto smaller = chunker.split(chunks[static_cast<size_t>(i)]);
+            if (depth >= max_splits || smaller.size() < 2) {
+                LOG_WARN_N << (group_failed ? "Failed" : "The output was cut short") << " processing chunk "
+                           << i << " of " << count << " of the document, at split depth " << depth;
+                co_return nullopt;
+            }
+
+            LOG_INFO_N << (group_failed ? "Failed" : "The output was cut short") << " processing chunk "
+                       << i << " of " << count << ". Trying again in " << smaller.size() << " smaller chunks.";
+            const auto sub = co_await promptChunks(stage, prefix, tail, smaller, chunker, depth + 1);
+            if (!sub) {
+                co_return nullopt;
+            }
+            parts.append(DocumentChunker::stitch(smaller, *sub));
+        }
+    }
+
+    co_return parts;
+}
+
+QCoro::Task<void> AppEngine::runBatch()
+{
+    const int count = batch_jobs_.count();
+    LOG_INFO_N << "Starting batch transcription of " << count << " files";
+
+    if (!post_transcriber_) {
+        failed(tr("Batch transcription needs a transcription model"));
+        co_return;
+    }
+
+    batch_cancel_ = false;
+    batch_jobs_.resetStatus();
+    batch_started_.assign(static_cast<size_t>(count), {});
+    setState(State::Processing, tr("Loading models..."));
+
+    // Load everything up front. The models stay loaded for the whole batch.
+    if (!post_transcriber_->isLoaded() && !co_await post_transcriber_->loadModel()) {
+        failed(tr("Failed to load the transcription model"));
+        co_return;
+    }
+    post_transcriber_->setVocabulary(transcribe_vocabulary_.toStdString());
+    post_transcriber_->setPriorSegments({});
+
+    for (auto *model : {doc_prepare_model_.get(), doc_translate_model_.get()}) {
+        if (!model) {
+            continue;
+        }
+        if (!model->isLoaded() && !co_await model->loadModel()) {
+            failed(tr("Failed to load model: %1").arg(QString::fromUtf8(model->modelInfo().id)));
+            co_return;
+        }
+        model->setVocabulary(transcribe_vocabulary_.toStdString());
+    }
+
+    // Three stage pipeline. In each step file N+1 is decoded (thread-pool) while
+    // Whisper transcribes file N and the LLM post-processes file N-1, each on the
+    // worker thread of its model. A step takes as long as its slowest stage.
+    const ScopedTimer wall;
+    BatchDecoded decoded;
+    BatchTranscribed transcribed;
+    for (int step = 0; step < count + 2; ++step) {
+        if (batch_cancel_) {
+            LOG_INFO_N << "Batch transcription cancelled";
+            break;
+        }
+
+        setStateText(tr("Batch: %1 of %2 files done").arg(step < 2 ? 0 : step - 2).arg(count));
+
+        optional<QCoro::Task<BatchDecoded>> decode;
+        optional<QCoro::Task<BatchTranscribed>> transcribe;
+        optional<QCoro::Task<void>> post_process;
+
+        // The tasks start running when they are called
+        if (step < count) {
+            decode = batchDecode(step);
+        }
+        if (decoded.row >= 0) {
+            transcribe = batchTranscribe(std::move(decoded));
+        }
+        if (transcribed.row >= 0) {
+            post_process = batchPostProcess(std::move(transcribed));
+        }
+
+        decoded = decode ? co_await std::move(*decode) : BatchDecoded{};
+        transcribed = transcribe ? co_await std::move(*transcribe) : BatchTranscribed{};
+        if (post_process) {
+            co_await std::move(*post_process);
+        }
+    }
+
+    // Put files that were in flight when cancelled back in the queue
+    for (const auto row : {decoded.row, transcribed.row}) {
+        if (row >= 0) {
+            batch_jobs_.setStatus(row, BatchJobsModel::Status::Queued);
+        }
+    }
+
+    int done = 0;
+    double audio_seconds = 0.0;
+    for (int row = 0; row < count; ++row) {
+        if (const auto& job = batch_jobs_.job(row); job.status == BatchJobsModel::Status::Done) {
+            ++done;
+            audio_seconds += job.audio_seconds;
+        }
+    }
+    const auto wall_seconds = wall.elapsed();
+    const auto speed = wall_seconds > 0.0 ? audio_seconds / wall_seconds : 0.0;
+    LOG_INFO_N << "Batch transcription done. " << done << " of " << count << " files, "
+               << (audio_seconds / 3600.0) << " hours of audio in " << (wall_seconds / 3600.0)
+               << " hours. Throughput: " << speed << " audio hours per wall hour.";
+
+    if (post_transcriber_->isLoaded()) {
+        co_await post_transcriber_->unloadModel();
+    }
+    for (auto *model : {&doc_prepare_model_, &doc_translate_model_}) {
+        if (*model) {
+            co_await (*model)->stop();
+            model->reset();
+        }
+    }
+
+    setState(State::Done, tr("Transcribed %1 of %2 files. %3 h audio in %4 h (%5 audio hours per hour)")
+                     .arg(done)
+                     .arg(count)
+                     .arg(audio_seconds / 3600.0, 0, 'f', 2)
+                     .arg(wall_seconds / 3600.0, 0, 'f', 2)
+                     .arg(speed, 0, 'f', 1));
+}
+
+QCoro::Task<AppEngine::BatchDecoded> AppEngine::batchDecode(int row)
+{
+    const auto path = batch_jobs_.job(row).path;
+    batch_started_.at(static_cast<size_t>(row)) = chrono::steady_clock::now();
+    batch_jobs_.setStatus(row, BatchJobsModel::Status::Decoding);
+
+    const ScopedTimer timer;
+    auto audio_key = co_await transcript_cache_.audioKey(path);
+
+    // No need to decode the file if it was transcribed before
+    const auto cache_key = TranscriptCache::transcriptKey(audio_key,
+                                                          post_transcriber_->modelInfo().id,
+                                                          post_transcriber_->recordingSignature());
+    if (auto cached = co_await transcript_cache_.loadTranscript(cache_key)) {
+        if (!cached->segments.empty()) {
+            batch_jobs_.setAudioSeconds(row, static_cast<double>(cached->segments.back().t1_ms) / 1000.0);
+        }
+        batch_jobs_.setStatus(row, BatchJobsModel::Status::Decoded);
+        co_return BatchDecoded{row, {}, std::move(audio_key), std::move(cached)};
+    }
+
+    auto pcm = co_await transcript_cache_.loadPcm(audio_key);
+    if (!pcm) {
+        AudioImport import;
+        if (!co_await import.decodeMediaFile(path)) {
+            LOG_WARN_N << "Failed to decode audio file: " << path << ": " << import.errorMessage();
+            batch_jobs_.setStatus(row, BatchJobsModel::Status::Failed, import.errorMessage());
+            co_return {};
+        }
+
+        pcm = import.takeMono16kData();
+        transcript_cache_.storePcm(audio_key, pcm);
+    }
+
+    if (!pcm || pcm->empty()) {
+        batch_jobs_.setStatus(row, BatchJobsModel::Status::Failed, tr("No audio in file"));
+        co_return {};
+    }
+
+    const auto audio_seconds = static_cast<double>(pcm->size()) / 16000.0;
+    LOG_DEBUG_N << "Decoded " << path << " (" << audio_seconds << " seconds of audio) in "
+                << timer.elapsed() << " seconds";
+    batch_jobs_.setAudioSeconds(row, audio_seconds);
+    batch_jobs_.setStatus(row, BatchJobsModel::Status::Decoded);
+    co_return BatchDecoded{row, std::move(pcm), std::move(audio_key), {}};
+}
+
+QCoro::Task<AppEngine::BatchTranscribed> AppEngine::batchTranscribe(BatchDecoded decoded)
+{
+    const int row = decoded.row;
+    batch_jobs_.setStatus(row, BatchJobsModel::Status::Transcribing);
+
+    const ScopedTimer timer;
+    QString text;
+    if (decoded.transcript) {
+        text = QString::fromStdString(decoded.transcript->text);
+    } else {
+        const auto cache_key = TranscriptCache::transcriptKey(decoded.audio_key,
+                                                              post_transcriber_->modelInfo().id,
+                                                              post_transcriber_->recordingSignature());
+        post_transcriber_->setRecordingSource({std::span<const float>(*decoded.pcm), decoded.pcm});
+        const auto ok = co_await post_transcriber_->transcribeRecording();
+        post_transcriber_->setRecordingSource({});
+        if (!ok) {
+            batch_jobs_.setStatus(row, BatchJobsModel::Status::Failed, tr("Transcription failed"));
+            co_return {};
+        }
+
+        text = QString::fromStdString(post_transcriber_->finalText());
+        transcript_cache_.storeTranscript(cache_key, {post_transcriber_->finalText(),
+                                                      post_transcriber_->recordingLanguage(),
+                                                      post_transcriber_->recordingSegments()});
+    }
+
+    const auto seconds = timer.elapsed();
+    LOG_DEBUG_N << "Transcribed " << batch_jobs_.job(row).path << " in " << seconds << " seconds";
+    addBatchMessage(row, tr("Transcript"), text, post_transcriber_->modelInfo().id, seconds);
+
+    batch_jobs_.setStatus(row, BatchJobsModel::Status::Transcribed);
+    co_return BatchTranscribed{row, std::move(text)};
+}
+
+QCoro::Task<void> AppEngine::batchPostProcess(BatchTranscribed transcribed)
+{
+    const int row = transcribed.row;
+    auto text = std::move(transcribed.text);
+
+    if (doc_prepare_model_ && !text.isEmpty()) {
+        batch_jobs_.setStatus(row, BatchJobsModel::Status::PostProcessing);
+        const ScopedTimer timer;
+        auto result = co_await promptDocument(DocStage::Rewrite, text);
+        if (!result) {
+            batch_jobs_.setStatus(row, BatchJobsModel::Status::Failed, tr("Rewrite failed"));
+            co_return;
+        }
+        text = std::move(*result);
+        addBatchMessage(row, tr("Rewrite"), text, doc_prepare_model_->modelInfo().id, timer.elapsed());
+    }
+
+    if (doc_translate_model_ && !text.isEmpty()) {
+        batch_jobs_.setStatus(row, BatchJobsModel::Status::PostProcessing);
+        const ScopedTimer timer;
+        auto result = co_await promptDocument(DocStage::Translate, text);
+        if (!result) {
+            batch_jobs_.setStatus(row, BatchJobsModel::Status::Failed, tr("Translation failed"));
+            co_return;
+        }
+        text = std::move(*result);
+        addBatchMessage(row, tr("Translate"), text, doc_translate_model_->modelInfo().id, timer.elapsed());
+    }
+
+    const auto output_path = batchOutputPath(batch_jobs_.job(row).path);
+    QSaveFile out{output_path};
+    const auto bytes = text.toUtf8();
+    if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)
+        || out.write(bytes) != bytes.size() || !out.commit()) {
+        LOG_WARN_N << "Failed to write " << output_path << ": " << out.errorString();
+        batch_jobs_.setStatus(row, BatchJobsModel::Status::Failed,
+                              tr("Cannot write %1").arg(output_path));
+        co_return;
+    }
+
+    const auto seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - batch_started_.at(static_cast<size_t>(row))).count();
+    batch_jobs_.setDone(row, output_path, seconds);
+}
+
+void AppEngine::addBatchMessage(int row, const QString &stage, const QString &text,
+                                std::string_view modelId, double seconds)
+{
+    if (!transcribe_conversation_) {
+        return;
+    }
+
+    const auto name = QFileInfo{batch_jobs_.job(row).path}.fileName();
+    auto msg = make_shared<ChatMessage>(PromptRole::Assistant,
+                                        text.toStdString(),
+                                        true,
+                                        QStringLiteral("%1: %2").arg(name, stage).toStdString());
+    msg->model_used = modelId;
+    msg->duration_seconds = seconds;
+    transcribe_conversation_->addMessage(std::move(msg));
+}
+
+QString AppEngine::batchOutputPath(const QString &inputPath) const
+{
+    const QFileInfo fi{inputPath};
+    const QDir dir{batch_output_folder_.isEmpty() ? fi.absolutePath() : batch_output_folder_};
+    return dir.filePath(fi.completeBaseName() + QStringLiteral(".txt"));
+}
+
+QString AppEngine::chatSnapshotPath(const ChatConversation &conversation) const
+{
+    const QDir dir{QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + QLatin1String("/chat")};
+    if (!dir.mkpath(".")) {
+        LOG_WARN_N << "Cannot create directory " << dir.path();
+        return {};
+    }
+    return dir.filePath(conversation.id() + QStringLiteral(".kv"));
+}
+
+void AppEngine::discardChatSnapshot(ChatConversation &conversation)
+{
+    if (const auto path = conversation.kvSnapshot(); !path.isEmpty()) {
+        LOG_DEBUG_N << "Removing the KV snapshot " << path << " of chat conversation " << conversation.name();
+        if (!QFile::remove(path) && QFile::exists(path)) {
+            LOG_WARN_N << "Failed to remove " << path;
+        }
+        conversation.setKvSnapshot({});
+    }
+}
+
+void AppEngine::removeStaleChatSnapshots()
+{
+    const QDir dir{QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + QLatin1String("/chat")};
+    for (const auto& fi : dir.entryInfoList({QStringLiteral("*.kv"), QStringLiteral("*.kv.tmp")}, QDir::Files)) {
+        LOG_DEBUG_N << "Removing stale chat KV snapshot " << fi.fileName() << " (" << fi.size() << " bytes)";
+        QFile::remove(fi.absoluteFilePath());
+    }
+}
+
 bool AppEngine::failed(const QString &why)
 {
     LOG_ERROR_N << "Operation failed: " << why;
@@ -1674,6 +2253,12 @@ QCoro::Task<void> AppEngine::doReset()
     file_writer_.reset();
     recorder_.reset();
     chunk_queue_.reset();
+    imported_pcm_.reset();
+    recording_audio_key_.clear();
+
+    if (chat_conversation_) {
+        discardChatSnapshot(*chat_conversation_);
+    }
 
     setRecordedText({});
     setState(State::Idle);
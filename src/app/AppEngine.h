@@ -1,5 +1,7 @@
 #pragma once
 
+#include <optional>
+
 #include <QObject>
 #include <QQmlComponent>
 
@@ -13,6 +15,9 @@
 #include "LanguagesModel.h"
 #include "RewriteStyleModel.h"
 #include "ModelState.h"
+#include "BatchJobsModel.h"
+#include "TranscriptCache.h"
+#include "DocumentChunker.h"
 
 #ifndef QVW_GPU_BACKEND_AVAILABLE
 #define QVW_GPU_BACKEND_AVAILABLE 0
@@ -64,6 +69,8 @@ class AppEngine : public QObject
     Q_PROPERTY(TranscribeSource transcribeSource READ transcribeSource WRITE setTranscribeSource NOTIFY stateFlagsChanged)
     Q_PROPERTY(QString transcribeVocabulary READ transcribeVocabulary WRITE setTranscribeVocabulary NOTIFY stateFlagsChanged)
     Q_PROPERTY(bool gpuBackendAvailable READ gpuBackendAvailable CONSTANT)
+    Q_PROPERTY(BatchJobsModel* batchJobs READ batchJobs CONSTANT)
+    Q_PROPERTY(QUrl batchOutputFolder READ batchOutputFolder WRITE setBatchOutputFolder NOTIFY batchOutputFolderChanged)
 
 public:
     enum class State {
@@ -99,7 +106,8 @@ public:
 
     enum class TranscribeSource {
         Mic,
-        File
+        File,
+        Batch
     };
     Q_ENUM(TranscribeSource)
 
@@ -125,6 +133,8 @@ public:
     Q_INVOKABLE void setInputAudioFile(const QUrl& path);
     Q_INVOKABLE void transcribeFile();
     Q_INVOKABLE void saveAudioToFile(const QUrl& path);
+    Q_INVOKABLE void transcribeBatch();
+    Q_INVOKABLE void cancelBatch(); // After the files in progress
 
     AppEngine();
 
@@ -168,6 +178,9 @@ public:
     QString transcribeVocabulary() const { return transcribe_vocabulary_; }
     void setTranscribeVocabulary(const QString& vocab);
     bool gpuBackendAvailable() const noexcept { return QVW_GPU_BACKEND_AVAILABLE != 0; }
+    BatchJobsModel* batchJobs() { return &batch_jobs_; }
+    QUrl batchOutputFolder() const; // Empty: next to each input file
+    void setBatchOutputFolder(const QUrl& folder);
 
     int  languageIndex() const { return language_index_; }
     QString transcribeModelName() const { return transcribe_model_name_;}
@@ -223,6 +236,7 @@ signals:
     void languagesChanged();
     void translationAvailable(const QString& text);
     void modeChanged();
+    void batchOutputFolderChanged();
 
 private:
     Mode mode() const { return mode_; }
@@ -261,6 +275,57 @@ private:
     void prepareAvailableModels();
     void setRecordedText(const QString text);
     void onModelChangedState(const Model *model, ModelState state);
+    std::string makeRewritePrompt(const QString& text) const;
+    std::string makeTranslatePrompt(const QString& text) const;
+
+    enum class DocStage {
+        Rewrite,
+        Translate
+    };
+
+    /*! Rewrites or translates a document with doc_prepare_model_ or doc_translate_model_.
+     *
+     *  Documents that are too long for one prompt are split (see DocumentChunker).
+     *  The chunks are processed as parallel sequences sharing the system prompt,
+     *  a few at a time, so the KV cache stays bounded. Returns nullopt on failure.
+     */
+    QCoro::Task<std::optional<QString>> promptDocument(DocStage stage, QString text);
+
+    /*! Processes the chunks of a document for promptDocument(), parallel() at a time.
+     *
+     *  Chunks with output that was cut short, or that did not fit in memory, are
+     *  split and processed again. Returns the output of each chunk, or nullopt
+     *  if a chunk still fails after a few splits.
+     */
+    QCoro::Task<std::optional<QStringList>> promptChunks(DocStage stage, std::string prefix, std::string tail,
+                                                         std::vector<DocumentChunker::Chunk> chunks,
+                                                         DocumentChunker chunker, int depth = 0);
+
+    // Batch pipeline
+    struct BatchDecoded {
+        int row{-1};
+        std::shared_ptr<const std::vector<float>> pcm;
+        QString audio_key;
+        std::optional<TranscriptCache::Transcript> transcript; // cached, then there is no pcm
+    };
+
+    struct BatchTranscribed {
+        int row{-1};
+        QString text;
+    };
+
+    QCoro::Task<void> runBatch();
+    QCoro::Task<BatchDecoded> batchDecode(int row);
+    QCoro::Task<BatchTranscribed> batchTranscribe(BatchDecoded decoded);
+    QCoro::Task<void> batchPostProcess(BatchTranscribed transcribed);
+    void addBatchMessage(int row, const QString& stage, const QString& text,
+                         std::string_view modelId, double seconds);
+    QString batchOutputPath(const QString& inputPath) const;
+    QString chatSnapshotPath(const ChatConversation& conversation) const;
+    // Deletes the KV snapshot of the conversation, if it has one
+    void discardChatSnapshot(ChatConversation& conversation);
+    // Conversations are not kept across runs, so their snapshots are of no use
+    void removeStaleChatSnapshots();
 
     ChatMessagesModel chat_messages_model_;
     ChatMessagesModel transcribe_messages_model_;
@@ -275,6 +340,7 @@ private:
     LanguagesModel doc_translate_languages_model_{"doc.translate.target-language", false};
     RewriteStyleModel rewrite_style_{"transcribe.doc.rewrite_style"};
     std::shared_ptr<ChatConversation> chat_conversation_; // the current conversation
+    QString chat_session_conversation_; // id of the conversation held by the chat model's session
     std::shared_ptr<ChatConversation> transcribe_conversation_; // for transcription edits
     AudioController audio_controller_;
     states_t state_{State::Idle, State::Idle, State::Idle};
@@ -302,7 +368,14 @@ private:
     Mode mode_{Mode::Transcribe};
     TranscribeSource transcribe_source_{TranscribeSource::Mic};
     QString transcribe_from_file_path_;
+    std::shared_ptr<const std::vector<float>> imported_pcm_; // decoded input file, 16 kHz mono
+    QString recording_audio_key_; // content hash of the input file, for the cache
+    TranscriptCache transcript_cache_;
     QString transcribe_vocabulary_;
+    BatchJobsModel batch_jobs_;
+    QString batch_output_folder_;
+    std::vector<std::chrono::steady_clock::time_point> batch_started_;
+    bool batch_cancel_{false};
 };
 
 std::ostream& operator << (std::ostream& os, AppEngine::State state);
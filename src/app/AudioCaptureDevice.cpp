@@ -10,11 +10,22 @@
 using namespace std;
 
 
-AudioCaptureDevice::AudioCaptureDevice(AudioRingBuffer *ring, int sampleRate, QObject *parent)
+AudioCaptureDevice::AudioCaptureDevice(AudioRingBuffer *ring, const QAudioFormat& inputFormat, QObject *parent)
     : QIODevice(parent),
     m_ring(ring),
-    sample_rate_(max(1, sampleRate))
+    input_format_(inputFormat),
+    sample_rate_(max(1, inputFormat.sampleRate()))
 {
+    convert_input_ = inputFormat.sampleRate() != 16000
+                     || inputFormat.channelCount() != 1
+                     || inputFormat.sampleFormat() != QAudioFormat::Int16;
+    if (convert_input_) {
+        LOG_INFO_N << "Converting captured audio from " << inputFormat.sampleRate() << " Hz, "
+                   << inputFormat.channelCount() << " channel(s) to 16 kHz mono";
+        resampler_.reset(max(1, inputFormat.sampleRate()), 16000);
+        sample_rate_ = 16000;
+    }
+
     QSettings settings;
     vad_enabled_ = settings.value("transcribe.vad.enabled", true).toBool();
     vad_config_.speech_margin_db = settings.value("transcribe.vad.speech_margin_db", 10.0).toFloat();
@@ -55,6 +66,19 @@ void AudioCaptureDevice::close()
     QIODevice::close();
 }
 
+QAudioFormat AudioCaptureDevice::outputFormat() const
+{
+    if (!convert_input_) {
+        return input_format_;
+    }
+
+    QAudioFormat fmt;
+    fmt.setSampleRate(16000);
+    fmt.setChannelCount(1);
+    fmt.setSampleFormat(QAudioFormat::Int16);
+    return fmt;
+}
+
 qint64 AudioCaptureDevice::writeData(const char *data, qint64 len)
 {
     //LOG_TRACE_N << "AudioCaptureDevice::writeData called with len =" << len;
@@ -68,6 +92,38 @@ qint64 AudioCaptureDevice::writeData(const char *data, qint64 len)
         chunk_start_time_ = std::chrono::steady_clock::now();
     });
 
+    if (convert_input_) {
+        convertInput(data, len);
+        appendPcm(converted_.constData(), converted_.size());
+    } else {
+        appendPcm(data, len);
+    }
+
+    return len;
+}
+
+void AudioCaptureDevice::convertInput(const char *data, qint64 len)
+{
+    pending_input_.append(data, len);
+
+    const auto frame_bytes = max(1, input_format_.bytesPerFrame());
+    const auto usable = (pending_input_.size() / frame_bytes) * frame_bytes;
+    toMonoFloat({reinterpret_cast<const std::byte *>(pending_input_.constData()), static_cast<size_t>(usable)},
+                input_format_, mono_);
+    pending_input_.remove(0, usable);
+
+    resampled_.clear();
+    resampler_.process(mono_, resampled_);
+
+    converted_.resize(static_cast<qsizetype>(resampled_.size() * sizeof(qint16)));
+    auto *dst = reinterpret_cast<qint16 *>(converted_.data());
+    for (size_t i = 0; i < resampled_.size(); ++i) {
+        dst[i] = static_cast<qint16>(std::lrint(std::clamp(resampled_[i], -1.0F, 1.0F) * 32767.0F));
+    }
+}
+
+void AudioCaptureDevice::appendPcm(const char *data, qint64 len)
+{
     qint64 written = 0;
 
     // Fill the audio buffer and push to ring buffer when full, or after 200 ms accumulated audio
@@ -109,8 +165,6 @@ qint64 AudioCaptureDevice::writeData(const char *data, qint64 len)
         }
 
     } while (written < len);
-
-    return len;
 }
 
 void AudioCaptureDevice::prepareBuffer()
@@ -4,17 +4,25 @@
 #include <span>
 
 #include <QIODevice>
+#include <QAudioFormat>
 
 #include "AudioRingBuffer.h"
+#include "AudioResampler.h"
 
 class AudioCaptureDevice : public QIODevice
 {
     Q_OBJECT
 public:
-    explicit AudioCaptureDevice(AudioRingBuffer *ring, int sampleRate, QObject *parent = nullptr);
+    explicit AudioCaptureDevice(AudioRingBuffer *ring, const QAudioFormat& inputFormat, QObject *parent = nullptr);
 
     bool open(OpenMode mode) override;
 
+    /*! The format of the PCM pushed to the ring buffer.
+     *
+     *  Input in other formats than 16 kHz mono Int16 is converted to that.
+     */
+    QAudioFormat outputFormat() const;
+
     void close() override;
 
 protected:
@@ -42,6 +50,8 @@ private:
         float noise_floor_alpha = 0.02F;
     };
 
+    void appendPcm(const char *data, qint64 len);
+    void convertInput(const char *data, qint64 len);
     void prepareBuffer();
     void recalculateRecordingLevel(std::span<const qint16> samples);
     ChunkStats calculateChunkStats(std::span<const qint16> samples) const;
@@ -49,6 +59,13 @@ private:
     static int toDurationMs(int sampleCount, int sampleRate);
 
     AudioRingBuffer *m_ring;
+    QAudioFormat input_format_;
+    bool convert_input_ = false;
+    PolyphaseResampler resampler_;
+    QByteArray pending_input_;      // partial frame from the last write
+    std::vector<float> mono_;
+    std::vector<float> resampled_;
+    QByteArray converted_;
     int sample_rate_ = 16000;
     unsigned int segment_ = 0;
     QByteArray audioBuffer_;
@@ -0,0 +1,996 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <thread>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+
+#include "AudioFileReader.h"
+#include "AudioResampler.h"
+
+#include "logging.h"
+
+using namespace std;
+
+namespace {
+
+using Result = AudioFileReader::Result;
+using bytes_t = std::span<const uint8_t>;
+
+constexpr int target_rate = 16000;
+
+// Work below this size is not worth another thread
+constexpr size_t min_frames_per_task = size_t{1} << 16;
+constexpr size_t min_flac_bytes_per_task = size_t{1} << 20;
+
+size_t taskCount(size_t count, size_t minPerTask)
+{
+    const size_t cores = max(1u, thread::hardware_concurrency());
+    return clamp<size_t>(count / minPerTask, 1, cores);
+}
+
+// Calls fn(begin, end, task) for `tasks` consecutive slices of [0, count).
+// The calling thread runs the first slice.
+template <typename Fn>
+void parallelFor(size_t count, size_t tasks, const Fn& fn)
+{
+    assert(tasks > 0);
+    const auto slice = [count, tasks](size_t t) {
+        return count / tasks * t + count % tasks * t / tasks;
+    };
+
+    vector<jthread> workers;
+    workers.reserve(tasks - 1);
+    for (size_t t = 1; t < tasks; ++t) {
+        workers.emplace_back([&fn, b = slice(t), e = slice(t + 1), t] {
+            fn(b, e, t);
+        });
+    }
+    fn(0, slice(1), 0);
+}
+
+bool startsWith(bytes_t data, string_view magic)
+{
+    return data.size() >= magic.size() && memcmp(data.data(), magic.data(), magic.size()) == 0;
+}
+
+uint16_t le16(const uint8_t *p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+uint32_t le32(const uint8_t *p) { return le16(p) | (static_cast<uint32_t>(le16(p + 2)) << 16); }
+uint64_t le64(const uint8_t *p) { return le32(p) | (static_cast<uint64_t>(le32(p + 4)) << 32); }
+uint32_t be24(const uint8_t *p) { return (static_cast<uint32_t>(p[0]) << 16) | (p[1] << 8) | p[2]; }
+
+// ----------------------------------------------------------------------------
+// Uncompressed PCM
+
+enum class SampleKind {
+    U8,
+    S16,
+    S24,
+    S32,
+    F32,
+    F64
+};
+
+struct PcmLayout {
+    bytes_t data;
+    SampleKind kind{SampleKind::S16};
+    int bytes_per_sample{2};
+    int channels{1};
+    int sample_rate{target_rate};
+};
+
+// Little endian samples at any alignment
+template <SampleKind kind>
+float loadSample(const uint8_t *p)
+{
+    if constexpr (kind == SampleKind::U8) {
+        return (static_cast<float>(*p) - 128.0f) / 128.0f;
+    } else if constexpr (kind == SampleKind::S16) {
+        int16_t v;
+        memcpy(&v, p, sizeof(v));
+        return static_cast<float>(v) / 32768.0f;
+    } else if constexpr (kind == SampleKind::S24) {
+        const auto v = static_cast<int32_t>((static_cast<uint32_t>(p[0]) << 8)
+                                            | (static_cast<uint32_t>(p[1]) << 16)
+                                            | (static_cast<uint32_t>(p[2]) << 24)) >> 8;
+        return static_cast<float>(v) / 8388608.0f;
+    } else if constexpr (kind == SampleKind::S32) {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return static_cast<float>(v) / 2147483648.0f;
+    } else if constexpr (kind == SampleKind::F32) {
+        float v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    } else {
+        double v;
+        memcpy(&v, p, sizeof(v));
+        return static_cast<float>(v);
+    }
+}
+
+// Plain loops over fixed-size samples, so the compiler can vectorize them
+template <SampleKind kind, int bytes>
+void convertFrames(const PcmLayout& pcm, size_t begin, size_t end, float *dst)
+{
+    const auto ch = static_cast<size_t>(pcm.channels);
+    const uint8_t *src = pcm.data.data() + begin * ch * bytes;
+    const size_t frames = end - begin;
+
+    if (ch == 1) {
+        for (size_t f = 0; f < frames; ++f) {
+            dst[f] = clamp(loadSample<kind>(src + f * bytes), -1.0f, 1.0f);
+        }
+        return;
+    }
+
+    if (ch == 2) {
+        for (size_t f = 0; f < frames; ++f) {
+            const uint8_t *frame = src + f * 2 * bytes;
+            dst[f] = clamp((loadSample<kind>(frame) + loadSample<kind>(frame + bytes)) * 0.5f, -1.0f, 1.0f);
+        }
+        return;
+    }
+
+    const float scale = 1.0f / static_cast<float>(ch);
+    for (size_t f = 0; f < frames; ++f) {
+        const uint8_t *frame = src + f * ch * bytes;
+        float s = 0.0f;
+        for (size_t c = 0; c < ch; ++c) {
+            s += loadSample<kind>(frame + c * bytes);
+        }
+        dst[f] = clamp(s * scale, -1.0f, 1.0f);
+    }
+}
+
+template <SampleKind kind, int bytes>
+void convertParallel(const PcmLayout& pcm, vector<float>& out)
+{
+    const auto frames = out.size();
+    parallelFor(frames, taskCount(frames, min_frames_per_task), [&](size_t b, size_t e, size_t) {
+        convertFrames<kind, bytes>(pcm, b, e, out.data() + b);
+    });
+}
+
+void convertToMono(const PcmLayout& pcm, vector<float>& out)
+{
+    const auto frame_bytes = static_cast<size_t>(pcm.channels) * static_cast<size_t>(pcm.bytes_per_sample);
+    out.resize(pcm.data.size() / frame_bytes);
+
+    switch (pcm.kind) {
+    case SampleKind::U8:
+        convertParallel<SampleKind::U8, 1>(pcm, out);
+        break;
+    case SampleKind::S16:
+        convertParallel<SampleKind::S16, 2>(pcm, out);
+        break;
+    case SampleKind::S24:
+        convertParallel<SampleKind::S24, 3>(pcm, out);
+        break;
+    case SampleKind::S32:
+        convertParallel<SampleKind::S32, 4>(pcm, out);
+        break;
+    case SampleKind::F32:
+        convertParallel<SampleKind::F32, 4>(pcm, out);
+        break;
+    case SampleKind::F64:
+        convertParallel<SampleKind::F64, 8>(pcm, out);
+        break;
+    }
+}
+
+// Finds the sample layout and the audio data in a RIFF/RF64 WAVE file.
+Result parseWav(bytes_t file, PcmLayout& pcm, QString& error)
+{
+    const bool rf64 = startsWith(file, "RF64");
+    if (file.size() < 12 || !(rf64 || startsWith(file, "RIFF"))
+        || memcmp(file.data() + 8, "WAVE", 4) != 0) {
+        return Result::NotHandled;
+    }
+
+    uint16_t tag{};
+    uint16_t channels{};
+    uint32_t rate{};
+    uint16_t block_align{};
+    uint16_t bits{};
+    bool have_fmt = false;
+    uint64_t ds64_data_size{};
+
+    uint64_t pos = 12;
+    while (pos + 8 <= file.size()) {
+        const uint8_t *chunk = file.data() + pos;
+        const uint64_t chunk_size = le32(chunk + 4);
+        const uint64_t body = pos + 8;
+        const uint64_t available = file.size() - body;
+
+        if (memcmp(chunk, "ds64", 4) == 0 && chunk_size >= 24 && available >= 24) {
+            ds64_data_size = le64(chunk + 8 + 8);
+        } else if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunk_size < 16 || available < 16) {
+                error = QStringLiteral("Invalid WAV format chunk");
+                return Result::Failed;
+            }
+            const uint8_t *fmt = chunk + 8;
+            tag = le16(fmt);
+            channels = le16(fmt + 2);
+            rate = le32(fmt + 4);
+            block_align = le16(fmt + 12);
+            bits = le16(fmt + 14);
+            if (tag == 0xFFFE /* WAVE_FORMAT_EXTENSIBLE */ && chunk_size >= 40 && available >= 40) {
+                // The first two bytes of the sub-format GUID are the format tag
+                tag = le16(fmt + 24);
+            }
+            have_fmt = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt) {
+                return Result::NotHandled;
+            }
+
+            uint64_t size = chunk_size;
+            if (rf64 && chunk_size == 0xFFFFFFFF) {
+                size = ds64_data_size;
+            }
+            // Streaming writers leave the size as -1 or never update it
+            if (chunk_size == 0xFFFFFFFF || size > available) {
+                size = available;
+            }
+            pcm.data = file.subspan(static_cast<size_t>(body), static_cast<size_t>(size));
+            break;
+        }
+
+        pos = body + chunk_size + (chunk_size & 1);
+    }
+
+    if (!have_fmt || pcm.data.data() == nullptr) {
+        return Result::NotHandled;
+    }
+
+    if (channels == 0 || rate == 0 || block_align == 0 || block_align % channels != 0) {
+        error = QStringLiteral("Invalid WAV header");
+        return Result::Failed;
+    }
+
+    const int bytes = block_align / channels;
+    if (bits > bytes * 8) {
+        return Result::NotHandled;
+    }
+
+    constexpr uint16_t pcm_tag = 1;
+    constexpr uint16_t float_tag = 3;
+    if (tag == pcm_tag && bytes >= 1 && bytes <= 4) {
+        static constexpr array<SampleKind, 4> kinds{SampleKind::U8, SampleKind::S16, SampleKind::S24, SampleKind::S32};
+        pcm.kind = kinds[static_cast<size_t>(bytes - 1)];
+    } else if (tag == float_tag && (bytes == 4 || bytes == 8)) {
+        pcm.kind = bytes == 4 ? SampleKind::F32 : SampleKind::F64;
+    } else {
+        // a-law, mu-law, ADPCM, MP3 in WAV and so on
+        return Result::NotHandled;
+    }
+
+    pcm.bytes_per_sample = bytes;
+    pcm.channels = channels;
+    pcm.sample_rate = static_cast<int>(rate);
+    return Result::Ok;
+}
+
+// ----------------------------------------------------------------------------
+// FLAC
+
+constexpr auto crc8_table = [] {
+    array<uint8_t, 256> table{};
+    for (unsigned i = 0; i < 256; ++i) {
+        auto c = static_cast<uint8_t>(i);
+        for (int b = 0; b < 8; ++b) {
+            c = static_cast<uint8_t>((c & 0x80) ? (c << 1) ^ 0x07 : c << 1);
+        }
+        table[i] = c;
+    }
+    return table;
+}();
+
+constexpr auto crc16_table = [] {
+    array<uint16_t, 256> table{};
+    for (unsigned i = 0; i < 256; ++i) {
+        auto c = static_cast<uint16_t>(i << 8);
+        for (int b = 0; b < 8; ++b) {
+            c = static_cast<uint16_t>((c & 0x8000) ? (c << 1) ^ 0x8005 : c << 1);
+        }
+        table[i] = c;
+    }
+    return table;
+}();
+
+uint8_t crc8(const uint8_t *p, size_t len)
+{
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc = crc8_table[crc ^ p[i]];
+    }
+    return crc;
+}
+
+uint16_t crc16(const uint8_t *p, size_t len)
+{
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc = static_cast<uint16_t>((crc << 8) ^ crc16_table[(crc >> 8) ^ p[i]]);
+    }
+    return crc;
+}
+
+// MSB-first bit reader. Reading past the end yields zeros and sets overrun().
+class BitReader
+{
+public:
+    explicit BitReader(bytes_t data)
+        : begin_{data.data()}, p_{data.data()}, end_{data.data() + data.size()} {}
+
+    bool overrun() const noexcept { return overrun_; }
+
+    uint32_t read(int n)
+    {
+        assert(n >= 0 && n <= 32);
+        if (n == 0) {
+            return 0;
+        }
+        if (bits_ < n) {
+            refill();
+            if (bits_ < n) {
+                overrun_ = true;
+                bits_ = n;
+            }
+        }
+        const auto v = static_cast<uint32_t>(cache_ >> (64 - n));
+        cache_ <<= n;
+        bits_ -= n;
+        return v;
+    }
+
+    int32_t readSigned(int n)
+    {
+        if (n == 0) {
+            return 0;
+        }
+        return static_cast<int32_t>(read(n) << (32 - n)) >> (32 - n);
+    }
+
+    // Number of 0 bits before the next 1 bit, which is consumed
+    uint32_t readUnary()
+    {
+        uint32_t count = 0;
+        for (;;) {
+            if (cache_ == 0) {
+                count += static_cast<uint32_t>(bits_);
+                bits_ = 0;
+                refill();
+                if (bits_ == 0) {
+                    overrun_ = true;
+                    return count;
+                }
+                continue;
+            }
+            const int zeros = countl_zero(cache_);
+            count += static_cast<uint32_t>(zeros);
+            cache_ <<= zeros;
+            cache_ <<= 1;
+            bits_ -= zeros + 1;
+            return count;
+        }
+    }
+
+    void alignToByte()
+    {
+        const int drop = bits_ & 7;
+        cache_ <<= drop;
+        bits_ -= drop;
+    }
+
+    // Bytes consumed. Only meaningful when aligned.
+    size_t bytePos() const noexcept
+    {
+        return static_cast<size_t>(p_ - begin_) - static_cast<size_t>(bits_ / 8);
+    }
+
+private:
+    void refill()
+    {
+        while (bits_ <= 56 && p_ < end_) {
+            cache_ |= static_cast<uint64_t>(*p_++) << (56 - bits_);
+            bits_ += 8;
+        }
+    }
+
+    const uint8_t *begin_;
+    const uint8_t *p_;
+    const uint8_t *end_;
+    uint64_t cache_{}; // valid bits are left aligned, the rest are zero
+    int bits_{};
+    bool overrun_{false};
+};
+
+struct FlacStreamInfo {
+    int max_block{};
+    int sample_rate{};
+    int channels{};
+    int bps{};
+    uint64_t total_samples{}; // 0 if unknown
+};
+
+/*! Decodes single FLAC frames to mono float.
+ *
+ *  Frames are fully validated (header CRC-8, frame CRC-16 and the stream
+ *  parameters), so decode() can also be used to find the next frame
+ *  when starting at an arbitrary byte offset.
+ */
+class FlacFrameDecoder
+{
+public:
+    explicit FlacFrameDecoder(const FlacStreamInfo& info)
+        : info_{info}
+    {
+        for (auto& ch : channels_) {
+            ch.reserve(static_cast<size_t>(max(info_.max_block, 4096)));
+        }
+    }
+
+    static bool maybeSync(bytes_t data, size_t pos)
+    {
+        return pos + 1 < data.size() && data[pos] == 0xFF && (data[pos + 1] & 0xFE) == 0xF8;
+    }
+
+    // Returns the frame size, or 0 if there is no valid frame at the start of `data`.
+    // The frame's samples are appended to `mono`.
+    size_t decode(bytes_t data, vector<float>& mono)
+    {
+        int block_size{};
+        int channel_mode{};
+        const auto header_len = parseHeader(data, block_size, channel_mode);
+        if (header_len == 0) {
+            return 0;
+        }
+
+        BitReader br{data.subspan(header_len)};
+        const int channels = channel_mode < 8 ? channel_mode + 1 : 2;
+        for (int c = 0; c < channels; ++c) {
+            // The side channel needs one extra bit
+            const bool side = (channel_mode == 8 && c == 1) || (channel_mode == 9 && c == 0)
+                              || (channel_mode == 10 && c == 1);
+            auto& samples = channels_[static_cast<size_t>(c)];
+            samples.resize(static_cast<size_t>(block_size));
+            if (!decodeSubframe(br, info_.bps + (side ? 1 : 0), block_size, samples.data())
+                || br.overrun()) {
+                return 0;
+            }
+        }
+
+        br.alignToByte();
+        const auto crc_pos = header_len + br.bytePos();
+        if (crc_pos + 2 > data.size()
+            || crc16(data.data(), crc_pos) != ((data[crc_pos] << 8) | data[crc_pos + 1])) {
+            return 0;
+        }
+
+        toMono(channels, channel_mode, block_size, mono);
+        return crc_pos + 2;
+    }
+
+private:
+    size_t parseHeader(bytes_t data, int& blockSize, int& channelMode) const
+    {
+        if (!maybeSync(data, 0) || data.size() < 6) {
+            return 0;
+        }
+
+        // The header is at most 16 bytes. Parse a zero padded copy, and check
+        // that it did not extend past the data at the end.
+        array<uint8_t, 16> header{};
+        copy_n(data.begin(), min(header.size(), data.size()), header.begin());
+        const uint8_t *p = header.data();
+        const int bs_code = p[2] >> 4;
+        const int sr_code = p[2] & 0x0F;
+        channelMode = p[3] >> 4;
+        const int ss_code = (p[3] >> 1) & 0x07;
+        if (bs_code == 0 || sr_code == 15 || channelMode > 10 || ss_code == 3 || (p[3] & 1)) {
+            return 0;
+        }
+
+        // UTF-8 style coded frame or sample number
+        size_t pos = 4;
+        const int lead = countl_one(p[pos]);
+        if (lead == 1 || lead > 7) {
+            return 0;
+        }
+        const size_t extra = lead == 0 ? 0 : static_cast<size_t>(lead - 1);
+        ++pos;
+        for (size_t i = 0; i < extra; ++i, ++pos) {
+            if ((p[pos] & 0xC0) != 0x80) {
+                return 0;
+            }
+        }
+
+        if (bs_code == 1) {
+            blockSize = 192;
+        } else if (bs_code <= 5) {
+            blockSize = 576 << (bs_code - 2);
+        } else if (bs_code == 6) {
+            blockSize = p[pos++] + 1;
+        } else if (bs_code == 7) {
+            blockSize = ((p[pos] << 8) | p[pos + 1]) + 1;
+            pos += 2;
+        } else {
+            blockSize = 256 << (bs_code - 8);
+        }
+
+        static constexpr array<int, 12> rates{0, 88200, 176400, 192000, 8000, 16000,
+                                             22050, 24000, 32000, 44100, 48000, 96000};
+        int rate = info_.sample_rate;
+        if (sr_code >= 1 && sr_code <= 11) {
+            rate = rates[static_cast<size_t>(sr_code)];
+        } else if (sr_code == 12) {
+            rate = p[pos++] * 1000;
+        } else if (sr_code == 13) {
+            rate = (p[pos] << 8) | p[pos + 1];
+            pos += 2;
+        } else if (sr_code == 14) {
+            rate = ((p[pos] << 8) | p[pos + 1]) * 10;
+            pos += 2;
+        }
+
+        static constexpr array<int, 8> sizes{0, 8, 12, 0, 16, 20, 24, 32};
+        const int bps = ss_code == 0 ? info_.bps : sizes[static_cast<size_t>(ss_code)];
+        const int channels = channelMode < 8 ? channelMode + 1 : 2;
+
+        // Changing stream parameters are allowed by the format, but not by us.
+        // Checking them also rejects false sync codes early.
+        if (rate != info_.sample_rate || bps != info_.bps || channels != info_.channels) {
+            return 0;
+        }
+
+        if (pos >= data.size() || crc8(p, pos) != p[pos]) {
+            return 0;
+        }
+        return pos + 1;
+    }
+
+    bool decodeSubframe(BitReader& br, int bps, int blockSize, int32_t *out)
+    {
+        if (br.read(1) != 0) {
+            return false;
+        }
+        const auto type = br.read(6);
+        if (br.read(1)) {
+            const auto wasted = br.readUnary() + 1;
+            if (wasted >= static_cast<uint32_t>(bps)) {
+                return false;
+            }
+            if (!decodeSubframeBody(br, type, bps - static_cast<int>(wasted), blockSize, out)) {
+                return false;
+            }
+            for (int i = 0; i < blockSize; ++i) {
+                out[i] = static_cast<int32_t>(static_cast<uint32_t>(out[i]) << wasted);
+            }
+            return true;
+        }
+        return decodeSubframeBody(br, type, bps, blockSize, out);
+    }
+
+    bool decodeSubframeBody(BitReader& br, uint32_t type, int bps, int blockSize, int32_t *out)
+    {
+        if (bps > 32) {
+            // 33 bit side channels of 32 bit streams
+            return false;
+        }
+
+        if (type == 0) { // Constant
+            fill(out, out + blockSize, br.readSigned(bps));
+            return true;
+        }
+
+        if (type == 1) { // Verbatim
+            for (int i = 0; i < blockSize; ++i) {
+                out[i] = br.readSigned(bps);
+            }
+            return true;
+        }
+
+        if (type >= 8 && type <= 12) { // Fixed predictor
+            const int order = static_cast<int>(type) - 8;
+            if (order > blockSize) {
+                return false;
+            }
+            for (int i = 0; i < order; ++i) {
+                out[i] = br.readSigned(bps);
+            }
+            if (!decodeResidual(br, order, blockSize, out)) {
+                return false;
+            }
+            restoreFixed(order, blockSize, out);
+            return true;
+        }
+
+        if (type >= 32) { // LPC
+            const int order = static_cast<int>(type & 31) + 1;
+            if (order > blockSize) {
+                return false;
+            }
+            for (int i = 0; i < order; ++i) {
+                out[i] = br.readSigned(bps);
+            }
+            const int precision = static_cast<int>(br.read(4)) + 1;
+            const int shift = br.readSigned(5);
+            if (precision == 16 || shift < 0) {
+                return false;
+            }
+            array<int32_t, 32> coeffs{};
+            for (int i = 0; i < order; ++i) {
+                coeffs[static_cast<size_t>(i)] = br.readSigned(precision);
+            }
+            if (!decodeResidual(br, order, blockSize, out)) {
+                return false;
+            }
+            restoreLpc(coeffs.data(), order, shift, blockSize, out);
+            return true;
+        }
+
+        return false; // Reserved
+    }
+
+    // Stores the Rice coded residual in out[order..blockSize)
+    static bool decodeResidual(BitReader& br, int order, int blockSize, int32_t *out)
+    {
+        const auto method = br.read(2);
+        if (method > 1) {
+            return false;
+        }
+        const int param_bits = method == 0 ? 4 : 5;
+        const uint32_t escape = method == 0 ? 15 : 31;
+
+        const int partition_order = static_cast<int>(br.read(4));
+        const int partition_size = blockSize >> partition_order;
+        if ((partition_size << partition_order) != blockSize || partition_size < order) {
+            return false;
+        }
+
+        int i = order;
+        for (int p = 0; p < (1 << partition_order); ++p) {
+            const int end = (p + 1) * partition_size;
+            const auto k = br.read(param_bits);
+            if (k == escape) {
+                const int bits = static_cast<int>(br.read(5));
+                for (; i < end; ++i) {
+                    out[i] = br.readSigned(bits);
+                }
+                continue;
+            }
+
+            for (; i < end; ++i) {
+                const uint64_t v = (static_cast<uint64_t>(br.readUnary()) << k) | br.read(static_cast<int>(k));
+                out[i] = static_cast<int32_t>(static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1));
+            }
+            if (br.overrun()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void restoreFixed(int order, int blockSize, int32_t *s)
+    {
+        const auto at = [s](int i) { return static_cast<int64_t>(s[i]); };
+        switch (order) {
+        case 1:
+            for (int i = 1; i < blockSize; ++i)
+                s[i] = static_cast<int32_t>(at(i) + at(i - 1));
+            break;
+        case 2:
+            for (int i = 2; i < blockSize; ++i)
+                s[i] = static_cast<int32_t>(at(i) + 2 * at(i - 1) - at(i - 2));
+            break;
+        case 3:
+            for (int i = 3; i < blockSize; ++i)
+                s[i] = static_cast<int32_t>(at(i) + 3 * at(i - 1) - 3 * at(i - 2) + at(i - 3));
+            break;
+        case 4:
+            for (int i = 4; i < blockSize; ++i)
+                s[i] = static_cast<int32_t>(at(i) + 4 * at(i - 1) - 6 * at(i - 2) + 4 * at(i - 3) - at(i - 4));
+            break;
+        default:
+            break;
+        }
+    }
+
+    static void restoreLpc(const int32_t *coeffs, int order, int shift, int blockSize, int32_t *s)
+    {
+        for (int i = order; i < blockSize; ++i) {
+            int64_t sum = 0;
+            const int32_t *history = s + i - 1;
+            for (int j = 0; j < order; ++j) {
+                sum += static_cast<int64_t>(coeffs[j]) * history[-j];
+            }
+            s[i] = static_cast<int32_t>(s[i] + (sum >> shift));
+        }
+    }
+
+    void toMono(int channels, int channelMode, int blockSize, vector<float>& mono) const
+    {
+        const auto start = mono.size();
+        mono.resize(start + static_cast<size_t>(blockSize));
+        float *dst = mono.data() + start;
+        const float scale = 1.0f / static_cast<float>(int64_t{1} << (info_.bps - 1)) / static_cast<float>(channels);
+        const int32_t *a = channels_[0].data();
+        const int32_t *b = channels > 1 ? channels_[1].data() : nullptr;
+
+        switch (channelMode) {
+        case 8: // left, side
+            for (int i = 0; i < blockSize; ++i)
+                dst[i] = static_cast<float>(2 * int64_t{a[i]} - b[i]) * scale;
+            return;
+        case 9: // side, right
+            for (int i = 0; i < blockSize; ++i)
+                dst[i] = static_cast<float>(int64_t{a[i]} + 2 * int64_t{b[i]}) * scale;
+            return;
+        case 10: // mid, side. left + right == 2 * mid + (side & 1)
+            for (int i = 0; i < blockSize; ++i)
+                dst[i] = static_cast<float>(2 * int64_t{a[i]} + (b[i] & 1)) * scale;
+            return;
+        default:
+            break;
+        }
+
+        for (int i = 0; i < blockSize; ++i) {
+            int64_t sum = 0;
+            for (int c = 0; c < channels; ++c) {
+                sum += channels_[static_cast<size_t>(c)][static_cast<size_t>(i)];
+            }
+            dst[i] = static_cast<float>(sum) * scale;
+        }
+    }
+
+    const FlacStreamInfo& info_;
+    array<vector<int32_t>, 8> channels_;
+};
+
+bytes_t skipId3v2(bytes_t file)
+{
+    if (file.size() < 10 || !startsWith(file, "ID3")) {
+        return file;
+    }
+    // Sync-safe size: 7 bits per byte
+    size_t size = 10 + ((file[6] & 0x7Fu) << 21 | (file[7] & 0x7Fu) << 14 | (file[8] & 0x7Fu) << 7 | (file[9] & 0x7Fu));
+    if (file[5] & 0x10) {
+        size += 10; // footer
+    }
+    return size < file.size() ? file.subspan(size) : bytes_t{};
+}
+
+bool isFlac(bytes_t file)
+{
+    return startsWith(skipId3v2(file), "fLaC");
+}
+
+// Decodes the first valid frame that starts in [from, end) into `out`.
+// Returns the offset after that frame, which may be past `end`, or nullopt if there is none.
+optional<size_t> findFrame(FlacFrameDecoder& decoder, bytes_t frames, size_t from, size_t end, vector<float>& out)
+{
+    for (size_t at = from; at < end; ++at) {
+        if (FlacFrameDecoder::maybeSync(frames, at)) {
+            if (const auto len = decoder.decode(frames.subspan(at), out)) {
+                return at + len;
+            }
+        }
+    }
+    return nullopt;
+}
+
+/*! Decodes a native FLAC stream to mono float at the stream's sample rate.
+ *
+ *  The frame data is split in byte ranges decoded in parallel. Each range
+ *  starts at the first valid frame at or after its first byte, and ends
+ *  with the frame that starts before the next range.
+ */
+Result decodeFlac(bytes_t file, FlacStreamInfo& info, vector<float>& mono, QString& error)
+{
+    file = skipId3v2(file);
+    if (!startsWith(file, "fLaC")) {
+        return Result::NotHandled;
+    }
+
+    size_t pos = 4;
+    bool have_info = false;
+    for (bool last = false; !last;) {
+        if (pos + 4 > file.size()) {
+            error = QStringLiteral("Truncated FLAC metadata");
+            return Result::Failed;
+        }
+        last = (file[pos] & 0x80) != 0;
+        const int type = file[pos] & 0x7F;
+        const size_t len = be24(file.data() + pos + 1);
+        pos += 4;
+        if (pos + len > file.size()) {
+            error = QStringLiteral("Truncated FLAC metadata");
+            return Result::Failed;
+        }
+
+        if (type == 0 && len >= 34) { // STREAMINFO
+            const uint8_t *si = file.data() + pos;
+            info.max_block = (si[2] << 8) | si[3];
+            info.sample_rate = static_cast<int>((be24(si + 10) >> 4) & 0xFFFFF);
+            info.channels = ((si[12] >> 1) & 0x07) + 1;
+            info.bps = (((si[12] & 1) << 4) | (si[13] >> 4)) + 1;
+            info.total_samples = (static_cast<uint64_t>(si[13] & 0x0F) << 32)
+                                 | (static_cast<uint64_t>(si[14]) << 24) | (si[15] << 16) | (si[16] << 8) | si[17];
+            have_info = true;
+        }
+        pos += len;
+    }
+
+    if (!have_info || info.sample_rate == 0 || info.bps < 4) {
+        error = QStringLiteral("Invalid FLAC stream info");
+        return Result::Failed;
+    }
+
+    const auto frames = file.subspan(pos);
+    const auto tasks = taskCount(frames.size(), min_flac_bytes_per_task);
+    vector<vector<float>> parts(tasks);
+    atomic_bool damaged{false};
+
+    parallelFor(frames.size(), tasks, [&](size_t begin, size_t end, size_t task) {
+        FlacFrameDecoder decoder{info};
+        auto& out = parts[task];
+        if (info.total_samples > 0) {
+            out.reserve(static_cast<size_t>(info.total_samples * (end - begin) / max<size_t>(frames.size(), 1))
+                        + static_cast<size_t>(info.max_block));
+        }
+
+        // The first range starts at a frame
+        size_t at = task == 0 ? begin : findFrame(decoder, frames, begin, end, out).value_or(end);
+        while (at < end && !damaged) {
+            const auto len = decoder.decode(frames.subspan(at), out);
+            if (len == 0) {
+                // Tolerate trailing junk, like an ID3v1 tag, after the last frame
+                vector<float> scratch;
+                if (task + 1 < tasks || findFrame(decoder, frames, at + 1, end, scratch)) {
+                    damaged = true;
+                }
+                return;
+            }
+            at += len;
+        }
+    });
+
+    if (damaged) {
+        LOG_WARN_N << "The FLAC stream has damaged frames.";
+        return Result::NotHandled;
+    }
+
+    if (all_of(parts.begin(), parts.end(), [](const auto& part) { return part.empty(); })
+        && !frames.empty()) {
+        LOG_WARN_N << "No decodable FLAC frames found.";
+        return Result::NotHandled;
+    }
+
+    size_t total = 0;
+    for (const auto& part : parts) {
+        total += part.size();
+    }
+    mono.clear();
+    mono.reserve(total);
+    for (const auto& part : parts) {
+        mono.insert(mono.end(), part.begin(), part.end());
+    }
+
+    if (info.total_samples > 0 && info.total_samples != mono.size()) {
+        LOG_WARN_N << "Decoded " << mono.size() << " FLAC samples, but the stream info says "
+                   << info.total_samples;
+    }
+    return Result::Ok;
+}
+
+} // anon ns
+
+AudioFileReader::AudioFileReader(QString path)
+    : path_{std::move(path)}
+{
+}
+
+AudioFileReader::Result AudioFileReader::readMono16k(std::vector<float> &out)
+{
+    error_message_.clear();
+    out.clear();
+
+    QFile file{path_};
+    if (!file.open(QIODevice::ReadOnly)) {
+        error_message_ = file.errorString();
+        return Result::Failed;
+    }
+
+    const auto size = file.size();
+    if (size <= 0) {
+        return Result::NotHandled;
+    }
+
+    const uchar *map = file.map(0, size);
+    if (!map) {
+        LOG_DEBUG_N << "Cannot memory map " << path_ << ": " << file.errorString();
+        return Result::NotHandled;
+    }
+    const bytes_t bytes{map, static_cast<size_t>(size)};
+
+    const auto start = chrono::steady_clock::now();
+    vector<float> mono;
+    string_view codec;
+    const auto suffix = QFileInfo{path_}.suffix().toLower();
+
+    if (suffix == "pcm" || suffix == "raw" || startsWith(bytes, "RIFF") || startsWith(bytes, "RF64")) {
+        if constexpr (std::endian::native != std::endian::little) {
+            return Result::NotHandled;
+        }
+
+        PcmLayout pcm;
+        if (suffix == "pcm" || suffix == "raw") {
+            QSettings settings;
+            pcm.data = bytes;
+            pcm.sample_rate = settings.value("import.raw.sample_rate", target_rate).toInt();
+            pcm.channels = settings.value("import.raw.channels", 1).toInt();
+            if (pcm.sample_rate <= 0 || pcm.channels <= 0) {
+                error_message_ = QStringLiteral("Invalid raw PCM settings");
+                return Result::Failed;
+            }
+            codec = "raw PCM";
+        } else {
+            if (const auto r = parseWav(bytes, pcm, error_message_); r != Result::Ok) {
+                return r;
+            }
+            codec = "WAV";
+        }
+
+        convertToMono(pcm, mono);
+        sample_rate_ = pcm.sample_rate;
+        channels_ = pcm.channels;
+    } else if (isFlac(bytes)) {
+        FlacStreamInfo info;
+        if (const auto r = decodeFlac(bytes, info, mono, error_message_); r != Result::Ok) {
+            return r;
+        }
+        sample_rate_ = info.sample_rate;
+        channels_ = info.channels;
+        codec = "FLAC";
+    } else {
+        return Result::NotHandled;
+    }
+
+    const auto decoded = chrono::steady_clock::now();
+    const auto input_samples = mono.size();
+
+    if (sample_rate_ == target_rate) {
+        out = std::move(mono);
+    } else {
+        const PolyphaseResampler resampler{sample_rate_, target_rate};
+        out.resize(resampler.expectedOutput(mono.size()));
+        parallelFor(out.size(), taskCount(out.size(), min_frames_per_task), [&](size_t b, size_t e, size_t) {
+            resampler.resampleRange(mono, b, e, out.data() + b);
+        });
+    }
+
+    const auto done = chrono::steady_clock::now();
+    const auto decode_sec = chrono::duration<double>(decoded - start).count();
+    const auto resample_sec = chrono::duration<double>(done - decoded).count();
+    LOG_DEBUG_N << "Read " << codec << " file " << path_ << " (" << size << " bytes, "
+                << channels_ << " ch, " << sample_rate_ << " Hz) in "
+                << (decode_sec * 1000.0) << " ms ("
+                << (decode_sec > 0.0 ? static_cast<double>(size) / decode_sec / 1e6 : 0.0)
+                << " MB/s). Resampled " << input_samples << " samples to " << out.size()
+                << " in " << (resample_sec * 1000.0) << " ms.";
+
+    return Result::Ok;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+
+#include <QString>
+
+/*! Fast path readers for PCM WAV, raw PCM and FLAC files.
+ *
+ *  The file is memory mapped and decoded without QAudioDecoder. Sample
+ *  conversion, down-mixing, FLAC frame decoding and resampling are split
+ *  across the available cores.
+ *
+ *  Formats it does not handle (compressed audio in other containers,
+ *  unusual WAV encodings, damaged FLAC streams) are reported as NotHandled,
+ *  so the caller can fall back to QAudioDecoder.
+ *
+ *  Raw PCM (*.pcm, *.raw) is signed 16 bit little endian. The sample rate and
+ *  channel count are read from the settings `import.raw.sample_rate` (16000)
+ *  and `import.raw.channels` (1), which match the files the recorder writes.
+ */
+class AudioFileReader
+{
+public:
+    enum class Result {
+        Ok,
+        NotHandled,
+        Failed
+    };
+
+    explicit AudioFileReader(QString path);
+
+    /*! Decodes the file to mono float at 16 kHz.
+     *
+     *  Replaces the content of `out`. On Failed, errorMessage() explains why.
+     */
+    [[nodiscard]] Result readMono16k(std::vector<float>& out);
+
+    const QString& errorMessage() const noexcept {
+        return error_message_;
+    }
+
+    // Valid after a successful read
+    int sampleRate() const noexcept { return sample_rate_; }
+    int channels() const noexcept { return channels_; }
+
+private:
+    QString path_;
+    QString error_message_;
+    int sample_rate_{};
+    int channels_{};
+};
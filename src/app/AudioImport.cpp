@@ -1,4 +1,5 @@
 #include <array>
+#include <chrono>
 #include <string_view>
 #include <vector>
 #include <algorithm>
@@ -15,6 +16,8 @@
 #include <qcorofuture.h>
 
 #include "AudioImport.h"
+#include "AudioFileReader.h"
+#include "AudioResampler.h"
 
 #include "logging.h"
 
@@ -31,122 +34,6 @@ std::ostream& operator << (std::ostream& os, AudioImport::State state) {
     return os << names.at(size_t(state));
 }
 
-namespace {
-static inline float clamp1(float x) {
-    return std::max(-1.0f, std::min(1.0f, x));
-}
-
-static void bufferToFloatMono(const QAudioBuffer& buf, std::vector<float>& monoOut)
-{
-    const QAudioFormat fmt = buf.format();
-    const int ch = fmt.channelCount();
-    const int frames = buf.frameCount();
-    if (ch <= 0 || frames <= 0) return;
-
-    monoOut.resize(size_t(frames));
-
-    auto downmix = [&](auto sampleAtIndexToFloat) {
-        for (int f = 0; f < frames; ++f) {
-            float s = 0.0f;
-            const int base = f * ch;
-            for (int c = 0; c < ch; ++c) s += sampleAtIndexToFloat(base + c);
-            s /= float(ch);
-            monoOut[size_t(f)] = clamp1(s);
-        }
-    };
-
-    switch (fmt.sampleFormat()) {
-    case QAudioFormat::Int16: {
-        const auto* p = buf.constData<qint16>();
-        downmix([&](int i){ return float(p[i]) / 32768.0f; });
-        break;
-    }
-    case QAudioFormat::Int32: {
-        const auto* p = buf.constData<qint32>();
-        downmix([&](int i){ return float(p[i]) / 2147483648.0f; });
-        break;
-    }
-    case QAudioFormat::Float: {
-        const auto* p = buf.constData<float>();
-        downmix([&](int i){ return p[i]; });
-        break;
-    }
-    case QAudioFormat::UInt8: {
-        const auto* p = buf.constData<quint8>();
-        // 8-bit unsigned PCM: 128 is “zero”
-        downmix([&](int i){ return (float(p[i]) - 128.0f) / 128.0f; });
-        break;
-    }
-    default:
-        monoOut.clear(); // unsupported; you can add more if you ever see them
-        break;
-    }
-}
-
-class LinearResampler {
-public:
-    void reset(int inRate, int outRate) {
-        inRate_ = inRate;
-        outRate_ = outRate;
-        pos_ = 0.0;
-        haveLast_ = false;
-        last_ = 0.0f;
-    }
-
-    // Append input samples (mono float) and produce output samples (mono float)
-    void process(const float* in, size_t n, std::vector<float>& out) {
-        if (inRate_ <= 0 || outRate_ <= 0 || n == 0) return;
-
-        if (inRate_ == outRate_) {
-            out.insert(out.end(), in, in + n);
-            if (n) { last_ = in[n-1]; haveLast_ = true; }
-            return;
-        }
-
-        const double step = double(inRate_) / double(outRate_); // input samples per output sample
-
-        // We treat the input as preceded by last_ so interpolation at chunk boundary is continuous.
-        auto sampleAt = [&](size_t idx) -> float {
-            if (idx == 0) return haveLast_ ? last_ : in[0];
-            return in[idx - 1];
-        };
-
-        // pos_ is in “input sample units”, where 0.0 refers to the boundary between last_ and in[0]
-        // and 1.0 corresponds to in[0], 2.0 -> in[1], etc.
-        const double maxPos = double(n); // up to n (exclusive for safe idx+1)
-        while (pos_ + step <= maxPos) {
-            const double x = pos_;
-            const size_t i = size_t(std::floor(x));
-            const double frac = x - double(i);
-
-            const float a = sampleAt(i);
-            const float b = (i + 1 <= n) ? sampleAt(i + 1) : sampleAt(n);
-            out.push_back(a + float((b - a) * frac));
-
-            pos_ += step;
-        }
-
-        // Keep pos_ small and carry remainder into next chunk
-        pos_ -= double(n);
-
-        last_ = in[n - 1];
-        haveLast_ = true;
-    }
-
-    // Optional: call at end; for linear resampling we usually don’t need to flush.
-    void flush(std::vector<float>&) {}
-
-private:
-    int inRate_{0};
-    int outRate_{0};
-    double pos_{0.0};
-    bool haveLast_{false};
-    float last_{0.0f};
-};
-
-
-} // anon ns
-
 AudioImport::AudioImport(QObject *parent)
 : QObject(parent)
 {
@@ -163,6 +50,16 @@ std::span<const float> AudioImport::mono16kData() const noexcept
     return samples_;
 }
 
+std::shared_ptr<const std::vector<float> > AudioImport::takeMono16kData()
+{
+    assert(state() == State::Done);
+    if (state() != State::Done) {
+        LOG_WARN_N << "takeMono16kData() called but state is not Done";
+        return {};
+    }
+    return std::make_shared<const std::vector<float>>(std::move(samples_));
+}
+
 QString AudioImport::errorMessage() const noexcept {
     std::lock_guard lock(mutex_);
     return error_message_;
@@ -187,19 +84,37 @@ bool AudioImport::decode(const QString &filePath)
 {
     LOG_DEBUG_N << "Decoding audio file: " << filePath;
     setState(State::Decoding);
+    setErrorMessage("");
+    samples_.clear();
+
+    // WAV, raw PCM and FLAC are read directly from a memory mapped file
+    AudioFileReader reader{filePath};
+    switch (reader.readMono16k(samples_)) {
+    case AudioFileReader::Result::Ok:
+        setState(State::Done);
+        return true;
+    case AudioFileReader::Result::Failed:
+        LOG_WARN_N << "Failed to read " << filePath << ": " << reader.errorMessage();
+        setErrorMessage(reader.errorMessage());
+        setState(State::Error);
+        return false;
+    case AudioFileReader::Result::NotHandled:
+        samples_.clear();
+        break;
+    }
 
     QAudioDecoder decoder;
     decoder.setSource(QUrl::fromLocalFile(filePath));
 
     bool ok = true;
-    setErrorMessage("");
-    samples_.clear();
 
     QEventLoop loop;
 
     std::vector<float> chunkMono;
-    LinearResampler resampler;
+    PolyphaseResampler resampler;
     bool resampler_init = false;
+    size_t input_samples = 0;
+    chrono::steady_clock::duration resample_time{};
 
     connect(&decoder, &QAudioDecoder::bufferReady, this, [&]() {
         const QAudioBuffer buf = decoder.read();
@@ -209,12 +124,22 @@ bool AudioImport::decode(const QString &filePath)
         if (!resampler_init) {
             resampler.reset(fmt.sampleRate(), 16000);
             resampler_init = true;
+
+            // Allocate the output once if the decoder knows the duration
+            if (const auto duration_ms = decoder.duration(); duration_ms > 0) {
+                samples_.reserve(static_cast<size_t>(duration_ms) * 16 + 16000);
+            }
         }
 
-        bufferToFloatMono(buf, chunkMono);
+        toMonoFloat({reinterpret_cast<const std::byte *>(buf.constData<char>()),
+                     static_cast<size_t>(buf.byteCount())},
+                    fmt, chunkMono);
         if (chunkMono.empty()) return;
 
-        resampler.process(chunkMono.data(), chunkMono.size(), samples_);
+        input_samples += chunkMono.size();
+        const auto start = chrono::steady_clock::now();
+        resampler.process(chunkMono, samples_);
+        resample_time += chrono::steady_clock::now() - start;
     });
 
     connect(&decoder, &QAudioDecoder::finished, &loop, &QEventLoop::quit);
@@ -231,6 +156,17 @@ bool AudioImport::decode(const QString &filePath)
     decoder.start();
     loop.exec();
 
+    if (ok && resampler_init) {
+        resampler.flush(samples_);
+
+        const auto seconds = chrono::duration<double>(resample_time).count();
+        LOG_DEBUG_N << "Resampled " << input_samples << " samples from "
+                    << resampler.inRate() << " Hz to " << samples_.size() << " samples at 16000 Hz in "
+                    << (seconds * 1000.0) << " ms ("
+                    << (seconds > 0.0 ? static_cast<double>(input_samples) / seconds / 1e6 : 0.0)
+                    << " M input samples/s)";
+    }
+
     setState(ok ? State::Done : State::Error);
     return ok;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <span>
 #include <vector>
 #include <mutex>
@@ -36,11 +37,19 @@ public:
      */
     [[nodiscard]] std::span<const float> mono16kData() const noexcept;
 
+    /*! Moves the decoded samples out of the importer.
+     *
+     *  Lets the caller share the buffer (for example with a transcriber)
+     *  without copying it. The importer has no data afterwards.
+     */
+    [[nodiscard]] std::shared_ptr<const std::vector<float>> takeMono16kData();
+
     QString errorMessage() const noexcept;
 
     /*! Decodes audio from the media file at the given path.
      *
-     * Supported input formats depend on the underlying audio decoding library.
+     * PCM WAV, raw PCM and FLAC files are decoded by AudioFileReader. Other
+     * input formats depend on the underlying audio decoding library.
      *
      * Note that this is not a general audio decoding class - it's only meant to provide
      *      audio data suitable for processing by the projects transcription engine, which today
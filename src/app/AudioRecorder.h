@@ -21,7 +21,8 @@ class AudioRecorder : public QObject
 public:
     explicit AudioRecorder(const QAudioDevice &device, QObject *parent = nullptr);
 
-    QAudioFormat format() const { return format_; }
+    // Format of the recorded PCM (after any conversion of the device format)
+    QAudioFormat format() const { return captureDevice_->outputFormat(); }
 
     void start();
     void stop();
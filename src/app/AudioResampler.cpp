@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <numbers>
+#include <numeric>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define QVW_RESAMPLER_X86 1
+#   include <immintrin.h>
+#elif defined(__aarch64__)
+#   define QVW_RESAMPLER_NEON 1
+#   include <arm_neon.h>
+#endif
+
+#include "AudioResampler.h"
+
+using namespace std;
+
+namespace {
+
+// Kernel length in samples at the lower of the two rates.
+// With the Kaiser window below this gives a ~0.05 wide transition band.
+constexpr int base_taps = 96;
+
+// ~80 dB stop-band attenuation
+constexpr double stopband_db = 80.0;
+constexpr double kaiser_beta = 0.1102 * (stopband_db - 8.7);
+
+// Rates like 44101 Hz reduce to huge phase counts. Above this we use the
+// nearest stored phase, which adds at most 1/8192 sample of jitter.
+constexpr int max_phases = 4096;
+
+using dot_fn_t = float (*)(const float *a, const float *b, int n);
+
+// n is always a multiple of 8
+float dotScalar(const float *a, const float *b, int n)
+{
+    array<float, 8> acc{};
+    for (int i = 0; i < n; i += 8) {
+        for (int j = 0; j < 8; ++j) {
+            acc[j] += a[i + j] * b[i + j];
+        }
+    }
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+#ifdef QVW_RESAMPLER_X86
+__attribute__((target("avx2,fma")))
+float dotAvx2(const float *a, const float *b, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i < n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    return _mm_cvtss_f32(sum);
+}
+#endif
+
+#ifdef QVW_RESAMPLER_NEON
+float dotNeon(const float *a, const float *b, int n)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (int i = 0; i < n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1));
+}
+#endif
+
+dot_fn_t selectDot()
+{
+#ifdef QVW_RESAMPLER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return dotAvx2;
+    }
+#endif
+#ifdef QVW_RESAMPLER_NEON
+    return dotNeon;
+#endif
+    return dotScalar;
+}
+
+const dot_fn_t dot = selectDot();
+
+// Zeroth order modified Bessel function of the first kind
+double besselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    const double q = x * x / 4.0;
+    for (int k = 1; k < 64; ++k) {
+        term *= q / (static_cast<double>(k) * static_cast<double>(k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+double sinc(double x)
+{
+    if (std::abs(x) < 1e-12) {
+        return 1.0;
+    }
+    const double px = std::numbers::pi * x;
+    return std::sin(px) / px;
+}
+
+} // anon ns
+
+PolyphaseResampler::PolyphaseResampler(int inRate, int outRate)
+{
+    reset(inRate, outRate);
+}
+
+void PolyphaseResampler::reset(int inRate, int outRate)
+{
+    assert(inRate > 0 && outRate > 0);
+    in_rate_ = inRate;
+    out_rate_ = outRate;
+
+    const int g = std::gcd(inRate, outRate);
+    up_ = outRate / g;
+    down_ = inRate / g;
+
+    bank_.clear();
+    history_.clear();
+    input_count_ = 0;
+    next_out_ = 0;
+    flushed_ = false;
+
+    if (isPassThrough()) {
+        taps_ = 0;
+        phases_ = 0;
+        first_ = 0;
+        return;
+    }
+
+    // When downsampling, the kernel must be longer (in input samples) to keep
+    // the same transition width relative to the output rate.
+    const double ratio = std::max(1.0, static_cast<double>(down_) / static_cast<double>(up_));
+    taps_ = static_cast<int>(std::ceil(base_taps * ratio / 8.0)) * 8;
+    phases_ = std::min(up_, max_phases);
+
+    // Cut-off in cycles per input sample, placed so the stop-band starts at the
+    // Nyquist frequency of the lower rate.
+    const double transition = (stopband_db - 7.95) / (14.36 * base_taps);
+    const double cutoff = (0.5 - transition / 2.0) / ratio;
+    const double half = taps_ / 2.0;
+    const double i0_beta = besselI0(kaiser_beta);
+
+    // When phases are rounded, the last ones round up to a whole sample. That
+    // phase is stored too, rather than wrapping to the next input sample.
+    const int stored = phases_ < up_ ? phases_ + 1 : phases_;
+    bank_.resize(static_cast<size_t>(stored) * static_cast<size_t>(taps_));
+    for (int q = 0; q < stored; ++q) {
+        const double frac = static_cast<double>(q) / static_cast<double>(phases_);
+        float *phase = bank_.data() + static_cast<size_t>(q) * static_cast<size_t>(taps_);
+        double sum = 0.0;
+        for (int i = 0; i < taps_; ++i) {
+            // Taps are stored in reverse order, so the dot product runs forward
+            // over the input. Tap i weights the input at distance d from the output time.
+            const double d = half - 1.0 - i + frac;
+            const double x = d / half;
+            const double w = std::abs(x) < 1.0 ? besselI0(kaiser_beta * std::sqrt(1.0 - x * x)) / i0_beta : 0.0;
+            const double h = 2.0 * cutoff * sinc(2.0 * cutoff * d) * w;
+            phase[i] = static_cast<float>(h);
+            sum += h;
+        }
+
+        // Unity gain at DC for every phase
+        if (sum != 0.0) {
+            for (int i = 0; i < taps_; ++i) {
+                phase[i] = static_cast<float>(phase[i] / sum);
+            }
+        }
+    }
+
+    // Input before the first sample is silence
+    first_ = -taps_;
+    history_.assign(static_cast<size_t>(taps_), 0.0f);
+}
+
+size_t PolyphaseResampler::expectedOutput(size_t inputSamples) const noexcept
+{
+    if (isPassThrough()) {
+        return inputSamples;
+    }
+    return static_cast<size_t>((static_cast<uint64_t>(inputSamples) * up_ + down_ - 1) / down_);
+}
+
+void PolyphaseResampler::process(std::span<const float> in, std::vector<float> &out)
+{
+    assert(in_rate_ > 0 && "reset() must be called first");
+    if (in.empty()) {
+        return;
+    }
+
+    if (isPassThrough()) {
+        out.insert(out.end(), in.begin(), in.end());
+        return;
+    }
+
+    history_.insert(history_.end(), in.begin(), in.end());
+    input_count_ += static_cast<int64_t>(in.size());
+    emitAvailable(out);
+}
+
+void PolyphaseResampler::flush(std::vector<float> &out)
+{
+    if (isPassThrough() || flushed_) {
+        return;
+    }
+
+    // Feed the samples the filter still needs after the last input
+    flushed_ = true;
+    history_.resize(history_.size() + static_cast<size_t>(taps_ / 2), 0.0f);
+    emitAvailable(out);
+}
+
+void PolyphaseResampler::resampleRange(std::span<const float> in, size_t begin, size_t end, float *dst) const
+{
+    assert(in_rate_ > 0 && "reset() must be called first");
+    assert(end <= expectedOutput(in.size()));
+    if (begin >= end) {
+        return;
+    }
+
+    if (isPassThrough()) {
+        std::copy(in.begin() + static_cast<ptrdiff_t>(begin), in.begin() + static_cast<ptrdiff_t>(end), dst);
+        return;
+    }
+
+    const int64_t half = taps_ / 2;
+    const auto size = static_cast<int64_t>(in.size());
+    vector<float> edge(static_cast<size_t>(taps_));
+
+    const uint64_t pos = static_cast<uint64_t>(begin) * static_cast<uint64_t>(down_);
+    int64_t base = static_cast<int64_t>(pos / static_cast<uint64_t>(up_));
+    int phase = static_cast<int>(pos % static_cast<uint64_t>(up_));
+    const int64_t base_step = down_ / up_;
+    const int phase_step = down_ % up_;
+
+    for (size_t k = begin; k < end; ++k) {
+        const int64_t from = base + half - taps_ + 1;
+        const float *x = nullptr;
+        if (from >= 0 && from + taps_ <= size) {
+            x = in.data() + from;
+        } else {
+            // Before the first and after the last input sample is silence
+            for (int i = 0; i < taps_; ++i) {
+                const auto ix = from + i;
+                edge[static_cast<size_t>(i)] = ix >= 0 && ix < size ? in[static_cast<size_t>(ix)] : 0.0f;
+            }
+            x = edge.data();
+        }
+        *dst++ = dot(phaseTaps(phase), x, taps_);
+
+        base += base_step;
+        phase += phase_step;
+        if (phase >= up_) {
+            phase -= up_;
+            ++base;
+        }
+    }
+}
+
+std::vector<float> PolyphaseResampler::resample(std::span<const float> in, int inRate, int outRate)
+{
+    PolyphaseResampler r{inRate, outRate};
+    std::vector<float> out(r.expectedOutput(in.size()));
+    r.resampleRange(in, 0, out.size(), out.data());
+    return out;
+}
+
+const float *PolyphaseResampler::phaseTaps(int phase) const noexcept
+{
+    const int q = phases_ == up_
+                      ? phase
+                      : static_cast<int>((static_cast<int64_t>(phase) * phases_ + up_ / 2) / up_);
+    return bank_.data() + static_cast<size_t>(q) * static_cast<size_t>(taps_);
+}
+
+void PolyphaseResampler::emitAvailable(std::vector<float> &out)
+{
+    const int64_t half = taps_ / 2;
+
+    // Output k is at input time k * down / up, and uses the input up to
+    // floor(k * down / up) + half.
+    const int64_t available = input_count_ + (flushed_ ? half : 0);
+    const int64_t limit = available - half; // floor(k * down / up) must be below this
+    if (limit <= 0) {
+        return;
+    }
+
+    uint64_t end = (static_cast<uint64_t>(limit) * up_ + down_ - 1) / down_;
+    if (flushed_) {
+        end = std::min<uint64_t>(end, expectedOutput(static_cast<size_t>(input_count_)));
+    }
+    if (end <= next_out_) {
+        return;
+    }
+
+    const auto count = static_cast<size_t>(end - next_out_);
+    const auto start = out.size();
+    out.resize(start + count);
+
+    const uint64_t pos = next_out_ * static_cast<uint64_t>(down_);
+    int64_t base = static_cast<int64_t>(pos / static_cast<uint64_t>(up_));
+    int phase = static_cast<int>(pos % static_cast<uint64_t>(up_));
+    const int64_t base_step = down_ / up_;
+    const int phase_step = down_ % up_;
+
+    float *dst = out.data() + start;
+    for (size_t i = 0; i < count; ++i) {
+        const float *x = history_.data() + (base + half - taps_ + 1 - first_);
+        dst[i] = dot(phaseTaps(phase), x, taps_);
+
+        base += base_step;
+        phase += phase_step;
+        if (phase >= up_) {
+            phase -= up_;
+            ++base;
+        }
+    }
+    next_out_ = end;
+
+    // Drop the input the next output no longer needs
+    const int64_t keep_from = base + half - taps_ + 1;
+    if (const auto drop = keep_from - first_; drop > 0) {
+        const auto n = std::min<size_t>(static_cast<size_t>(drop), history_.size());
+        history_.erase(history_.begin(), history_.begin() + static_cast<ptrdiff_t>(n));
+        first_ += static_cast<int64_t>(n);
+    }
+}
+
+void toMonoFloat(std::span<const std::byte> interleaved, const QAudioFormat &format, std::vector<float> &out)
+{
+    out.clear();
+
+    const int ch = format.channelCount();
+    const int bytes_per_frame = format.bytesPerFrame();
+    if (ch <= 0 || bytes_per_frame <= 0) {
+        return;
+    }
+
+    const auto frames = interleaved.size() / static_cast<size_t>(bytes_per_frame);
+    if (frames == 0) {
+        return;
+    }
+
+    auto convert = [&]<typename T>(const T *src, auto toFloat) {
+        out.resize(frames);
+        float *dst = out.data();
+        if (ch == 1) {
+            for (size_t f = 0; f < frames; ++f) {
+                dst[f] = std::clamp(toFloat(src[f]), -1.0f, 1.0f);
+            }
+            return;
+        }
+
+        const float scale = 1.0f / static_cast<float>(ch);
+        for (size_t f = 0; f < frames; ++f) {
+            const T *frame = src + f * static_cast<size_t>(ch);
+            float s = 0.0f;
+            for (int c = 0; c < ch; ++c) {
+                s += toFloat(frame[c]);
+            }
+            dst[f] = std::clamp(s * scale, -1.0f, 1.0f);
+        }
+    };
+
+    const auto *data = interleaved.data();
+    switch (format.sampleFormat()) {
+    case QAudioFormat::Int16:
+        convert(reinterpret_cast<const qint16 *>(data), [](qint16 v) { return float(v) / 32768.0f; });
+        break;
+    case QAudioFormat::Int32:
+        convert(reinterpret_cast<const qint32 *>(data), [](qint32 v) { return float(v) / 2147483648.0f; });
+        break;
+    case QAudioFormat::Float:
+        convert(reinterpret_cast<const float *>(data), [](float v) { return v; });
+        break;
+    case QAudioFormat::UInt8:
+        // 8-bit unsigned PCM: 128 is "zero"
+        convert(reinterpret_cast<const quint8 *>(data), [](quint8 v) { return (float(v) - 128.0f) / 128.0f; });
+        break;
+    default:
+        break; // unsupported
+    }
+}
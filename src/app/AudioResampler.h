@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <QAudioFormat>
+
+/*! Windowed-sinc polyphase resampler for mono float audio.
+ *
+ *  The rate ratio is reduced to up/down (L/M). The low-pass prototype filter
+ *  is split into L phases that are precomputed when the rates are set, so each
+ *  output sample is a single dot product over the most recent input samples.
+ *
+ *  The dot product uses AVX2/FMA or NEON when available, selected at runtime
+ *  on x86.
+ *
+ *  The resampler is streaming: process() can be called with arbitrary chunk sizes,
+ *  and flush() emits the tail that is held back by the filter delay.
+ */
+class PolyphaseResampler
+{
+public:
+    PolyphaseResampler() = default;
+    PolyphaseResampler(int inRate, int outRate);
+
+    void reset(int inRate, int outRate);
+
+    int inRate() const noexcept { return in_rate_; }
+    int outRate() const noexcept { return out_rate_; }
+
+    // True if the rates are equal and process() only copies
+    bool isPassThrough() const noexcept { return up_ == down_; }
+
+    //! Number of output samples produced for the given number of input samples
+    size_t expectedOutput(size_t inputSamples) const noexcept;
+
+    //! Appends the output for `in` to `out`. Grows `out` at most once per call.
+    void process(std::span<const float> in, std::vector<float>& out);
+
+    //! Appends the remaining output held back by the filter delay.
+    void flush(std::vector<float>& out);
+
+    /*! Computes the outputs [begin, end) for the complete input `in` into `dst`.
+     *
+     *  Gives the same samples as process() followed by flush(), but does not
+     *  touch the streaming state, so separate ranges can run in parallel.
+     */
+    void resampleRange(std::span<const float> in, size_t begin, size_t end, float *dst) const;
+
+    //! Resamples a complete buffer in one go.
+    static std::vector<float> resample(std::span<const float> in, int inRate, int outRate);
+
+private:
+    void emitAvailable(std::vector<float>& out);
+    const float *phaseTaps(int phase) const noexcept;
+
+    int in_rate_{};
+    int out_rate_{};
+    int up_{1};
+    int down_{1};
+    int taps_{};            // per phase, multiple of 8
+    int phases_{};          // stored phases, == up_ unless up_ is very large
+    std::vector<float> bank_;   // phases_ (+ 1 if fewer than up_) * taps_, taps in reverse order
+
+    std::vector<float> history_; // input, starting at absolute index first_
+    int64_t first_{};
+    int64_t input_count_{};      // total input samples received
+    uint64_t next_out_{};        // index of the next output sample
+    bool flushed_{false};
+};
+
+/*! Converts interleaved PCM in `format` to mono float in the range [-1, 1].
+ *
+ *  Channels are averaged. Replaces the content of `out`. Unsupported
+ *  sample formats leave `out` empty.
+ */
+void toMonoFloat(std::span<const std::byte> interleaved, const QAudioFormat& format, std::vector<float>& out);
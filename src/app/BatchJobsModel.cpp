@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <array>
+#include <string_view>
+
+#include <QFileInfo>
+
+#include "BatchJobsModel.h"
+
+#include "logging.h"
+
+using namespace std;
+
+std::ostream& operator << (std::ostream& os, BatchJobsModel::Status status) {
+    static constexpr auto names = to_array<string_view>({
+        "Queued",
+        "Decoding",
+        "Decoded",
+        "Transcribing",
+        "Transcribed",
+        "PostProcessing",
+        "Done",
+        "Failed"
+    });
+
+    return os << names.at(static_cast<size_t>(status));
+}
+
+BatchJobsModel::BatchJobsModel(QObject *parent)
+    : QAbstractListModel(parent)
+{
+}
+
+void BatchJobsModel::addFiles(const QList<QUrl> &files)
+{
+    vector<QString> paths;
+    for (const auto& url : files) {
+        auto path = url.toLocalFile();
+        if (path.isEmpty()) {
+            LOG_WARN_N << "Ignoring non-local file: " << url.toString();
+            continue;
+        }
+        if (ranges::any_of(jobs_, [&](const Job& j) { return j.path == path; })) {
+            LOG_DEBUG_N << "File already in the batch: " << path;
+            continue;
+        }
+        paths.push_back(std::move(path));
+    }
+
+    if (paths.empty()) {
+        return;
+    }
+
+    const auto first = count();
+    beginInsertRows({}, first, first + static_cast<int>(paths.size()) - 1);
+    for (auto& path : paths) {
+        jobs_.push_back({.path = std::move(path)});
+    }
+    endInsertRows();
+    emit countChanged();
+}
+
+void BatchJobsModel::remove(int row)
+{
+    if (row < 0 || row >= count()) {
+        return;
+    }
+
+    beginRemoveRows({}, row, row);
+    jobs_.erase(jobs_.begin() + row);
+    endRemoveRows();
+    emit countChanged();
+}
+
+void BatchJobsModel::clear()
+{
+    beginResetModel();
+    jobs_.clear();
+    endResetModel();
+    emit countChanged();
+}
+
+void BatchJobsModel::resetStatus()
+{
+    for (int row = 0; row < count(); ++row) {
+        auto path = std::move(jobs_[static_cast<size_t>(row)].path);
+        jobs_[static_cast<size_t>(row)] = {.path = std::move(path)};
+    }
+    if (!jobs_.empty()) {
+        emit dataChanged(index(0), index(count() - 1));
+    }
+}
+
+void BatchJobsModel::setStatus(int row, Status status, const QString &error)
+{
+    auto& j = jobs_.at(static_cast<size_t>(row));
+    LOG_DEBUG_N << "Batch job #" << row << " " << j.path << " changed status from "
+                << j.status << " to " << status;
+    j.status = status;
+    j.error = error;
+    rowChanged(row);
+}
+
+void BatchJobsModel::setAudioSeconds(int row, double seconds)
+{
+    jobs_.at(static_cast<size_t>(row)).audio_seconds = seconds;
+    rowChanged(row);
+}
+
+void BatchJobsModel::setDone(int row, const QString &outputPath, double seconds)
+{
+    auto& j = jobs_.at(static_cast<size_t>(row));
+    j.status = Status::Done;
+    j.output_path = outputPath;
+    j.seconds = seconds;
+    rowChanged(row);
+}
+
+int BatchJobsModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.isValid()) {
+        return 0;
+    }
+    return count();
+}
+
+QVariant BatchJobsModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() < 0 || index.row() >= count()) {
+        return {};
+    }
+
+    const auto& j = job(index.row());
+    switch (static_cast<Roles>(role)) {
+    case Roles::Name:
+        return QFileInfo{j.path}.fileName();
+    case Roles::Path:
+        return j.path;
+    case Roles::Status:
+        return static_cast<int>(j.status);
+    case Roles::StatusText:
+        return statusText(j);
+    case Roles::AudioSeconds:
+        return j.audio_seconds;
+    case Roles::Seconds:
+        return j.seconds;
+    case Roles::OutputPath:
+        return j.output_path;
+    case Roles::Error:
+        return j.error;
+    }
+
+    return {};
+}
+
+QHash<int, QByteArray> BatchJobsModel::roleNames() const
+{
+    QHash<int, QByteArray> roles;
+    roles[static_cast<int>(Roles::Name)] = "name";
+    roles[static_cast<int>(Roles::Path)] = "path";
+    roles[static_cast<int>(Roles::Status)] = "status";
+    roles[static_cast<int>(Roles::StatusText)] = "statusText";
+    roles[static_cast<int>(Roles::AudioSeconds)] = "audioSeconds";
+    roles[static_cast<int>(Roles::Seconds)] = "seconds";
+    roles[static_cast<int>(Roles::OutputPath)] = "outputPath";
+    roles[static_cast<int>(Roles::Error)] = "error";
+    return roles;
+}
+
+QString BatchJobsModel::statusText(const Job &job)
+{
+    switch (job.status) {
+    case Status::Queued:
+        return tr("Queued");
+    case Status::Decoding:
+        return tr("Decoding");
+    case Status::Decoded:
+        return tr("Waiting for transcription");
+    case Status::Transcribing:
+        return tr("Transcribing");
+    case Status::Transcribed:
+        return tr("Waiting for post-processing");
+    case Status::PostProcessing:
+        return tr("Post-processing");
+    case Status::Done:
+        if (job.seconds > 0.0) {
+            return tr("Done in %1 s").arg(job.seconds, 0, 'f', 1);
+        }
+        return tr("Done");
+    case Status::Failed:
+        return tr("Failed: %1").arg(job.error);
+    }
+    return {};
+}
+
+void BatchJobsModel::rowChanged(int row)
+{
+    const auto ix = index(row);
+    emit dataChanged(ix, ix);
+}
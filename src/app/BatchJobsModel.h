@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+
+#include <QObject>
+#include <QQmlComponent>
+#include <QAbstractListModel>
+#include <QUrl>
+
+/*! List of audio files for batch transcription, with per-file progress.
+ *
+ *  The AppEngine owns the instance and updates the status of each job as the
+ *  file moves through the pipeline (decode, transcribe, rewrite/translate).
+ */
+class BatchJobsModel : public QAbstractListModel
+{
+    Q_OBJECT
+    QML_ELEMENT
+    Q_PROPERTY(int count READ count NOTIFY countChanged)
+
+public:
+    enum class Status {
+        Queued,
+        Decoding,
+        Decoded,
+        Transcribing,
+        Transcribed,
+        PostProcessing,
+        Done,
+        Failed
+    };
+    Q_ENUM(Status)
+
+    enum class Roles {
+        Name = Qt::UserRole + 1,
+        Path,
+        Status,
+        StatusText,
+        AudioSeconds,
+        Seconds,
+        OutputPath,
+        Error
+    };
+
+    struct Job {
+        QString path;
+        Status status{Status::Queued};
+        double audio_seconds{};
+        double seconds{}; // wall time from start of decoding until done
+        QString output_path;
+        QString error;
+    };
+
+    explicit BatchJobsModel(QObject *parent = nullptr);
+
+    Q_INVOKABLE void addFiles(const QList<QUrl>& files);
+    Q_INVOKABLE void remove(int row);
+    Q_INVOKABLE void clear();
+
+    //! Sets all jobs back to Queued, keeping the files
+    void resetStatus();
+
+    int count() const noexcept { return static_cast<int>(jobs_.size()); }
+    const Job& job(int row) const { return jobs_.at(static_cast<size_t>(row)); }
+
+    void setStatus(int row, Status status, const QString& error = {});
+    void setAudioSeconds(int row, double seconds);
+    void setDone(int row, const QString& outputPath, double seconds);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+signals:
+    void countChanged();
+
+private:
+    static QString statusText(const Job& job);
+    void rowChanged(int row);
+
+    std::vector<Job> jobs_;
+};
+
+std::ostream& operator << (std::ostream& os, BatchJobsModel::Status status);
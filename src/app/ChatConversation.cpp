@@ -1,3 +1,5 @@
+#include <QUuid>
+
 #include "ChatConversation.h"
 #include "ChatMessagesModel.h"
 
@@ -25,6 +27,7 @@ void updateModel(ChatMessagesModel *m,
 
 ChatConversation::ChatConversation(QString name, QObject *parent)
     : QObject{parent}, name_{std::move(name)}
+    , id_{QUuid::createUuid().toString(QUuid::WithoutBraces)}
 {
 }
 
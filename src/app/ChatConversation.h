@@ -22,6 +22,16 @@ public:
 
     const QString& name() const { return name_; }
 
+    //! Unique id. Used for files that belong to the conversation.
+    const QString& id() const { return id_; }
+
+    /*! The KV snapshot of the chat session after the last reply, or empty.
+     *
+     *  Restoring it lets the conversation continue without replaying it.
+     */
+    const QString& kvSnapshot() const { return kv_snapshot_; }
+    void setKvSnapshot(QString path) { kv_snapshot_ = std::move(path); }
+
     void addMessage(std::shared_ptr<ChatMessage> message);
     void updateLastMessage(std::string text); // for partial updates from assistant
     void finalizeLastMessage();
@@ -51,6 +61,8 @@ signals:
 
 private:
     QString name_;
+    QString id_;
+    QString kv_snapshot_;
     std::deque<std::shared_ptr<ChatMessage>> messages_;
     ChatMessagesModel *model_{nullptr};
     std::array<const ChatMessage *, 2> last_message_cache_{nullptr, nullptr};
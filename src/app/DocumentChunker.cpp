@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <utility>
+
+#include <QSettings>
+
+#include "DocumentChunker.h"
+
+#include "logging.h"
+
+using namespace std;
+
+namespace {
+
+struct Break {
+    qsizetype at{};
+    QStringView separator; // what joins the results on each side
+};
+
+// Where a chunk that must end before limit should end
+Break breakBefore(const QString& text, qsizetype from, qsizetype limit)
+{
+    // Prefer paragraphs, then lines, sentences and words, but not in the first half of the window
+    static constexpr auto separators = to_array<pair<QStringView, QStringView>>({
+        {u"\n\n", u"\n\n"}, {u"\n", u"\n"}, {u". ", u" "}, {u"! ", u" "}, {u"? ", u" "}, {u" ", u" "}});
+
+    const auto min = from + (limit - from) / 2;
+    for (const auto& [sep, join] : separators) {
+        const auto at = text.lastIndexOf(sep, limit - sep.size());
+        if (at >= min) {
+            return {at + sep.size(), join};
+        }
+    }
+
+    // In the middle of a word
+    return {limit, {}};
+}
+
+} // anon ns
+
+DocumentChunker::DocumentChunker()
+{
+    QSettings settings;
+    max_chars_ = std::max(0, settings.value("doc.chunk.max_chars", max_chars_).toInt());
+    overlap_chars_ = std::clamp(settings.value("doc.chunk.overlap_chars", overlap_chars_).toInt(), 0, max_chars_ / 4);
+    parallel_ = std::clamp(settings.value("doc.chunk.parallel", parallel_).toInt(), 1, 16);
+    consolidate_ = settings.value("doc.chunk.consolidate", consolidate_).toBool();
+}
+
+void DocumentChunker::fitContext(int maxTokens)
+{
+    // Conservative for most languages
+    constexpr int chars_per_token = 3;
+    constexpr int min_chunk_chars = 2000;
+
+    if (maxTokens <= 0 || max_chars_ == 0) {
+        return;
+    }
+
+    // A chunk needs room for its context, itself and about as much output.
+    // The instructions get 1024 tokens.
+    const int chars = std::max(0, maxTokens - 1024) * chars_per_token / 2;
+
+    // Process fewer chunks at a time before making them smaller
+    const auto parallel = parallel_;
+    while (parallel_ > 1 && chars / parallel_ < max_chars_ + overlap_chars_) {
+        parallel_ /= 2;
+    }
+
+    const auto max_chars = max_chars_;
+    max_chars_ = std::clamp(chars / parallel_ - overlap_chars_, std::min(min_chunk_chars, max_chars_), max_chars_);
+
+    if (parallel_ != parallel || max_chars_ != max_chars) {
+        LOG_INFO_N << "Memory allows a context of " << maxTokens << " tokens. Using chunks of "
+                   << max_chars_ << " characters, " << parallel_ << " at a time.";
+    }
+}
+
+std::vector<DocumentChunker::Chunk> DocumentChunker::split(const QString &text) const
+{
+    if (!needsChunking(text)) {
+        return {Chunk{.text = text}};
+    }
+
+    return split(text, max_chars_);
+}
+
+std::vector<DocumentChunker::Chunk> DocumentChunker::split(const Chunk &chunk) const
+{
+    constexpr qsizetype min_chunk_chars = 200;
+
+    if (chunk.text.size() < min_chunk_chars * 2) {
+        return {};
+    }
+
+    auto chunks = split(chunk.text, chunk.text.size() / 2 + 1);
+    if (!chunks.empty()) {
+        chunks.front().context = chunk.context;
+        chunks.front().separator = chunk.separator;
+    }
+    return chunks;
+}
+
+std::vector<DocumentChunker::Chunk> DocumentChunker::split(const QString &text, qsizetype maxChars) const
+{
+    vector<Chunk> chunks;
+    qsizetype start = 0;
+    QStringView separator;
+    while (start < text.size()) {
+        const auto limit = start + maxChars;
+        const auto brk = (limit >= text.size()) ? Break{.at = text.size()} : breakBefore(text, start, limit);
+        const auto end = brk.at;
+
+        Chunk chunk{.text = text.mid(start, end - start).trimmed(), .separator = separator.toString()};
+        if (overlap_chars_ > 0 && start > 0) {
+            // Start the context at a word
+            auto from = std::max<qsizetype>(0, start - overlap_chars_);
+            if (const auto space = text.indexOf(u' ', from); space >= 0 && space < start) {
+                from = space + 1;
+            }
+            chunk.context = text.mid(from, start - from).trimmed();
+        }
+
+        if (!chunk.text.isEmpty()) {
+            chunks.push_back(std::move(chunk));
+        }
+        separator = brk.separator;
+        start = end;
+    }
+
+    LOG_DEBUG_N << "Split a document of " << text.size() << " characters into " << chunks.size() << " chunks";
+    return chunks;
+}
+
+QString DocumentChunker::stitch(const std::vector<Chunk> &chunks, const QStringList &parts)
+{
+    assert(chunks.size() == static_cast<size_t>(parts.size()));
+
+    QString text;
+    for (qsizetype i = 0; i < parts.size(); ++i) {
+        if (i > 0) {
+            text += chunks[static_cast<size_t>(i)].separator;
+        }
+        text += parts[i].trimmed();
+    }
+    return text;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+
+#include <QString>
+#include <QStringList>
+
+/*! Splits documents that are too long for one prompt into chunks.
+ *
+ *  A chunk ends at a paragraph break if there is one in the second half of
+ *  the window, else at a line break, a sentence end or a space. The tail of
+ *  the previous chunk is passed along as context, so that the model knows
+ *  what came before, but it is not part of the chunk itself. The results are
+ *  stitched back in order, joined by the kind of break the text was split at,
+ *  so a transcript on one line stays on one line.
+ *
+ *  Settings:
+ *  - `doc.chunk.max_chars` (12000). Documents up to this size are not split. 0 disables chunking.
+ *  - `doc.chunk.overlap_chars` (400). Context from the previous chunk.
+ *  - `doc.chunk.parallel` (4). Chunks processed together, as sequences in one context.
+ *  - `doc.chunk.consolidate` (false). Smooth the seams with a final pass over the result.
+ */
+class DocumentChunker
+{
+public:
+    struct Chunk {
+        QString context; // the end of the previous chunk
+        QString text;
+        QString separator; // between the previous chunk and this one: a paragraph or line break, a space, or nothing
+    };
+
+    DocumentChunker();
+
+    bool needsChunking(const QString& text) const noexcept {
+        return max_chars_ > 0 && text.size() > max_chars_;
+    }
+
+    /*! Makes the chunks, and the number processed together, fit in a context of maxTokens.
+     *
+     *  Used when memory is tight. 0 means no limit.
+     */
+    void fitContext(int maxTokens);
+
+    std::vector<Chunk> split(const QString& text) const;
+
+    /*! Splits a chunk in about two halves, for when its output did not fit.
+     *
+     *  The first half keeps the context of the chunk. Empty if the chunk is
+     *  too small to split.
+     */
+    std::vector<Chunk> split(const Chunk& chunk) const;
+
+    int parallel() const noexcept { return parallel_; }
+    bool consolidate() const noexcept { return consolidate_; }
+
+    // A final pass is only done if the result is not much larger than what one batch of chunks holds
+    bool canConsolidate(const QString& text) const noexcept {
+        return text.size() <= static_cast<qsizetype>(max_chars_) * parallel_;
+    }
+
+    //! Joins parts[i], the result for chunks[i], in order
+    static QString stitch(const std::vector<Chunk>& chunks, const QStringList& parts);
+
+private:
+    std::vector<Chunk> split(const QString& text, qsizetype maxChars) const;
+
+    int max_chars_{12000};
+    int overlap_chars_{400};
+    int parallel_{4};
+    bool consolidate_{false};
+};
@@ -2,6 +2,8 @@
 #include <thread>
 #include <span>
 
+#include <QSettings>
+
 #include "GeneralModel.h"
 
 #include "ScopedTimer.h"
@@ -46,6 +48,11 @@ QCoro::Task<bool> GeneralModel::prompt(std::string text, const qvw::LlamaSession
                            << timer.elapsed() << " seconds.";
         LOG_DEBUG_EX(*this) << "Prompt completed with output length="
                             << session_ctx_->getFullTextResult().size();
+        if (draft_instance_) {
+            const auto stats = session_ctx_->speculativeStats();
+            LOG_DEBUG_EX(*this) << "Speculative decoding with " << draft_instance_->modelId()
+                                << " so far: drafted=" << stats.drafted << ", accepted=" << stats.accepted;
+        }
 
         return result;
     });
@@ -57,12 +64,159 @@ QCoro::Task<bool> GeneralModel::prompt(std::string text, const qvw::LlamaSession
     const auto result = co_await future;
     LOG_TRACE_EX(*this) << "TranscribeRecording command completed.";
     final_text_ = session_ctx_->getFullTextResult();
+    truncated_ = session_ctx_->truncated();
     const auto qtext = QString::fromStdString(final_text_);
     emit partialTextAvailable(qtext);
     emit finalTextAvailable(qtext);
     co_return result;
 }
 
+QCoro::Task<QStringList> GeneralModel::promptFanOut(std::string prefix,
+                                                    std::vector<std::string> suffixes,
+                                                    const qvw::LlamaSessionCtx::Params& params)
+{
+    auto results = make_shared<vector<string>>();
+    auto truncated = make_shared<vector<size_t>>();
+    auto op = make_unique<Model::Operation>([this, prefix=std::move(prefix), suffixes=std::move(suffixes),
+                                             params, results, truncated]() -> bool {
+        LOG_DEBUG_EX(*this) << "Prompting GeneralModel with a shared prefix length=" << prefix.size()
+                            << " and " << suffixes.size() << " suffixes";
+
+        assert(session_ctx_ != nullptr);
+        if (!session_ctx_) {
+            return failed("Session context is null in promptFanOut");
+        }
+
+        ScopedTimer timer;
+        const bool result = session_ctx_->promptFanOut(prefix, suffixes, params, *results);
+        *truncated = session_ctx_->truncatedSequences();
+        LOG_INFO_EX(*this) << "Fan-out prompt with " << suffixes.size() << " sequences completed in "
+                           << timer.elapsed() << " seconds.";
+        return result;
+    });
+
+    auto future = op->future();
+    enqueueCommand(std::move(op));
+    QStringList texts;
+    const auto ok = co_await future;
+    truncated_sequences_ = std::move(*truncated);
+    if (ok) {
+        for (const auto& text : *results) {
+            texts.append(QString::fromStdString(text));
+        }
+    }
+    co_return texts;
+}
+
+QCoro::Task<bool> GeneralModel::saveState(QString path)
+{
+    auto op = make_unique<Model::Operation>([this, path]() -> bool {
+        assert(session_ctx_ != nullptr);
+        if (!session_ctx_) {
+            return failed("Session context is null in saveState");
+        }
+
+        return session_ctx_->saveState(path.toStdString());
+    });
+
+    auto future = op->future();
+    enqueueCommand(std::move(op));
+    co_return co_await future;
+}
+
+QCoro::Task<bool> GeneralModel::loadState(QString path)
+{
+    auto op = make_unique<Model::Operation>([this, path]() -> bool {
+        assert(session_ctx_ != nullptr);
+        if (!session_ctx_) {
+            return failed("Session context is null in loadState");
+        }
+
+        ScopedTimer timer;
+        const bool result = session_ctx_->loadState(path.toStdString());
+        if (result) {
+            LOG_DEBUG_EX(*this) << "Restored session state from " << path
+                                << " in " << timer.elapsed() << " seconds.";
+        }
+        return result;
+    });
+
+    auto future = op->future();
+    enqueueCommand(std::move(op));
+    co_return co_await future;
+}
+
+QCoro::Task<bool> GeneralModel::setDraftModel(QString modelId, int draftTokens)
+{
+    assert(session_ctx_);
+    assert(!draft_instance_);
+
+    auto instance = co_await ModelMgr::instance().getInstance(ModelKind::GENERAL, modelId);
+    if (!instance || !co_await instance->load()) {
+        LOG_WARN_EX(*this) << "Failed to load draft model " << modelId;
+        co_return false;
+    }
+
+    auto draft = dynamic_pointer_cast<qvw::LlamaCtx>(instance->modelCtx());
+    auto op = make_unique<Model::Operation>([this, draft, draftTokens]() -> bool {
+        return session_ctx_->setDraftModel(draft, draftTokens);
+    });
+
+    auto future = op->future();
+    enqueueCommand(std::move(op));
+    if (!co_await future) {
+        LOG_WARN_EX(*this) << "Cannot use " << modelId << " as draft model for " << modelInfo().id;
+        co_await instance->unload();
+        co_return false;
+    }
+
+    draft_instance_ = std::move(instance);
+    co_return true;
+}
+
+QCoro::Task<bool> GeneralModel::loadModel()
+{
+    if (!co_await Model::loadModel()) {
+        co_return false;
+    }
+
+    QSettings settings;
+    const auto draft_id = settings.value(QString::fromStdString("speculative." + name() + ".draft_model")).toString();
+    if (!draft_id.isEmpty()) {
+        co_await setDraftModel(draft_id, settings.value("speculative.draft_tokens", 8).toInt());
+    }
+    co_return true;
+}
+
+QCoro::Task<bool> GeneralModel::unloadModel()
+{
+    if (draft_instance_) {
+        if (session_ctx_) {
+            // The session holds a reference to the draft model
+            auto op = make_unique<Model::Operation>([this]() -> bool {
+                return session_ctx_->setDraftModel({});
+            });
+            auto future = op->future();
+            enqueueCommand(std::move(op));
+            co_await future;
+        }
+        co_await draft_instance_->unload();
+        draft_instance_.reset();
+    }
+
+    co_return co_await Model::unloadModel();
+}
+
+int GeneralModel::maxContextTokens() const
+{
+    if (auto instance = modelInstance()) {
+        if (auto ctx = dynamic_pointer_cast<qvw::LlamaCtx>(instance->modelCtx())) {
+            return ctx->maxContextTokens();
+        }
+    }
+    return 0;
+}
+
 bool GeneralModel::createContextImpl()
 {
     LOG_DEBUG_EX(*this) << "Creating a context/session for a loaded Whisper model";
@@ -86,6 +240,10 @@ bool GeneralModel::createContextImpl()
         emit partialTextAvailable(QString::fromStdString(partial_text));
     });
 
+    session_ctx_->setOnSequenceTextCallback([this](size_t index, const std::string &text) {
+        emit sequenceTextAvailable(static_cast<int>(index), QString::fromStdString(text));
+    });
+
     return true;
 }
 
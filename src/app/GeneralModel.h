@@ -1,5 +1,9 @@
 #pragma once
 
+#include <vector>
+
+#include <QStringList>
+
 #include "Model.h"
 #include "qvw/LlamaEngine.h"
 
@@ -18,16 +22,60 @@ public:
 
     QCoro::Task<bool> prompt(std::string text, const qvw::LlamaSessionCtx::Params& params);
 
+    // True if the output of the last prompt() was cut short
+    bool truncated() const noexcept {
+        return truncated_;
+    }
+
+    /*! Completes prefix + suffix for each of the suffixes, evaluating the prefix once.
+     *
+     *  Returns one result per suffix, or an empty list on failure.
+     *  sequenceTextAvailable() reports the progress of each of them.
+     */
+    QCoro::Task<QStringList> promptFanOut(std::string prefix,
+                                          std::vector<std::string> suffixes,
+                                          const qvw::LlamaSessionCtx::Params& params);
+
+    // The indexes of the results of the last promptFanOut() that were cut short, in order
+    const std::vector<size_t>& truncatedSequences() const noexcept {
+        return truncated_sequences_;
+    }
+
+    // Saves/restores the conversation in the session. Runs in the model's thread.
+    QCoro::Task<bool> saveState(QString path);
+    QCoro::Task<bool> loadState(QString path);
+
+    /*! Loads the model, and the draft model for speculative decoding if one is set.
+     *
+     *  The draft model is a smaller model from the same family, set like
+     *  "speculative.doc-rewrite-model.draft_model" for the model named
+     *  "doc-rewrite-model". If it can't be used, decoding goes on without it.
+     */
+    QCoro::Task<bool> loadModel() override;
+    QCoro::Task<bool> unloadModel() override;
+
+    // The largest context the loaded model has memory for. 0 if unknown.
+    int maxContextTokens() const;
+
     const std::string& finalText() const noexcept override {
         return final_text_;
     }
 
+signals:
+    void sequenceTextAvailable(int index, const QString &text);
+
 protected:
     bool createContextImpl() override;
     bool stopImpl() override;
 
 private:
+    // Loads a smaller model with the same vocabulary for speculative decoding
+    QCoro::Task<bool> setDraftModel(QString modelId, int draftTokens);
+
     std::shared_ptr<qvw::LlamaSessionCtx> session_ctx_;
+    std::shared_ptr<ModelInstance> draft_instance_;
     std::unique_ptr<Config> config_;
     std::string final_text_;
+    bool truncated_{false};
+    std::vector<size_t> truncated_sequences_;
 };
@@ -109,8 +109,8 @@ public:
     virtual ModelKind kind() const noexcept  = 0;
     virtual const std::string& finalText() const noexcept = 0;
     [[nodiscard]] QCoro::Task<bool> init(const QString &modelId);
-    [[nodiscard]] QCoro::Task<bool> loadModel();
-    [[nodiscard]] QCoro::Task<bool> unloadModel();
+    [[nodiscard]] virtual QCoro::Task<bool> loadModel();
+    [[nodiscard]] virtual QCoro::Task<bool> unloadModel();
 
     void cancel();
     void reset();
@@ -163,6 +163,7 @@ protected:
 signals:
     void partialTextAvailable(const QString &text);
     void finalTextAvailable(const QString &text);
+    void progressChanged(int percent); // for long operations, from the worker thread
     void modelReady();
     void errorOccurred(const QString &message);
     void stateChanged(const Model *model, ModelState state);
@@ -447,6 +447,20 @@ bool verifyFileChecksum(const QString& filePath, const QString& expectedChecksum
     return true;
 }
 
+// Maps the value of a setting to an option. Unknown values give the first one.
+template <typename T>
+T settingOption(const QSettings& settings, const QString& key, std::initializer_list<std::pair<QStringView, T>> options)
+{
+    const auto value = settings.value(key, options.begin()->first.toString()).toString().trimmed().toLower();
+    for (const auto& [name, option] : options) {
+        if (name == value) {
+            return option;
+        }
+    }
+    LOG_WARN_N << "Unknown value \"" << value << "\" for " << key << ". Using " << options.begin()->first.toString();
+    return options.begin()->second;
+}
+
 } // anon ns
 
 std::ostream& operator<<(std::ostream &os, ModelKind kind) {
@@ -549,7 +563,13 @@ std::optional<ModelInfo> ModelMgr::findModelByName(ModelKind kind, const QString
 qvw::WhisperEngine &ModelMgr::whisperEngine() {
 
     if (!whisper_engine_) {
-        whisper_engine_ = qvw::WhisperEngine::create({});
+        // Concurrent sessions share these threads
+        QSettings settings;
+        qvw::WhisperEngine::WhisperCreateParams params;
+        params.threads = settings.value("transcribe.scheduler.threads", -1).toInt();
+        params.max_parallel_jobs = std::max(1, settings.value("transcribe.scheduler.max_parallel", 2).toInt());
+        params.min_job_threads = std::max(1, settings.value("transcribe.scheduler.min_job_threads", 2).toInt());
+        whisper_engine_ = qvw::WhisperEngine::create(params);
         if (!whisper_engine_) {
             LOG_ERROR_N << "Failed to create Whisper engine instance.";
             throw std::runtime_error{"Failed to create Whisper engine instance."};
@@ -975,20 +995,28 @@ bool ModelInstance::loadWhisper()
 
     auto& wengine = ModelMgr::instance().whisperEngine();
     const filesystem::path path = full_path_.toStdString();
-    const bool force_cpu = QSettings{}.value("models/disable_gpu", false).toBool();
+    QSettings settings;
+    const bool force_cpu = settings.value("models/disable_gpu", false).toBool();
     qvw::WhisperEngineLoadParams params;
     params.use_gpu = (QVW_GPU_BACKEND_AVAILABLE != 0) && !force_cpu;
     params.flash_attn = false;
     params.gpu_device = 0;
+    // Idle whisper states are kept so back-to-back sessions start without allocating
+    params.max_idle_states = std::max(0, settings.value("transcribe.state_pool.max_idle", 2).toInt());
+    params.max_idle_state_bytes = static_cast<size_t>(
+        std::max(0LL, settings.value("transcribe.state_pool.max_idle_mb", 0).toLongLong())) * 1024 * 1024;
     ScopedTimer timer;
     LOG_DEBUG_N << "Loading Whisper model \"" << modelId() << "\" from path: " << full_path_;
-    model_ctx_ = wengine.loadWhisper(modelId().toStdString(), path, params);
-    if (!model_ctx_) {
+    auto whisper_ctx = wengine.loadWhisper(modelId().toStdString(), path, params);
+    if (!whisper_ctx) {
         LOG_ERROR_N << "Failed to load Whisper model from path: " << full_path_;
         return false;
     }
+    const auto load_stats = whisper_ctx->loadStats();
+    model_ctx_ = std::move(whisper_ctx);
     LOG_INFO_N << "Whisper model \"" << modelId() << "\" loaded in "
-                << timer.elapsed() << " seconds from path: " << full_path_;
+                << timer.elapsed() << " seconds from path: " << full_path_
+                << " (blocks_read=" << load_stats.blocks_read << ")";
     emit modelReady();
     return true;
 }
@@ -997,9 +1025,33 @@ bool ModelInstance::loadLlama()
 {
     auto& llama_engine = ModelMgr::instance().llamaEngine();
     const filesystem::path path = full_path_.toStdString();
-    const bool force_cpu = QSettings{}.value("models/disable_gpu", false).toBool();
+    QSettings settings;
+    const bool force_cpu = settings.value("models/disable_gpu", false).toBool();
     qvw::LlamaEngineLoadParams params;
     params.n_gpu_layers = ((QVW_GPU_BACKEND_AVAILABLE != 0) && !force_cpu) ? 999 : 0;
+    // The rewrite and translate instructions are the same for every recording
+    params.prefix_cache_bytes = static_cast<size_t>(
+        std::max(0LL, settings.value("models/llama_prefix_cache_mb", 256).toLongLong())) * 1024 * 1024;
+    params.max_idle_contexts = std::max(0, settings.value("models/llama_idle_contexts", 2).toInt());
+    params.memory_budget = static_cast<size_t>(
+        std::max(0LL, settings.value("models/llama_memory_budget_mb", 0).toLongLong())) * 1024 * 1024;
+
+    // Context options. "auto" lets the wrapper decide from the available memory.
+    using lp_t = qvw::LlamaEngineLoadParams;
+    params.kv_type = settingOption<lp_t::KvType>(settings, "models/llama_kv_type", {
+        {u"auto", lp_t::KvType::Auto},
+        {u"f16", lp_t::KvType::F16},
+        {u"q8_0", lp_t::KvType::Q8_0},
+        {u"q4_0", lp_t::KvType::Q4_0}
+    });
+    params.flash_attn = settingOption<lp_t::FlashAttn>(settings, "models/llama_flash_attn", {
+        {u"auto", lp_t::FlashAttn::Auto},
+        {u"off", lp_t::FlashAttn::Off},
+        {u"on", lp_t::FlashAttn::On}
+    });
+    params.n_ubatch = std::max(0, settings.value("models/llama_ubatch", 0).toInt());
+    params.offload_kqv = settings.value("models/llama_offload_kqv", true).toBool();
+    params.defrag_thold = settings.value("models/llama_defrag_thold", -1.0).toFloat();
     ScopedTimer timer;
     LOG_DEBUG_N << "Loading Llama model \"" << modelId() << "\" from path: " << full_path_;
     model_ctx_ = llama_engine.loadLlama(modelId().toStdString(), path, params);
@@ -21,17 +21,20 @@ std::pair<bool /* json */, std::string /* content or json */> toLog(const Transc
 
 namespace {
 
-std::vector<float> compactPcmBySilence(const std::vector<float>& input, int sampleRate)
+using sample_spans_t = std::vector<Transcriber::SampleSpan>;
+
+// Returns the parts of the input that contain speech, in order.
+// If the VAD is disabled, the whole input is returned as one span.
+sample_spans_t detectSpeechSpans(std::span<const float> input, int sampleRate)
 {
     if (input.empty() || sampleRate <= 0) {
-        return input;
+        return {};
     }
 
     QSettings settings;
     const bool vad_enabled = settings.value("transcribe.vad.enabled", true).toBool();
-    const bool post_skip_silence = settings.value("transcribe.post.skip_silence", true).toBool();
-    if (!vad_enabled || !post_skip_silence) {
-        return input;
+    if (!vad_enabled) {
+        return {{0, input.size()}};
     }
 
     const int frame_ms = std::max(10, settings.value("transcribe.vad.frame_ms", 20).toInt());
@@ -122,22 +125,46 @@ std::vector<float> compactPcmBySilence(const std::vector<float>& input, int samp
         }
     }
 
-    std::vector<float> output;
-    output.reserve(input.size());
+    sample_spans_t spans;
     for (int i = 0; i < frame_count; ++i) {
         if (!keep[static_cast<size_t>(i)]) {
             continue;
         }
         const size_t start = static_cast<size_t>(i) * static_cast<size_t>(frame_samples);
         const size_t end = std::min(input.size(), start + static_cast<size_t>(frame_samples));
-        output.insert(output.end(), input.begin() + static_cast<ptrdiff_t>(start), input.begin() + static_cast<ptrdiff_t>(end));
+        if (!spans.empty() && spans.back().end == start) {
+            spans.back().end = end;
+        } else {
+            spans.push_back({start, end});
+        }
     }
 
-    // If VAD compaction removed everything or almost everything, keep original as safe fallback.
-    if (output.size() < static_cast<size_t>(frame_samples)) {
-        return input;
+    return spans;
+}
+
+// Returns the speech parts of the input, or an empty vector if the input should be used as is.
+std::vector<float> compactPcmBySilence(std::span<const float> input, const sample_spans_t& speech)
+{
+    QSettings settings;
+    const bool post_skip_silence = settings.value("transcribe.post.skip_silence", true).toBool();
+    if (!post_skip_silence
+        || (speech.size() == 1 && speech.front().begin == 0 && speech.front().end == input.size())) {
+        return {};
     }
 
+    size_t total = 0;
+    for (const auto& span : speech) {
+        total += span.end - span.begin;
+    }
+
+    std::vector<float> output;
+    output.reserve(total);
+    for (const auto& span : speech) {
+        output.insert(output.end(), input.begin() + static_cast<ptrdiff_t>(span.begin), input.begin() + static_cast<ptrdiff_t>(span.end));
+    }
+
+    // If VAD compaction removed everything, the empty output makes the
+    // caller keep the original as safe fallback.
     return output;
 }
 
@@ -153,6 +180,9 @@ Transcriber::Transcriber(std::string name,
 {
     const auto *m = dynamic_cast<Model*>(this);
     assert(m);
+    if (pcmFilePath.isEmpty()) {
+        return; // Recording source is set with setRecordingSource()
+    }
     if (!file_.open(QIODevice::ReadOnly)) {
         LOG_ERROR_EX(*m) << "Failed to open file for writing: " << pcmFilePath;
         throw runtime_error("Failed to open file for writing");
@@ -178,6 +208,13 @@ QCoro::Task<bool> Transcriber::transcribeChunks()
 QCoro::Task<bool> Transcriber::transcribeRecording()
 {
     auto op = make_unique<Model::Operation>([this]() -> bool {
+        if (!recording_source_.samples.empty()) {
+            LOG_TRACE_EX(*this) << "Processing " << recording_source_.samples.size()
+                                << " in-memory samples from worker thread";
+            processRecordingPcm(recording_source_.samples);
+            return true;
+        }
+
         LOG_TRACE_EX(*this) << "Callig processRecordingFromFile... from worker thread";
         processRecordingFromFile();
         LOG_TRACE_EX(*this) << "processRecordingFromFile completed.";
@@ -193,6 +230,31 @@ QCoro::Task<bool> Transcriber::transcribeRecording()
     co_return result;
 }
 
+std::string Transcriber::recordingSignature() const
+{
+    // The speech detection and post pass settings change what the engine sees
+    QSettings settings;
+    auto keys = settings.allKeys();
+    keys.sort();
+
+    string sig = "language=" + language() + ";vocabulary=" + vocabulary() + ";";
+    for (const auto& key : keys) {
+        if (key.startsWith("transcribe.vad.") || key.startsWith("transcribe.post.")) {
+            sig += key.toStdString() + "=" + settings.value(key).toString().toStdString() + ";";
+        }
+    }
+
+    // Selective re-transcription depends on the live segments
+    if (!prior_segments_.empty() && settings.value("transcribe.post.selective", false).toBool()) {
+        sig += "prior=";
+        for (const auto& segment : prior_segments_) {
+            sig += to_string(segment.t0_ms) + ":" + to_string(segment.t1_ms) + ":" + segment.text + "|";
+        }
+    }
+
+    return sig;
+}
+
 void Transcriber::stopTranscribing() {
     if (state() < ModelState::STOPPING) {
         LOG_TRACE_EX(*this) << "Stopping transcriber.";
@@ -285,6 +347,7 @@ bool Transcriber::transcribeSegments()
             } while (chunk_read < chunk_size);
 
             if (chunk_read > 0) {
+                chunk_offset_ = fc.offset + static_cast<qint64>(read);
                 read += chunk_read;
                 try {
                     processChunk({reinterpret_cast<const uint8_t*>(buffer.data()), chunk_read},
@@ -340,11 +403,28 @@ void Transcriber::processRecordingFromFile()
         total_read += bytes;
     }
 
-    auto compacted_pcm = compactPcmBySilence(whisper_pcm, format_.sampleRate());
-    if (compacted_pcm.size() != whisper_pcm.size()) {
-        LOG_DEBUG_EX(*this) << name() << ": Silence compaction reduced samples from "
-                            << whisper_pcm.size() << " to " << compacted_pcm.size();
+    processRecordingPcm(whisper_pcm);
+}
+
+void Transcriber::processRecordingPcm(std::span<const float> pcm)
+{
+    const auto speech = detectSpeechSpans(pcm, format_.sampleRate());
+
+    if (!prior_segments_.empty()
+        && QSettings{}.value("transcribe.post.selective", false).toBool()) {
+        if (processRecordingSelective(pcm, speech)) {
+            return;
+        }
+        LOG_DEBUG_EX(*this) << name() << ": Selective re-transcription declined. Using a full pass.";
+    }
+
+    const auto compacted_pcm = compactPcmBySilence(pcm, speech);
+    if (compacted_pcm.empty()) {
+        processRecording(pcm);
+        return;
     }
 
+    LOG_DEBUG_EX(*this) << name() << ": Silence compaction reduced samples from "
+                        << pcm.size() << " to " << compacted_pcm.size();
     processRecording(std::span<const float>(compacted_pcm.data(), compacted_pcm.size()));
 }
@@ -17,6 +17,37 @@ class Transcriber : public Model
 {
     Q_OBJECT
 public:
+    /*! A transcribed part of the recording, with the decoder's confidence.
+     *
+     *  Times are relative to the start of the recording.
+     */
+    struct ScoredSegment {
+        int64_t t0_ms{};
+        int64_t t1_ms{};
+        std::string text;
+        float avg_logprob{};
+        float no_speech_prob{};
+        float compression_ratio{};
+        float min_token_p{1.0F}; // lowest probability of a text token, if known
+    };
+
+    using scored_segments_t = std::vector<ScoredSegment>;
+
+    // Range of samples in the recording, [begin, end)
+    struct SampleSpan {
+        size_t begin{};
+        size_t end{};
+    };
+
+    /*! A complete recording as mono float samples at the transcriber's sample rate.
+     *
+     *  `owner` keeps the memory behind `samples` alive (a vector, a mapped file, ...).
+     */
+    struct PcmSource {
+        std::span<const float> samples;
+        std::shared_ptr<const void> owner;
+    };
+
     Transcriber(std::string name,
                 std::unique_ptr<Config> &&config,
                 chunk_queue_t *queue,
@@ -34,17 +65,99 @@ public:
 
     const std::string& language() const noexcept;
 
+    /*! Segments produced by the live pass.
+     *
+     *  Only valid after the transcriber is stopped.
+     */
+    const scored_segments_t& scoredSegments() const noexcept {
+        return scored_segments_;
+    }
+
+    /*! Segments from a previous (live) pass over the same recording.
+     *
+     *  If set, the post pass may keep the confident ones and only
+     *  re-decode the rest of the speech.
+     */
+    void setPriorSegments(scored_segments_t segments) {
+        prior_segments_ = std::move(segments);
+    }
+
+    /*! Use `source` for transcribeRecording() instead of reading the PCM file.
+     *
+     *  The samples are passed to the engine as they are, without any copy.
+     */
+    void setRecordingSource(PcmSource source) {
+        recording_source_ = std::move(source);
+    }
+
+    /*! Segments produced by the last transcribeRecording().
+     *
+     *  Times are relative to the audio passed to the engine.
+     */
+    const scored_segments_t& recordingSegments() const noexcept {
+        return recording_segments_;
+    }
+
+    //! Language of the last transcribeRecording(), detected or forced.
+    const std::string& recordingLanguage() const noexcept {
+        return recording_language_;
+    }
+
+    /*! Identifies everything besides the audio and the model that
+     *  affects the result of transcribeRecording().
+     *
+     *  Used as part of the key for cached transcripts.
+     */
+    virtual std::string recordingSignature() const;
+
 protected:
     virtual void processChunk(std::span<const uint8_t> data,
                               bool lastChunk = false,
                               bool forceProcess = false) = 0;
     virtual bool processRecording(std::span<const float> data) = 0;
 
+    /*! Post pass that only re-decodes the parts of the recording not
+     *  confidently covered by the prior segments.
+     *
+     *  @param data The complete recording.
+     *  @param speech The parts of the recording that contain speech.
+     *  @return false if the subclass declined, in which case the full pass is used.
+     */
+    virtual bool processRecordingSelective(std::span<const float> data,
+                                           const std::vector<SampleSpan>& speech) {
+        return false;
+    }
+
+    // Byte offset in the PCM file of the data passed to processChunk()
+    qint64 chunkOffset() const noexcept {
+        return chunk_offset_;
+    }
+
+    const scored_segments_t& priorSegments() const noexcept {
+        return prior_segments_;
+    }
+
+    void addScoredSegment(ScoredSegment && segment) {
+        scored_segments_.push_back(std::move(segment));
+    }
+
+    void setRecordingResult(scored_segments_t segments, std::string language) {
+        recording_segments_ = std::move(segments);
+        recording_language_ = std::move(language);
+    }
+
 private:
     bool transcribeSegments();
     void processRecordingFromFile();
+    void processRecordingPcm(std::span<const float> pcm);
 
     std::string      language_;
+    qint64           chunk_offset_{};
+    scored_segments_t scored_segments_;
+    scored_segments_t prior_segments_;
+    scored_segments_t recording_segments_;
+    std::string      recording_language_;
+    PcmSource        recording_source_;
     chunk_queue_t    *queue_;
     QFile            file_;
     QAudioFormat     format_;
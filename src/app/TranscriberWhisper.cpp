@@ -4,6 +4,7 @@
 #include <QSettings>
 
 #include <algorithm>
+#include <cctype>
 #include <cmath>
 
 #include "TranscriberWhisper.h"
@@ -19,6 +20,47 @@ std::pair<bool /* json */, std::string /* content or json */> toLog(const Transc
 
 using namespace std;
 
+namespace {
+
+// Same measure as whisper's temperature fallback uses: repetitive
+// (often hallucinated) text compresses unusually well.
+float compressionRatio(const std::string& text)
+{
+    if (text.empty()) {
+        return 0.0F;
+    }
+
+    const auto packed = qCompress(reinterpret_cast<const uchar *>(text.data()),
+                                  static_cast<qsizetype>(text.size()));
+    // qCompress() prepends a 4 byte length header
+    const auto size = std::max<qsizetype>(1, packed.size() - 4);
+    return static_cast<float>(text.size()) / static_cast<float>(size);
+}
+
+qvw::WhisperSessionCtx::WhisperFullParams decodingPreset(const std::string& name)
+{
+    using params_t = qvw::WhisperSessionCtx::WhisperFullParams;
+    if (auto params = params_t::Preset(name)) {
+        return *params;
+    }
+    LOG_WARN_N << "Unknown Whisper decoding preset '" << name << "'. Using 'balanced'.";
+    return params_t::Balanced();
+}
+
+void appendText(std::string& out, const std::string& text)
+{
+    if (text.empty()) {
+        return;
+    }
+    if (!out.empty() && !std::isspace(static_cast<unsigned char>(out.back()))
+        && !std::isspace(static_cast<unsigned char>(text.front()))) {
+        out += ' ';
+    }
+    out += text;
+}
+
+} // anon ns
+
 TranscriberWhisper::TranscriberWhisper(std::string name, std::unique_ptr<Config> &&cfg, chunk_queue_t *queue, const QString &filePath, QAudioFormat format)
     : Transcriber(std::move(name), std::move(cfg), queue, filePath, format)
 {
@@ -26,13 +68,30 @@ TranscriberWhisper::TranscriberWhisper(std::string name, std::unique_ptr<Config>
     max_live_latency_ms_ = std::max(200, settings.value("transcribe.live.max_latency_ms", 1500).toInt());
     min_live_submit_ms_ = std::max(50, settings.value("transcribe.live.min_submit_ms", 220).toInt());
     min_live_rms_dbfs_ = std::clamp(settings.value("transcribe.live.min_rms_dbfs", -52.0).toFloat(), -90.0F, -20.0F);
+    min_avg_logprob_ = settings.value("transcribe.post.selective.min_avg_logprob", -1.0).toFloat();
+    max_no_speech_prob_ = std::clamp(settings.value("transcribe.post.selective.max_no_speech_prob", 0.6).toFloat(), 0.0F, 1.0F);
+    max_compression_ratio_ = std::max(1.0F, settings.value("transcribe.post.selective.max_compression_ratio", 2.4).toFloat());
+    min_token_p_ = std::clamp(settings.value("transcribe.post.selective.min_token_p", 0.0).toFloat(), 0.0F, 1.0F);
+    max_redo_ratio_ = std::clamp(settings.value("transcribe.post.selective.max_redo_ratio", 0.6).toDouble(), 0.0, 1.0);
+    redo_padding_ms_ = std::max(0, settings.value("transcribe.post.selective.padding_ms", 200).toInt());
+    fit_live_audio_ctx_ = settings.value("transcribe.live.fit_audio_ctx", true).toBool();
+    min_live_audio_ctx_ = std::clamp(settings.value("transcribe.live.min_audio_ctx", 256).toInt(), 64, 1500);
+    pin_live_language_ = settings.value("transcribe.live.pin_language", true).toBool();
+    stream_live_mel_ = settings.value("transcribe.live.stream_mel", true).toBool();
+    min_language_detect_ms_ = std::clamp(settings.value("transcribe.live.language_detect_min_ms", 1500).toInt(), 500, 30000);
+    live_preset_ = settings.value("transcribe.live.preset", "live-fast").toString().toStdString();
+    post_preset_ = settings.value("transcribe.post.preset", "balanced").toString().toStdString();
 
     LOG_TRACE_EX(*this) << "TranscriberWhisper: constructor called for model "
                 << modelName()
                 << " with language '" << language()
                 << "', max_live_latency_ms=" << max_live_latency_ms_
                 << ", min_live_submit_ms=" << min_live_submit_ms_
-                << ", min_live_rms_dbfs=" << min_live_rms_dbfs_;
+                << ", min_live_rms_dbfs=" << min_live_rms_dbfs_
+                << ", live_preset=" << live_preset_
+                << ", pin_language=" << pin_live_language_
+                << ", stream_mel=" << stream_live_mel_
+                << ", post_preset=" << post_preset_;
 }
 
 TranscriberWhisper::~TranscriberWhisper()
@@ -53,11 +112,30 @@ bool TranscriberWhisper::createContextImpl()
 
     auto whisper_ctx = model_instance->modelCtx();
 
+    const ScopedTimer timer;
     session_ctx_ = whisper_ctx->createWhisperSession();
     if (!session_ctx_) {
         return failed("Failed to create Whisper session context in createContextImpl");
     }
 
+    if (auto *ctx = dynamic_cast<qvw::WhisperCtx *>(whisper_ctx.get())) {
+        const auto stats = ctx->statePoolStats();
+        LOG_DEBUG_EX(*this) << "Whisper session ready in " << timer.elapsed() << " seconds. State pool: idle="
+                            << stats.idle << ", in_use=" << stats.in_use
+                            << ", created=" << stats.created << ", reused=" << stats.reused
+                            << ", state_mb~" << (stats.state_bytes / (1024 * 1024));
+
+        if (const auto *engine = dynamic_cast<const qvw::WhisperEngine *>(&ctx->engine())) {
+            const auto sched = engine->schedulerStats();
+            const auto jobs = static_cast<double>(std::max<uint64_t>(1, sched.jobs));
+            LOG_DEBUG_EX(*this) << "Whisper scheduler: threads=" << sched.free_threads << '/' << sched.total_threads
+                                << " free, running=" << sched.running << ", queued=" << sched.queued
+                                << ", jobs=" << sched.jobs << ", missed_deadlines=" << sched.missed_deadlines
+                                << ", avg_queue_ms=" << (sched.queue_ms / jobs)
+                                << ", avg_run_ms=" << (sched.run_ms / jobs);
+        }
+    }
+
     return true;
 }
 
@@ -76,14 +154,23 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
 
     // Append voiced PCM16 as float; silence is handled by caller.
     if (!data.empty()) {
+        if (pending_pcm_.empty()) {
+            pending_start_ms_ = (chunkOffset() / static_cast<qint64>(sizeof(int16_t)) * 1000) / sample_rate_;
+        }
         auto *samplesI16 = reinterpret_cast<const int16_t*>(data.data());
         const auto newSamples = static_cast<int>(data.size() / sizeof(int16_t));
         if (newSamples > 0) {
+            const auto first_new = pending_pcm_.size();
             pending_pcm_.reserve(pending_pcm_.size() + static_cast<size_t>(newSamples));
             for (int i = 0; i < newSamples; ++i) {
                 pending_pcm_.push_back(samplesI16[i] / 32768.0F);
             }
             pending_samples_ += newSamples;
+
+            // Compute the mel spectrogram now, while we wait for the rest of the phrase
+            if (stream_live_mel_) {
+                session_ctx_->streamAppend(std::span<const float>{pending_pcm_}.subspan(first_new));
+            }
         }
     }
 
@@ -118,6 +205,7 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
                             << pending_duration_ms << "ms < " << min_live_submit_ms_ << "ms";
         pending_pcm_.clear();
         pending_samples_ = 0;
+        session_ctx_->streamReset();
         return;
     }
 
@@ -132,12 +220,13 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
                             << rms_dbfs << " < " << min_live_rms_dbfs_;
         pending_pcm_.clear();
         pending_samples_ = 0;
+        session_ctx_->streamReset();
         return;
     }
 
     // --- 4) Prepare Whisper parameters -----------------------------------
 
-    qvw::WhisperSessionCtx::WhisperFullParams params;
+    auto params = decodingPreset(live_preset_);
 
     // Threads
     const unsigned hwThreads = std::max(1u, std::thread::hardware_concurrency());
@@ -148,8 +237,7 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
     params.print_timestamps = true;
     params.offset_ms = 0;  // or leave default
 
-    const auto& lng = language();
-    params.language = lng.empty() ? nullptr : lng.c_str();
+    params.language = language();
 
     params.no_context     = false;
     params.single_segment = false;
@@ -160,6 +248,21 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
         params.token_timestamps = true;
     }
 
+    // Live chunks are a few seconds. No need to encode a full 30 s window.
+    params.fit_audio_ctx = fit_live_audio_ctx_;
+    params.min_audio_ctx = min_live_audio_ctx_;
+
+    // Token probabilities let the post pass redo segments with a single weak word
+    params.collect_tokens = min_token_p_ > 0.0F;
+
+    // Live chunks go before file and post-processing work on the same engine
+    params.priority = qvw::WhisperSessionCtx::WhisperFullParams::Priority::Live;
+    params.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{max_live_latency_ms_};
+
+    // With [Auto], detect the language once instead of in every chunk
+    params.pin_language = pin_live_language_;
+    params.min_detect_ms = min_language_detect_ms_;
+
 
     // Run Whisper only on new pending voiced audio.
 
@@ -171,9 +274,27 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
     const auto pcm_window = std::span<const float>(pending_pcm_.data(), pending_pcm_.size());
     qvw::WhisperSessionCtx::Transcript transcript_out;
     ScopedTimer timer;
-    const auto ok = session_ctx_->whisperFull(pcm_window, params, transcript_out);
+    const auto ok = stream_live_mel_
+        ? session_ctx_->whisperFullStreamed(params, transcript_out)
+        : session_ctx_->whisperFull(pcm_window, params, transcript_out);
+    const auto elapsed = timer.elapsed();
     LOG_DEBUG_EX(*this) << "whisper_full() returned ok =" << ok
-                        << " in " << timer.elapsed() << " seconds.";
+                        << " in " << elapsed << " seconds with preset " << live_preset_
+                        << ", audio_ctx=" << transcript_out.audio_ctx
+                        << ", threads=" << transcript_out.threads
+                        << ", queued " << transcript_out.queue_ms << " ms"
+                        << (transcript_out.audio_ctx_fallback ? " (fallback from a fitted context)" : "");
+    ++live_calls_;
+    live_whisper_seconds_ += elapsed;
+    live_queue_ms_ += transcript_out.queue_ms;
+    if (transcript_out.audio_ctx_fallback) {
+        ++live_ctx_fallbacks_;
+    }
+    if (ok && !transcript_out.language.empty() && transcript_out.language != live_language_) {
+        LOG_DEBUG_EX(*this) << "Live language changed from '" << live_language_
+                            << "' to '" << transcript_out.language << "'";
+        live_language_ = transcript_out.language;
+    }
 
     if (isCancelled()) {
         LOG_DEBUG_EX(*this) << "Cancelled during whisper_full() call. Aborting furtner processing.";
@@ -182,12 +303,34 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
 
     if (!ok) {
         LOG_ERROR_N << "whisper_full() failed";
+        if (stream_live_mel_) {
+            // The stream was consumed. Keep it in sync with pending_pcm_ for the next try.
+            session_ctx_->streamAppend(pcm_window);
+        }
         return;
     }
 
+    const int64_t window_end_ms = pending_start_ms_ + pending_duration_ms;
     std::string chunk_text;
     for (const auto& segment : transcript_out.segments) {
         chunk_text += segment.text;
+
+        if (!segment.text.empty()) {
+            float min_token_p = 1.0F;
+            for (const auto& token : transcript_out.segmentTokens(segment)) {
+                min_token_p = std::min(min_token_p, token.p);
+            }
+
+            addScoredSegment({
+                .t0_ms = std::min(window_end_ms, pending_start_ms_ + segment.t0_ms),
+                .t1_ms = std::min(window_end_ms, pending_start_ms_ + segment.t1_ms),
+                .text = segment.text,
+                .avg_logprob = segment.avg_logprob,
+                .no_speech_prob = segment.no_speech_prob,
+                .compression_ratio = compressionRatio(segment.text),
+                .min_token_p = min_token_p
+            });
+        }
     }
 
     final_text_ += chunk_text;
@@ -199,28 +342,28 @@ void TranscriberWhisper::processChunk(std::span<const uint8_t> data, bool lastCh
 
     if (lastChunk) {
         LOG_DEBUG_EX(*this) << "Final text:" << final_text_;
+        if (live_calls_ > 0) {
+            // Compare with transcribe.live.fit_audio_ctx=false for the encoder savings
+            LOG_INFO_EX(*this) << "Live transcription: " << live_calls_ << " whisper_full() calls, "
+                               << (live_whisper_seconds_ * 1000.0 / static_cast<double>(live_calls_))
+                               << " ms per chunk, fit_audio_ctx=" << fit_live_audio_ctx_
+                               << ", stream_mel=" << stream_live_mel_
+                               << ", " << live_ctx_fallbacks_ << " fallbacks to the full context, "
+                               << (live_queue_ms_ / static_cast<double>(live_calls_))
+                               << " ms average wait for the scheduler";
+        }
     }
 }
 
-bool TranscriberWhisper::processRecording(std::span<const float> data)
+qvw::WhisperSessionCtx::WhisperFullParams TranscriberWhisper::recordingParams() const
 {
-    LOG_DEBUG_EX(*this) << name() << ": Called with data size ="
-                << data.size();
-
-    assert(session_ctx_ != nullptr);
+    auto params = decodingPreset(post_preset_);
 
-    final_text_.clear();
-
-    qvw::WhisperSessionCtx::WhisperFullParams params;
-
-    // Threads
-    const unsigned hwThreads = std::max(1u, std::thread::hardware_concurrency());
     params.print_progress   = false;
     params.print_realtime   = false;
     params.print_timestamps = true;
 
-    const auto& lng = language();
-    params.language = lng.empty() ? nullptr : lng.c_str();
+    params.language = language();
 
     params.no_context     = false;
     params.single_segment = false;
@@ -229,14 +372,70 @@ bool TranscriberWhisper::processRecording(std::span<const float> data)
     params.token_timestamps = true;
 
     params.vocabulary = vocabulary();
+    return params;
+}
+
+std::string TranscriberWhisper::recordingSignature() const
+{
+    const auto params = recordingParams();
+    const auto opt = [](const auto& v) {
+        return v ? std::to_string(*v) : std::string{"-"};
+    };
+
+    return Transcriber::recordingSignature()
+           + "whisper:preset=" + post_preset_
+           + ";sampling=" + std::to_string(static_cast<int>(params.sampling))
+           + ";best_of=" + opt(params.best_of)
+           + ";beam_size=" + opt(params.beam_size)
+           + ";temperature=" + opt(params.temperature)
+           + ";temperature_inc=" + opt(params.temperature_inc)
+           + ";entropy_thold=" + opt(params.entropy_thold)
+           + ";logprob_thold=" + opt(params.logprob_thold)
+           + ";no_speech_thold=" + opt(params.no_speech_thold)
+           + ";no_timestamps=" + opt(params.no_timestamps)
+           + ";suppress_blank=" + opt(params.suppress_blank)
+           + ";suppress_nst=" + opt(params.suppress_nst)
+           + ";max_len=" + opt(params.max_len)
+           + ";offset_ms=" + opt(params.offset_ms)
+           + ";token_timestamps=" + opt(params.token_timestamps)
+           + ";no_context=" + opt(params.no_context)
+           + ";single_segment=" + opt(params.single_segment)
+           + ";";
+}
+
+bool TranscriberWhisper::processRecording(std::span<const float> data)
+{
+    LOG_DEBUG_EX(*this) << name() << ": Called with data size ="
+                << data.size();
+
+    assert(session_ctx_ != nullptr);
+
+    final_text_.clear();
+
+    const auto params = recordingParams();
 
     LOG_DEBUG_EX(*this) << "Calling whisper_full() with " << data.size()
                         << " samples and vocabulary: " << params.vocabulary;
+    // Stream the text while a long recording is transcribed
+    session_ctx_->setOnPartialTextCallback([this](const std::string& text) {
+        emit partialTextAvailable(QString::fromStdString(text));
+    });
+    session_ctx_->setOnProgressCallback([this](int percent) {
+        emit progressChanged(percent);
+    });
+
     qvw::WhisperSessionCtx::Transcript transcript_out;
     ScopedTimer timer;
     const auto ok = session_ctx_->whisperFull(data, params, transcript_out);
-    LOG_DEBUG_EX(*this) << "whisper_full() returned ok =" << ok
-                        << " in " << timer.elapsed() << " seconds.";
+    const auto elapsed = timer.elapsed();
+    session_ctx_->setOnPartialTextCallback({});
+    session_ctx_->setOnProgressCallback({});
+    const auto audio_seconds = static_cast<double>(data.size()) / sample_rate_;
+    // Speed of the preset. Compare with the same audio and model for the tradeoff.
+    LOG_INFO_EX(*this) << "whisper_full() returned ok =" << ok
+                       << " in " << elapsed << " seconds for " << audio_seconds
+                       << " seconds of audio with preset " << post_preset_
+                       << ". Real-time factor: " << (audio_seconds > 0.0 ? elapsed / audio_seconds : 0.0);
 
     if (!ok) {
         LOG_ERROR_N << "whisper_full() failed.";
@@ -245,9 +444,20 @@ bool TranscriberWhisper::processRecording(std::span<const float> data)
 
     // Get all the returned test into final_text_
     final_text_.clear();
-    for(const auto segment: transcript_out.segments){
+    scored_segments_t segments;
+    segments.reserve(transcript_out.segments.size());
+    for(const auto& segment: transcript_out.segments){
         final_text_ += segment.text;
+        segments.push_back({
+            .t0_ms = segment.t0_ms,
+            .t1_ms = segment.t1_ms,
+            .text = segment.text,
+            .avg_logprob = segment.avg_logprob,
+            .no_speech_prob = segment.no_speech_prob,
+            .compression_ratio = compressionRatio(segment.text)
+        });
     }
+    setRecordingResult(std::move(segments), std::move(transcript_out.language));
 
     // if (config().submit_filal_text) {
     //     LOG_TRACE_EX(*this) << "Emitting final text:" << final_text_;
@@ -257,6 +467,150 @@ bool TranscriberWhisper::processRecording(std::span<const float> data)
     return true;
 }
 
+bool TranscriberWhisper::processRecordingSelective(std::span<const float> data,
+                                                   const std::vector<SampleSpan>& speech)
+{
+    assert(session_ctx_ != nullptr);
+
+    if (data.empty() || speech.empty()) {
+        return false;
+    }
+
+    const auto toSample = [&](int64_t ms) {
+        return std::min(data.size(), static_cast<size_t>(std::max<int64_t>(0, ms) * sample_rate_ / 1000));
+    };
+
+    struct Piece {
+        SampleSpan span;
+        std::string text;
+    };
+
+    // Confident live segments are kept as they are
+    std::vector<Piece> pieces;
+    for (const auto& segment : priorSegments()) {
+        if (!isConfident(segment)) {
+            continue;
+        }
+        const SampleSpan span{toSample(segment.t0_ms), toSample(segment.t1_ms)};
+        if (span.end > span.begin) {
+            pieces.push_back({span, segment.text});
+        }
+    }
+    std::ranges::sort(pieces, {}, [](const Piece& p) { return p.span.begin; });
+    const auto kept_count = pieces.size();
+
+    // Speech not covered by a kept segment is decoded again. The spans are padded
+    // into the surrounding silence, but never into a kept segment.
+    const size_t min_redo_samples = static_cast<size_t>(sample_rate_) / 5;
+    const size_t padding = static_cast<size_t>(redo_padding_ms_) * static_cast<size_t>(sample_rate_) / 1000;
+    std::vector<SampleSpan> redo;
+    size_t speech_samples = 0;
+    size_t redo_samples = 0;
+
+    auto addRedo = [&](size_t begin, size_t end) {
+        if (end - begin < min_redo_samples) {
+            return;
+        }
+        size_t low = begin > padding ? begin - padding : 0;
+        size_t high = std::min(data.size(), end + padding);
+        for (size_t i = 0; i < kept_count; ++i) {
+            const auto& k = pieces[i].span;
+            if (k.end <= begin) {
+                low = std::max(low, k.end);
+            } else if (k.begin >= end) {
+                high = std::min(high, k.begin);
+            }
+        }
+        if (!redo.empty() && low <= redo.back().end) {
+            redo_samples -= redo.back().end - redo.back().begin;
+            redo.back().end = std::max(redo.back().end, high);
+        } else {
+            redo.push_back({low, high});
+        }
+        redo_samples += redo.back().end - redo.back().begin;
+    };
+
+    for (const auto& s : speech) {
+        speech_samples += s.end - s.begin;
+        size_t pos = s.begin;
+        for (size_t i = 0; i < kept_count && pos < s.end; ++i) {
+            const auto& k = pieces[i].span;
+            if (k.end <= pos || k.begin >= s.end) {
+                continue;
+            }
+            if (k.begin > pos) {
+                addRedo(pos, k.begin);
+            }
+            pos = std::max(pos, k.end);
+        }
+        if (pos < s.end) {
+            addRedo(pos, s.end);
+        }
+    }
+
+    if (speech_samples == 0 || redo_samples > max_redo_ratio_ * static_cast<double>(speech_samples)) {
+        LOG_DEBUG_EX(*this) << name() << ": " << redo_samples << " of " << speech_samples
+                            << " speech samples need to be re-decoded. Not worth a selective pass.";
+        return false;
+    }
+
+    LOG_DEBUG_EX(*this) << name() << ": Keeping " << kept_count << " of " << priorSegments().size()
+                        << " live segments, re-decoding " << redo.size() << " spans ("
+                        << (redo_samples * 1000 / sample_rate_) << " of "
+                        << (speech_samples * 1000 / sample_rate_) << " ms of speech)";
+
+    auto params = recordingParams();
+    ScopedTimer timer;
+    size_t done_samples = 0;
+    for (const auto& span : redo) {
+        if (isCancelled()) {
+            return false;
+        }
+
+        emit progressChanged(static_cast<int>(done_samples * 100 / redo_samples));
+        done_samples += span.end - span.begin;
+
+        qvw::WhisperSessionCtx::Transcript transcript_out;
+        if (!session_ctx_->whisperFull(data.subspan(span.begin, span.end - span.begin), params, transcript_out)) {
+            LOG_ERROR_N << "whisper_full() failed.";
+            return false;
+        }
+
+        Piece piece{span, {}};
+        for (const auto& segment : transcript_out.segments) {
+            piece.text += segment.text;
+        }
+        pieces.push_back(std::move(piece));
+    }
+
+    std::ranges::stable_sort(pieces, {}, [](const Piece& p) { return p.span.begin; });
+
+    final_text_.clear();
+    scored_segments_t segments;
+    segments.reserve(pieces.size());
+    for (const auto& piece : pieces) {
+        appendText(final_text_, piece.text);
+        segments.push_back({
+            .t0_ms = static_cast<int64_t>(piece.span.begin * 1000 / static_cast<size_t>(sample_rate_)),
+            .t1_ms = static_cast<int64_t>(piece.span.end * 1000 / static_cast<size_t>(sample_rate_)),
+            .text = piece.text,
+            .compression_ratio = compressionRatio(piece.text)
+        });
+    }
+    setRecordingResult(std::move(segments), language());
+
+    LOG_DEBUG_EX(*this) << name() << ": Selective pass completed in " << timer.elapsed() << " seconds.";
+    return true;
+}
+
+bool TranscriberWhisper::isConfident(const ScoredSegment &segment) const noexcept
+{
+    return segment.avg_logprob >= min_avg_logprob_
+           && segment.no_speech_prob <= max_no_speech_prob_
+           && segment.compression_ratio <= max_compression_ratio_
+           && segment.min_token_p >= min_token_p_;
+}
+
 bool TranscriberWhisper::stopImpl()
 {
     LOG_DEBUG_EX(*this) << "TranscriberWhisper::stopImpl called";
@@ -30,15 +30,21 @@ public:
         return final_text_;
     }
 
+    std::string recordingSignature() const override;
+
 protected:
     bool createContextImpl() override;
     void processChunk(std::span<const uint8_t> data, bool lastChunk, bool forceProcess) override;
     bool processRecording(std::span<const float> data) override;
+    bool processRecordingSelective(std::span<const float> data,
+                                   const std::vector<SampleSpan>& speech) override;
     bool stopImpl() override;
 
 private:
     bool ensureModelOnDisk();           // check + download if needed
     bool downloadModelBlocking(const ModelInfo &model);
+    bool isConfident(const ScoredSegment& segment) const noexcept;
+    qvw::WhisperSessionCtx::WhisperFullParams recordingParams() const;
 
 private:
     std::shared_ptr<qvw::WhisperSessionCtx> session_ctx_;
@@ -49,10 +55,35 @@ private:
     int max_live_latency_ms_ = 1500; // fallback trigger during continuous speech
     int min_live_submit_ms_ = 220; // ignore very short phrase fragments on forced flush
     float min_live_rms_dbfs_ = -52.0F; // drop near-silent chunks that slip past VAD
+    bool fit_live_audio_ctx_ = true; // shorter encoder context for short live chunks
+    int min_live_audio_ctx_ = 256;
+    bool pin_live_language_ = true; // with [Auto], detect the language once per session
+    bool stream_live_mel_ = true; // compute the mel spectrogram as the audio arrives
+    int min_language_detect_ms_ = 1500;
+    std::string live_language_;
+
+    // Live whisper_full() timing, logged with the final chunk
+    size_t live_calls_ = 0;
+    size_t live_ctx_fallbacks_ = 0;
+    double live_whisper_seconds_ = 0.0;
+    double live_queue_ms_ = 0.0;
+
+    // Decoding presets, see qvw::WhisperSessionCtx::WhisperFullParams::Preset()
+    std::string live_preset_{"live-fast"};
+    std::string post_preset_{"balanced"};
+
+    // Confidence gate for keeping live segments in the post pass.
+    float min_avg_logprob_ = -1.0F;
+    float max_no_speech_prob_ = 0.6F;
+    float max_compression_ratio_ = 2.4F;
+    float min_token_p_ = 0.0F; // 0 disables the per-token check
+    double max_redo_ratio_ = 0.6; // above this share of the speech, do a full pass
+    int redo_padding_ms_ = 200;
 
     // Pending voiced PCM that has not yet been submitted to Whisper.
     std::vector<float> pending_pcm_;
     int64_t pending_samples_ = 0;
+    int64_t pending_start_ms_ = 0; // position of pending_pcm_ in the recording
 
     // Transcript accumulation
     std::string final_text_;
@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <mutex>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QSettings>
+#include <QStandardPaths>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <qcorofuture.h>
+
+#include "TranscriptCache.h"
+#include "ScopedTimer.h"
+
+#include "logging.h"
+
+using namespace std;
+
+namespace {
+
+// Bump if the format of an entry, or how it is computed, changes
+constexpr string_view cache_version = "1";
+
+constexpr array<char, 8> pcm_magic = {'Q', 'V', 'W', 'P', 'C', 'M', '0', '1'};
+
+// Serializes evictions. Stores and loads don't need it.
+std::mutex eviction_mutex;
+
+QString entryPath(const QString& dir, const QString& key, const QString& suffix)
+{
+    return QDir{dir}.filePath(key + suffix);
+}
+
+// The decoded audio also depends on how raw PCM files are interpreted
+QString pcmKey(const QString& audioKey)
+{
+    QSettings settings;
+    QCryptographicHash hash{QCryptographicHash::Sha256};
+    hash.addData(QByteArrayView{cache_version.data(), static_cast<qsizetype>(cache_version.size())});
+    hash.addData(audioKey.toLatin1());
+    hash.addData(settings.value("import.raw.sample_rate", 16000).toByteArray());
+    hash.addData(settings.value("import.raw.channels", 1).toByteArray());
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+// Marks the entry as recently used
+void touch(const QString& path)
+{
+    QFile file{path};
+    if (file.open(QIODevice::ReadWrite)) {
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    }
+}
+
+void evict(const QString& dir, qint64 maxBytes)
+{
+    lock_guard lock{eviction_mutex};
+
+    // Oldest first
+    auto entries = QDir{dir}.entryInfoList(QDir::Files | QDir::NoDotAndDotDot,
+                                           QDir::Time | QDir::Reversed);
+    qint64 total = 0;
+    for (const auto& fi : entries) {
+        total += fi.size();
+    }
+
+    for (const auto& fi : entries) {
+        if (total <= maxBytes) {
+            break;
+        }
+        LOG_DEBUG_N << "Evicting cache entry " << fi.fileName() << " (" << fi.size() << " bytes)";
+        if (QFile::remove(fi.absoluteFilePath())) {
+            total -= fi.size();
+        }
+    }
+}
+
+bool writeEntry(const QString& path, const QByteArray& header, const char *data, qint64 size)
+{
+    QSaveFile file{path};
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(header) != header.size()
+        || file.write(data, size) != size
+        || !file.commit()) {
+        LOG_WARN_N << "Failed to write cache entry " << path << ": " << file.errorString();
+        return false;
+    }
+    return true;
+}
+
+QJsonObject toJson(const TranscriptCache::Transcript& transcript)
+{
+    QJsonArray segments;
+    for (const auto& s : transcript.segments) {
+        segments.append(QJsonObject{
+            {"t0_ms", static_cast<qint64>(s.t0_ms)},
+            {"t1_ms", static_cast<qint64>(s.t1_ms)},
+            {"text", QString::fromStdString(s.text)},
+            {"avg_logprob", s.avg_logprob},
+            {"no_speech_prob", s.no_speech_prob},
+            {"compression_ratio", s.compression_ratio}
+        });
+    }
+
+    return QJsonObject{
+        {"version", QString::fromLatin1(cache_version.data(), static_cast<qsizetype>(cache_version.size()))},
+        {"text", QString::fromStdString(transcript.text)},
+        {"language", QString::fromStdString(transcript.language)},
+        {"segments", segments}
+    };
+}
+
+TranscriptCache::Transcript fromJson(const QJsonObject& obj)
+{
+    TranscriptCache::Transcript transcript;
+    transcript.text = obj.value("text").toString().toStdString();
+    transcript.language = obj.value("language").toString().toStdString();
+    for (const auto& v : obj.value("segments").toArray()) {
+        const auto s = v.toObject();
+        transcript.segments.push_back({
+            .t0_ms = s.value("t0_ms").toInteger(),
+            .t1_ms = s.value("t1_ms").toInteger(),
+            .text = s.value("text").toString().toStdString(),
+            .avg_logprob = static_cast<float>(s.value("avg_logprob").toDouble()),
+            .no_speech_prob = static_cast<float>(s.value("no_speech_prob").toDouble()),
+            .compression_ratio = static_cast<float>(s.value("compression_ratio").toDouble())
+        });
+    }
+    return transcript;
+}
+
+} // anon ns
+
+TranscriptCache::TranscriptCache()
+{
+    QSettings settings;
+    enabled_ = settings.value("cache.enabled", true).toBool();
+    max_bytes_ = std::max<qint64>(0, settings.value("cache.max_size_mb", 4096).toLongLong()) * 1024 * 1024;
+    dir_ = settings.value("cache.path", "").toString().trimmed();
+    if (dir_.isEmpty()) {
+        auto models = settings.value("models/path", "").toString().trimmed();
+        if (models.isEmpty()) {
+            models = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/models";
+        }
+        dir_ = QFileInfo{models}.dir().filePath("cache");
+    }
+
+    if (enabled_ && !QDir{}.mkpath(dir_)) {
+        LOG_WARN_N << "Cannot create cache directory " << dir_ << ". The cache is disabled.";
+        enabled_ = false;
+    }
+
+    LOG_DEBUG_N << "Transcript cache: enabled=" << enabled_ << ", path=" << dir_
+                << ", max_bytes=" << max_bytes_;
+}
+
+QCoro::Task<QString> TranscriptCache::audioKey(const QString &filePath) const
+{
+    if (!enabled_) {
+        co_return QString{};
+    }
+
+    co_return co_await QtConcurrent::run([filePath]() -> QString {
+        QFile file{filePath};
+        if (!file.open(QIODevice::ReadOnly)) {
+            LOG_WARN_N << "Cannot open " << filePath << " for hashing";
+            return {};
+        }
+
+        const ScopedTimer timer;
+        QCryptographicHash hash{QCryptographicHash::Sha256};
+        if (!hash.addData(&file)) {
+            LOG_WARN_N << "Failed to hash " << filePath;
+            return {};
+        }
+        auto key = QString::fromLatin1(hash.result().toHex());
+        LOG_TRACE_N << "Hashed " << filePath << " (" << file.size() << " bytes) in "
+                    << timer.elapsed() << " seconds: " << key;
+        return key;
+    });
+}
+
+QString TranscriptCache::transcriptKey(const QString &audioKey,
+                                       std::string_view modelId,
+                                       std::string_view signature)
+{
+    if (audioKey.isEmpty()) {
+        return {};
+    }
+
+    QCryptographicHash hash{QCryptographicHash::Sha256};
+    for (const auto part : {cache_version, string_view{"\0", 1}, modelId, string_view{"\0", 1}, signature}) {
+        hash.addData(QByteArrayView{part.data(), static_cast<qsizetype>(part.size())});
+    }
+    hash.addData(audioKey.toLatin1());
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+QCoro::Task<TranscriptCache::pcm_t> TranscriptCache::loadPcm(const QString &audioKey) const
+{
+    if (!enabled_ || audioKey.isEmpty()) {
+        co_return pcm_t{};
+    }
+
+    // Entries hold little endian floats
+    if constexpr (std::endian::native != std::endian::little) {
+        co_return pcm_t{};
+    }
+
+    co_return co_await QtConcurrent::run([path = entryPath(dir_, pcmKey(audioKey), QStringLiteral(".pcm"))]() -> pcm_t {
+        QFile file{path};
+        if (!file.open(QIODevice::ReadOnly)) {
+            return {};
+        }
+
+        array<char, pcm_magic.size()> magic{};
+        quint64 count{};
+        if (file.read(magic.data(), magic.size()) != static_cast<qint64>(magic.size())
+            || magic != pcm_magic
+            || file.read(reinterpret_cast<char *>(&count), sizeof(count)) != sizeof(count)
+            || static_cast<qint64>(count * sizeof(float)) != file.size() - file.pos()) {
+            LOG_WARN_N << "Ignoring invalid cache entry " << path;
+            file.close();
+            QFile::remove(path);
+            return {};
+        }
+
+        auto pcm = make_shared<vector<float>>(count);
+        const auto bytes = static_cast<qint64>(count * sizeof(float));
+        if (file.read(reinterpret_cast<char *>(pcm->data()), bytes) != bytes) {
+            LOG_WARN_N << "Failed to read cache entry " << path;
+            return {};
+        }
+        file.close();
+
+        touch(path);
+        LOG_DEBUG_N << "Decoded audio cache hit: " << path;
+        return pcm;
+    });
+}
+
+QCoro::Task<std::optional<TranscriptCache::Transcript> > TranscriptCache::loadTranscript(const QString &key) const
+{
+    if (!enabled_ || key.isEmpty()) {
+        co_return nullopt;
+    }
+
+    co_return co_await QtConcurrent::run([path = entryPath(dir_, key, QStringLiteral(".json"))]() -> optional<Transcript> {
+        QFile file{path};
+        if (!file.open(QIODevice::ReadOnly)) {
+            return nullopt;
+        }
+
+        QJsonParseError err;
+        const auto doc = QJsonDocument::fromJson(file.readAll(), &err);
+        file.close();
+        if (err.error != QJsonParseError::NoError || !doc.isObject()) {
+            LOG_WARN_N << "Ignoring invalid cache entry " << path << ": " << err.errorString();
+            QFile::remove(path);
+            return nullopt;
+        }
+
+        touch(path);
+        LOG_DEBUG_N << "Transcript cache hit: " << path;
+        return fromJson(doc.object());
+    });
+}
+
+void TranscriptCache::storePcm(const QString &audioKey, pcm_t pcm) const
+{
+    if (!enabled_ || audioKey.isEmpty() || !pcm || pcm->empty()) {
+        return;
+    }
+
+    // Entries hold little endian floats
+    if constexpr (std::endian::native != std::endian::little) {
+        return;
+    }
+
+    QThreadPool::globalInstance()->start([path = entryPath(dir_, pcmKey(audioKey), QStringLiteral(".pcm")), dir = dir_,
+                                          max_bytes = max_bytes_, pcm = std::move(pcm)] {
+        QByteArray header{pcm_magic.data(), static_cast<qsizetype>(pcm_magic.size())};
+        const quint64 count = pcm->size();
+        header.append(reinterpret_cast<const char *>(&count), sizeof(count));
+
+        if (writeEntry(path, header, reinterpret_cast<const char *>(pcm->data()),
+                       static_cast<qint64>(count * sizeof(float)))) {
+            evict(dir, max_bytes);
+        }
+    });
+}
+
+void TranscriptCache::storeTranscript(const QString &key, Transcript transcript) const
+{
+    if (!enabled_ || key.isEmpty()) {
+        return;
+    }
+
+    QThreadPool::globalInstance()->start([path = entryPath(dir_, key, QStringLiteral(".json")), dir = dir_,
+                                          max_bytes = max_bytes_, transcript = std::move(transcript)] {
+        const auto json = QJsonDocument{toJson(transcript)}.toJson(QJsonDocument::Compact);
+        if (writeEntry(path, {}, json.constData(), json.size())) {
+            evict(dir, max_bytes);
+        }
+    });
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <QString>
+
+#include <qcorotask.h>
+
+#include "Transcriber.h"
+
+/*! On-disk cache for decoded audio and transcripts.
+ *
+ *  Entries are content addressed. The audio key is the SHA-256 of the input
+ *  file, so a renamed or copied file is still a hit. Decoded 16 kHz mono PCM
+ *  is stored under the audio key. A transcript is stored under a key derived
+ *  from the audio key, the model id and everything else that affects the
+ *  result (see Transcriber::recordingSignature()).
+ *
+ *  The cache lives in `cache` next to the models directory, unless
+ *  `cache.path` is set. When it grows above `cache.max_size_mb` (4096), the
+ *  least recently used entries are removed. `cache.enabled` turns it off.
+ *
+ *  The file operations run in the Qt thread-pool.
+ */
+class TranscriptCache
+{
+public:
+    using pcm_t = std::shared_ptr<const std::vector<float>>;
+
+    struct Transcript {
+        std::string text;
+        std::string language;
+        Transcriber::scored_segments_t segments;
+    };
+
+    TranscriptCache();
+
+    bool enabled() const noexcept { return enabled_; }
+
+    //! Hashes the content of the file. Returns an empty string on failure or if disabled.
+    [[nodiscard]] QCoro::Task<QString> audioKey(const QString& filePath) const;
+
+    static QString transcriptKey(const QString& audioKey,
+                                 std::string_view modelId,
+                                 std::string_view signature);
+
+    [[nodiscard]] QCoro::Task<pcm_t> loadPcm(const QString& audioKey) const;
+    [[nodiscard]] QCoro::Task<std::optional<Transcript>> loadTranscript(const QString& key) const;
+
+    // Stores the entry in the background. Empty keys are ignored.
+    void storePcm(const QString& audioKey, pcm_t pcm) const;
+    void storeTranscript(const QString& key, Transcript transcript) const;
+
+private:
+    bool enabled_{true};
+    QString dir_;
+    qint64 max_bytes_{};
+};
@@ -1,18 +1,36 @@
 #define LOGFAULT_FWD_ENABLE_LOGGING 1
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <format>
+#include <fstream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "qvw/LlamaEngine.h"
 #include "qvw/log_wrapper.h"
 
 #include <llama.h>
+#include <ggml-backend.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -102,24 +120,396 @@ bool shouldFlushNow(std::string_view last_piece, string_view buffer) {
     return false;
 }
 
+// Upper bound for n_batch. Sessions preallocate a batch of this size.
+constexpr int32_t max_batch_tokens = 2048;
+
+// Session state files: magic, model id, n_past, the n_past tokens, then the state of sequence 0
+constexpr array<char, 8> state_magic = {'Q', 'V', 'W', 'K', 'V', '0', '0', '2'};
+
+/*! Decodes toks at positions [pos, pos + toks.size()) of sequence seq.
+ *
+ *  Splits them in batches of n_batch. Returns how many tokens were decoded.
+ *  The logits are kept for the last token, or for all of them if allLogits
+ *  is set (then they must fit in one batch).
+ */
+int32_t decodeTokens(llama_context * ctx, llama_batch & batch, span<const llama_token> toks,
+                     int32_t pos, bool allLogits, llama_seq_id seq = 0) {
+    const int32_t n_batch = std::min<int32_t>(llama_n_batch(ctx), max_batch_tokens);
+    if (n_batch <= 0) {
+        LOG_ERROR_N << "llama_n_batch(ctx) returned " << n_batch;
+        return 0;
+    }
+    assert(!allLogits || static_cast<int32_t>(toks.size()) <= n_batch);
+
+    int32_t offset = 0;
+    while (offset < (int32_t)toks.size()) {
+        const int32_t n_this = std::min<int32_t>(n_batch, (int32_t)toks.size() - offset);
+
+        batch.n_tokens = n_this;
+
+        for (int32_t i = 0; i < n_this; ++i) {
+            batch.token[i]     = toks[(size_t)offset + (size_t)i];
+            batch.pos[i]       = pos + offset + i;
+
+            batch.n_seq_id[i]  = 1;
+            batch.seq_id[i][0] = seq;
+
+            batch.logits[i]    = (allLogits || i == n_this - 1) ? 1 : 0;
+        }
+
+        const int rc = llama_decode(ctx, batch);
+        if (rc != 0) {
+            LOG_ERROR_N << "llama_decode failed rc=" << rc;
+            break;
+        }
+
+        offset += n_this;
+    }
+
+    return offset;
+}
+
+// Drafted tokens are only useful if they mean the same to both models
+bool vocabsMatch(const llama_vocab * target, const llama_vocab * draft) {
+    if (llama_vocab_type(target) != llama_vocab_type(draft)
+        || llama_vocab_get_add_bos(target) != llama_vocab_get_add_bos(draft)
+        || llama_vocab_bos(target) != llama_vocab_bos(draft)
+        || llama_vocab_eos(target) != llama_vocab_eos(draft)) {
+        LOG_WARN_N << "The draft model has another type of vocabulary or special tokens";
+        return false;
+    }
+
+    // Siblings may differ in the number of padding tokens at the end
+    const auto n_target = llama_vocab_n_tokens(target);
+    const auto n_draft = llama_vocab_n_tokens(draft);
+    if (std::abs(n_target - n_draft) > 128) {
+        LOG_WARN_N << "The draft model has " << n_draft << " tokens, the target model " << n_target;
+        return false;
+    }
+
+    // The first tokens are often control tokens that differ between fine-tunes
+    for (llama_token tok = 5; tok < std::min(n_target, n_draft); ++tok) {
+        if (std::strcmp(llama_vocab_get_text(target, tok), llama_vocab_get_text(draft, tok)) != 0) {
+            LOG_WARN_N << "Token " << tok << " differs between the draft and the target model";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+llama_sampler * makeSampler(const LlamaSessionCtx::Params & params) {
+    // Build sampler chain
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    if (!smpl) {
+        return nullptr;
+    }
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
+                                      /*penalty_last_n*/ -1,
+                                      /*penalty_repeat*/ params.repeat_penalty,
+                                      /*penalty_freq*/   0.0f,
+                                      /*penalty_present*/0.0f));
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.top_k));
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.top_p, /*min_keep*/ 1));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
+
+    // Terminal sampler that chooses token
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(/*seed*/ 1234));
+    // (or llama_sampler_init_greedy() for debugging)
+
+    llama_sampler_reset(smpl);
+    return smpl;
+}
+
+// What the process can still allocate: MemAvailable, capped by the cgroup limit. 0 if unknown.
+size_t availableMemory() {
+#ifdef __linux__
+    size_t available = 0;
+    ifstream meminfo{"/proc/meminfo"};
+    for (string line; getline(meminfo, line);) {
+        if (line.starts_with("MemAvailable:")) {
+            available = std::strtoull(line.c_str() + 13, nullptr, 10) * 1024; // kB
+            break;
+        }
+    }
+
+    const auto readBytes = [](const char * path) -> optional<size_t> {
+        ifstream in{path};
+        string value;
+        if (!(in >> value) || value == "max") {
+            return nullopt;
+        }
+        return std::strtoull(value.c_str(), nullptr, 10);
+    };
+
+    // cgroup v2, then v1. v1 reports a huge number when there is no limit.
+    auto limit = readBytes("/sys/fs/cgroup/memory.max");
+    auto usage = readBytes("/sys/fs/cgroup/memory.current");
+    if (!limit) {
+        limit = readBytes("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+        usage = readBytes("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+    }
+    if (limit && *limit < (size_t{1} << 60)) {
+        const auto left = *limit - std::min(*limit, usage.value_or(0));
+        available = available ? std::min(available, left) : left;
+    }
+
+    return available;
+#else
+    return 0;
+#endif
+}
+
+// The most free memory on a GPU. 0 if there is no GPU.
+size_t gpuFreeMemory() {
+    size_t best = 0;
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        auto * dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) {
+            continue;
+        }
+        size_t free = 0, total = 0;
+        ggml_backend_dev_memory(dev, &free, &total);
+        best = std::max(best, free);
+    }
+    return best;
+}
+
+// Resident memory of the process. 0 if unknown.
+size_t residentMemory() {
+#ifdef __linux__
+    ifstream statm{"/proc/self/statm"};
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident) {
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return 0;
+}
+
+// KV cache for one token, in all layers
+size_t kvBytesPerToken(const llama_model * model, ggml_type typeK, ggml_type typeV) {
+    const auto n_head = llama_model_n_head(model);
+    if (n_head <= 0) {
+        return 0;
+    }
+    const int64_t n_embd_kv = int64_t{llama_model_n_embd(model)} / n_head * llama_model_n_head_kv(model);
+    return static_cast<size_t>(llama_model_n_layer(model))
+           * (ggml_row_size(typeK, n_embd_kv) + ggml_row_size(typeV, n_embd_kv));
+}
+
+optional<ggml_type> toGgmlType(LlamaEngineLoadParams::KvType type) {
+    switch (type) {
+    case LlamaEngineLoadParams::KvType::Auto:
+        return nullopt;
+    case LlamaEngineLoadParams::KvType::F16:
+        return GGML_TYPE_F16;
+    case LlamaEngineLoadParams::KvType::Q8_0:
+        return GGML_TYPE_Q8_0;
+    case LlamaEngineLoadParams::KvType::Q4_0:
+        return GGML_TYPE_Q4_0;
+    }
+    return nullopt;
+}
+
+template <typename T>
+bool readValue(istream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+template <typename T>
+bool writeValue(ostream& out, const T& value) {
+    return static_cast<bool>(out.write(reinterpret_cast<const char *>(&value), sizeof(value)));
+}
+
 
 class LlamaImpl;
 class LlamaCtxImpl;
 
+// -------------------------
+// Prompt prefix cache
+// (shared by the sessions of a model)
+// -------------------------
+
+/*! KV snapshots of prompt prefixes.
+ *
+ *  An entry is the state of sequence 0 right after evaluating its tokens.
+ *  A new prompt restores the longest entry it starts with, and only
+ *  evaluates the rest.
+ *
+ *  We don't know which part of a prompt is shared (the instructions) and
+ *  which is not (the transcript). So the cache remembers the tokens of the
+ *  last few prompts. When a new prompt starts with the same tokens as one of
+ *  them, that common prefix is worth a snapshot.
+ */
+class PrefixCache {
+public:
+    static constexpr size_t block = 32;       // snapshot lengths are multiples of this
+    static constexpr size_t min_tokens = 64;  // shorter prefixes are cheap to evaluate
+    static constexpr size_t max_recent = 4;
+
+    struct Entry {
+        vector<llama_token> tokens;
+        vector<uint8_t> state;
+        uint64_t last_used{};
+    };
+
+    explicit PrefixCache(size_t maxBytes)
+        : max_bytes_{maxBytes} {}
+
+    bool enabled() const noexcept {
+        return max_bytes_ > 0;
+    }
+
+    // The longest entry that is a prefix of `tokens`, and shorter than it
+    shared_ptr<const Entry> find(span<const llama_token> tokens) {
+        const auto hashes = prefixHashes(tokens);
+
+        lock_guard lock{mutex_};
+        shared_ptr<Entry> best;
+        for (const auto& [key, entry] : entries_) {
+            const auto len = entry->tokens.size();
+            if (len >= tokens.size() || (best && len <= best->tokens.size())
+                || hashes.at(len / block) != key
+                || !std::equal(entry->tokens.begin(), entry->tokens.end(), tokens.begin())) {
+                continue;
+            }
+            best = entry;
+        }
+
+        if (best) {
+            best->last_used = ++tick_;
+            ++hits_;
+            reused_tokens_ += best->tokens.size();
+        } else {
+            ++misses_;
+        }
+        return best;
+    }
+
+    // The length of the prefix of `tokens` worth a snapshot, or 0. Remembers the tokens.
+    size_t snapshotLength(span<const llama_token> tokens) {
+        lock_guard lock{mutex_};
+        size_t common = 0;
+        for (const auto& recent : recent_) {
+            const auto [a, b] = std::mismatch(recent.begin(), recent.end(), tokens.begin(), tokens.end());
+            common = std::max(common, static_cast<size_t>(a - recent.begin()));
+        }
+
+        recent_.emplace_back(tokens.begin(), tokens.end());
+        if (recent_.size() > max_recent) {
+            recent_.pop_front();
+        }
+
+        // Leave at least one token to evaluate, for the logits
+        common = std::min(common, tokens.size() - 1) / block * block;
+        if (common < min_tokens || entries_.contains(hash(tokens.first(common)))) {
+            return 0;
+        }
+        return common;
+    }
+
+    void insert(shared_ptr<Entry> entry) {
+        const auto key = hash(entry->tokens);
+        const auto size = entry->state.size();
+        lock_guard lock{mutex_};
+        if (size > max_bytes_) {
+            LOG_DEBUG_N << "Prompt prefix of " << entry->tokens.size() << " tokens (" << size
+                        << " bytes) is larger than the cache";
+            return;
+        }
+
+        entry->last_used = ++tick_;
+        if (auto it = entries_.find(key); it != entries_.end()) {
+            bytes_ -= it->second->state.size();
+            it->second = std::move(entry);
+        } else {
+            entries_.emplace(key, std::move(entry));
+        }
+        bytes_ += size;
+
+        // Least recently used first
+        while (bytes_ > max_bytes_) {
+            auto lru = std::ranges::min_element(entries_, {}, [](const auto& e) { return e.second->last_used; });
+            assert(lru != entries_.end());
+            bytes_ -= lru->second->state.size();
+            entries_.erase(lru);
+            ++evictions_;
+        }
+    }
+
+    LlamaCtx::PrefixCacheStats stats() const {
+        lock_guard lock{mutex_};
+        return {
+            .entries = static_cast<int>(entries_.size()),
+            .bytes = bytes_,
+            .max_bytes = max_bytes_,
+            .hits = hits_,
+            .misses = misses_,
+            .reused_tokens = reused_tokens_,
+            .evictions = evictions_
+        };
+    }
+
+    void clear() {
+        lock_guard lock{mutex_};
+        entries_.clear();
+        recent_.clear();
+        bytes_ = 0;
+    }
+
+private:
+    // FNV-1a over the token ids
+    static constexpr uint64_t fnv_basis = 14695981039346656037ULL;
+    static constexpr uint64_t fnv_prime = 1099511628211ULL;
+
+    static uint64_t hash(span<const llama_token> tokens, uint64_t h = fnv_basis) noexcept {
+        for (const auto t : tokens) {
+            h = (h ^ static_cast<uint32_t>(t)) * fnv_prime;
+        }
+        return h;
+    }
+
+    // The hash of each block aligned prefix. [i] is for the first i * block tokens.
+    static vector<uint64_t> prefixHashes(span<const llama_token> tokens) {
+        vector<uint64_t> hashes;
+        hashes.reserve(tokens.size() / block + 1);
+        uint64_t h = fnv_basis;
+        hashes.push_back(h);
+        for (size_t i = 0; i + block <= tokens.size(); i += block) {
+            h = hash(tokens.subspan(i, block), h);
+            hashes.push_back(h);
+        }
+        return hashes;
+    }
+
+    mutable std::mutex mutex_;
+    const size_t max_bytes_;
+    unordered_map<uint64_t, shared_ptr<Entry>> entries_; // by the hash of the tokens
+    deque<vector<llama_token>> recent_;
+    size_t bytes_{};
+    uint64_t tick_{};
+    uint64_t hits_{};
+    uint64_t misses_{};
+    uint64_t reused_tokens_{};
+    uint64_t evictions_{};
+};
+
 // -------------------------
 // Session implementation
-// (owns its own llama_context)
+// (holds a llama_context from the model's pool)
 // -------------------------
 class LlamaSessionCtxImpl final : public LlamaSessionCtx {
 public:
     explicit LlamaSessionCtxImpl(shared_ptr<LlamaCtxImpl> modelCtx);
 
-    ~LlamaSessionCtxImpl() override {
-        if (ctx_) {
-            llama_free(ctx_);
-            ctx_ = nullptr;
-        }
-    }
+    ~LlamaSessionCtxImpl() override;
+
+    LlamaSessionCtxImpl(const LlamaSessionCtxImpl&) = delete;
+    LlamaSessionCtxImpl& operator=(const LlamaSessionCtxImpl&) = delete;
 
     void setOnPartialTextCallback(function<void(const string&)> cb) override {
         on_partial_text_callback_ = std::move(cb);
@@ -130,6 +520,23 @@ public:
     }
 
     bool promptImpl(string_view text, const Params & params) override;
+    bool saveStateImpl(const filesystem::path & path) const override;
+    bool loadStateImpl(const filesystem::path & path) override;
+    bool setDraftModelImpl(shared_ptr<LlamaCtx> draft, int draftTokens) override;
+    bool promptFanOutImpl(string_view prefix, span<const string> suffixes, const Params & params,
+                          vector<string> & results) override;
+    void setOnSequenceTextCallbackImpl(sequence_text_cb_t cb) override {
+        on_sequence_text_callback_ = std::move(cb);
+    }
+    SpeculativeStats speculativeStatsImpl() const override {
+        return spec_stats_;
+    }
+    bool truncatedImpl() const override {
+        return truncated_;
+    }
+    vector<size_t> truncatedSequencesImpl() const override {
+        return truncated_sequences_;
+    }
 
     void setOnPartialTextCallbackImpl(std::function<void (const std::string &)> on_partial_text_callback) override {
         on_partial_text_callback_ = std::move(on_partial_text_callback);
@@ -139,14 +546,26 @@ public:
         return final_text_;
     }
 
-    bool resetContext();
+    // Clears the KV cache. Swaps in a larger context if it holds less than nCtx tokens.
+    bool resetContext(int nCtx = 0, int minCtx = 0);
 
 
 private:
+    bool tokenize(string_view text, vector<llama_token> & tokens) const;
     bool appendAndCallback(string_view piece);
-    bool evalTokens(span<const llama_token> toks);
+    bool evalTokens(span<const llama_token> toks, bool allLogits = false);
+    // Evaluates the prompt in a fresh context, using the model's prefix cache
+    bool prefill(span<const llama_token> toks);
+    // Moves the KV cache to a context that holds at least nCtx tokens
+    bool growContext(int nCtx, int minCtx = 0);
+    // The sampler chain for params, reset. Reused while the sampling params don't change.
+    llama_sampler * sampler(const Params & params);
+    // Up to n tokens the draft model expects after history_ and id
+    span<const llama_token> draft(llama_token id, int n);
+    // Up to n tokens that followed the last n-gram of history_ and id the last time it occurred
+    span<const llama_token> lookup(llama_token id, int n);
+    void resetDraft();
 
-    int ctx_size_override_{0}; // 0 => use model_ctx_->ctxSize()
     shared_ptr<LlamaCtxImpl> model_ctx_;
 
     llama_context * ctx_{nullptr};
@@ -155,29 +574,65 @@ private:
 
     int32_t n_past_{0};
     int32_t last_logits_idx_ = 0;
+    llama_token last_token_{LLAMA_TOKEN_NULL};
+    vector<llama_token> history_; // the tokens in the KV cache, n_past_ of them
+    vector<uint8_t> state_buffer_;
+
+    // Reused by every decode, so the generation loop doesn't allocate
+    llama_batch batch_{};
+    llama_sampler * sampler_{nullptr};
+    Params sampler_params_;
+    chrono::steady_clock::duration decode_time_{};
+
+    // Speculative decoding. The draft context follows history_ lazily.
+    shared_ptr<LlamaCtxImpl> draft_model_;
+    llama_context * draft_ctx_{nullptr};
+    llama_sampler * draft_sampler_{nullptr};
+    int32_t draft_n_past_{0};
+    int draft_tokens_{0};
+    vector<llama_token> drafts_;
+    vector<llama_token> verify_;
+    SpeculativeStats spec_stats_;
+    bool truncated_{false};
+    vector<size_t> truncated_sequences_;
 
     string final_text_;
     string partial_text_;
     function<void(const string&)> on_partial_text_callback_;
+    sequence_text_cb_t on_sequence_text_callback_;
 };
 
 // -------------------------
 // Model context implementation
-// (owns llama_model; sessions create contexts)
+// (owns llama_model and a pool of idle contexts)
 // -------------------------
 class LlamaCtxImpl final : public LlamaCtx, public enable_shared_from_this<LlamaCtxImpl> {
 public:
     LlamaCtxImpl(LlamaImpl & engine,
                  string modelId,
                  llama_model * model,
-                 int threads,
-                 int ctx_size)
+                 const LlamaEngineLoadParams & params)
         : engine_(engine)
         , model_id_(std::move(modelId))
         , model_(model)
-        , threads_(threads)
-        , ctx_size_(ctx_size) {
+        , threads_(EngineBase::getThreads(params.threads))
+        , ctx_size_((params.ctx_size > 0) ? params.ctx_size : 4096)
+        , prefix_cache_(params.prefix_cache_bytes)
+        , max_idle_contexts_(static_cast<size_t>(std::max(0, params.max_idle_contexts)))
+        , kv_on_gpu_(params.offload_kqv && params.n_gpu_layers >= llama_model_n_layer(model))
+        , memory_budget_(params.memory_budget)
+        , kv_type_(toGgmlType(params.kv_type))
+        , flash_attn_(params.flash_attn)
+        , n_ubatch_(static_cast<uint32_t>(std::max(0, params.n_ubatch)))
+        , offload_kqv_(params.offload_kqv)
+        , defrag_thold_(params.defrag_thold) {
         assert(model_);
+        buildPieceTable();
+
+        if (flash_attn_ == LlamaEngineLoadParams::FlashAttn::Off && kv_type_ && *kv_type_ != GGML_TYPE_F16) {
+            LOG_WARN_N << "A quantized V cache requires flash attention. Only the K cache of "
+                       << model_id_ << " is quantized.";
+        }
     }
 
     ~LlamaCtxImpl() override;
@@ -198,6 +653,81 @@ public:
     const llama_model * model() const noexcept { return model_; }
     int threads() const noexcept { return threads_; }
     int ctxSize() const noexcept { return ctx_size_; }
+    PrefixCache& prefixCache() noexcept { return prefix_cache_; }
+
+    //! The text of a token, from a table built when the model is loaded
+    string_view piece(llama_token tok) const noexcept {
+        const auto ix = static_cast<size_t>(tok);
+        if (tok < 0 || ix + 1 >= piece_offsets_.size()) {
+            return {};
+        }
+        return string_view{pieces_}.substr(piece_offsets_[ix], piece_offsets_[ix + 1] - piece_offsets_[ix]);
+    }
+
+    /*! Returns a context with an empty KV cache that holds at least nCtx tokens.
+     *
+     *  Idle contexts are reused when one is large enough. New contexts are
+     *  sized in power of two buckets from ctxSize(), so that prompts of
+     *  similar length can share them.
+     *
+     *  With nSeq > 1 the sequences share one KV cache, so a prefix copied
+     *  to all of them is only stored once.
+     *
+     *  If a new context for nCtx tokens doesn't fit in memory, the idle
+     *  contexts are freed first. Then the KV cache is quantized, and then
+     *  the context is made smaller, down to minCtx tokens (nCtx if 0).
+     *  Returns nullptr if even that doesn't fit.
+     */
+    llama_context * acquireContext(int nCtx, int nSeq = 1, int minCtx = 0);
+
+    //! Keeps the context for reuse, or frees it if the pool is full
+    void releaseContext(llama_context * ctx) noexcept;
+
+protected:
+    void buildPieceTable();
+
+    //! The layout of a new context
+    struct ContextPlan {
+        uint32_t n_ctx{};
+        uint32_t n_ubatch{512};
+        ggml_type type_kv{GGML_TYPE_F16};
+    };
+
+    /*! Bytes a new context may use for its KV cache and work buffers. nullopt if unknown.
+     *
+     *  An explicit budget is shared by all the contexts of the model. With
+     *  reclaimIdle, the memory of the idle contexts counts as available, as
+     *  they can be freed.
+     */
+    optional<size_t> memoryBudget(bool reclaimIdle = false) const;
+
+    //! Frees the idle contexts, so their memory can go to a new one. Returns how many.
+    size_t freeIdleContexts();
+
+    // Whether a context with a K cache of typeK uses flash attention. Auto counts as off for f16.
+    bool flashAttn(ggml_type typeK) const noexcept {
+        return flash_attn_ == LlamaEngineLoadParams::FlashAttn::On
+               || (flash_attn_ == LlamaEngineLoadParams::FlashAttn::Auto && typeK != GGML_TYPE_F16);
+    }
+
+    // llama.cpp can only quantize the V cache with flash attention
+    ggml_type typeV(ggml_type typeK) const noexcept {
+        return (flash_attn_ == LlamaEngineLoadParams::FlashAttn::Off) ? GGML_TYPE_F16 : typeK;
+    }
+
+    size_t contextBytes(uint32_t nCtx, uint32_t nUbatch, ggml_type typeKv) const;
+    // The first of the sizes that fits, with the least quantized KV cache
+    optional<ContextPlan> planContext(initializer_list<uint32_t> sizes) const;
+
+    int maxContextTokensImpl() const override;
+
+    PrefixCacheStats prefixCacheStatsImpl() const override {
+        return prefix_cache_.stats();
+    }
+
+    void clearPrefixCacheImpl() override {
+        prefix_cache_.clear();
+    }
 
 private:
     LlamaImpl & engine_;
@@ -207,6 +737,28 @@ private:
 
     int threads_{EngineBase::getThreads()};
     int ctx_size_{4096};
+    PrefixCache prefix_cache_;
+
+    // All the token pieces back to back. Token i is [offsets[i], offsets[i + 1]).
+    string pieces_;
+    vector<uint32_t> piece_offsets_;
+
+    mutable mutex pool_mutex_;
+    vector<llama_context *> idle_contexts_;
+    unordered_map<const llama_context *, size_t> context_bytes_; // planned size of each context, in use or idle
+    size_t max_idle_contexts_{2};
+    uint64_t contexts_created_{};
+    uint64_t contexts_reused_{};
+
+    bool kv_on_gpu_{false};
+    size_t memory_budget_{0};
+
+    // Context options. Empty or 0 lets planContext() choose.
+    optional<ggml_type> kv_type_;
+    LlamaEngineLoadParams::FlashAttn flash_attn_{LlamaEngineLoadParams::FlashAttn::Auto};
+    uint32_t n_ubatch_{0};
+    bool offload_kqv_{true};
+    float defrag_thold_{-1.0f};
 };
 
 // -------------------------
@@ -279,10 +831,7 @@ public:
             return {};
         }
 
-        const int threads = EngineBase::getThreads(params.threads);
-        const int ctx_size = (params.ctx_size > 0) ? params.ctx_size : 4096;
-
-        auto ctx = make_shared<LlamaCtxImpl>(*this, modelId, model, threads, ctx_size);
+        auto ctx = make_shared<LlamaCtxImpl>(*this, modelId, model, params);
         ++num_loaded_models_;
         return ctx;
     }
@@ -316,6 +865,9 @@ private:
 // LlamaCtxImpl dtor + info
 // -------------------------
 LlamaCtxImpl::~LlamaCtxImpl() {
+    // The contexts reference the model
+    freeIdleContexts();
+
     if (model_) {
         llama_model_free(model_);
         model_ = nullptr;
@@ -330,6 +882,265 @@ string LlamaCtxImpl::info() const noexcept {
 EngineBase & LlamaCtxImpl::engine() noexcept { return engine_; }
 const EngineBase & LlamaCtxImpl::engine() const noexcept { return engine_; }
 
+void LlamaCtxImpl::buildPieceTable() {
+    const auto started = chrono::steady_clock::now();
+    const auto * vocab = llama_model_get_vocab(model_);
+    const auto n_vocab = llama_vocab_n_tokens(vocab);
+
+    piece_offsets_.clear();
+    piece_offsets_.reserve(static_cast<size_t>(n_vocab) + 1);
+    pieces_.clear();
+    pieces_.reserve(static_cast<size_t>(n_vocab) * 8);
+    for (llama_token tok = 0; tok < n_vocab; ++tok) {
+        piece_offsets_.push_back(static_cast<uint32_t>(pieces_.size()));
+        pieces_.append(tokenToPiece(vocab, tok));
+    }
+    piece_offsets_.push_back(static_cast<uint32_t>(pieces_.size()));
+    pieces_.shrink_to_fit();
+
+    LOG_DEBUG_N << "Built the piece table for " << n_vocab << " tokens (" << pieces_.size()
+                << " bytes) in " << chrono::duration<double, milli>(chrono::steady_clock::now() - started).count()
+                << " ms";
+}
+
+optional<size_t> LlamaCtxImpl::memoryBudget(bool reclaimIdle) const {
+    size_t used = 0;
+    size_t idle = 0;
+    {
+        lock_guard lock{pool_mutex_};
+        for (const auto& entry : context_bytes_) {
+            used += entry.second;
+        }
+        for (const auto * ctx : idle_contexts_) {
+            idle += context_bytes_.at(ctx);
+        }
+    }
+
+    if (memory_budget_ > 0) {
+        if (reclaimIdle) {
+            used -= idle;
+        }
+        return (memory_budget_ > used) ? memory_budget_ - used : 0;
+    }
+
+    // The contexts that exist are already used memory
+    const auto reclaim = reclaimIdle ? idle : 0;
+    if (kv_on_gpu_) {
+        if (const auto free = gpuFreeMemory()) {
+            return (free + reclaim) / 10 * 9;
+        }
+    }
+
+    // Leave room for the rest of the app, and for the pages of the mapped model file
+    if (const auto available = availableMemory()) {
+        return (available + reclaim) / 4 * 3;
+    }
+    return nullopt;
+}
+
+size_t LlamaCtxImpl::freeIdleContexts() {
+    vector<llama_context *> idle;
+    {
+        lock_guard lock{pool_mutex_};
+        idle.swap(idle_contexts_);
+        for (const auto * ctx : idle) {
+            context_bytes_.erase(ctx);
+        }
+    }
+
+    for (auto * ctx : idle) {
+        llama_free(ctx);
+    }
+    return idle.size();
+}
+
+size_t LlamaCtxImpl::contextBytes(uint32_t nCtx, uint32_t nUbatch, ggml_type typeKv) const {
+    const size_t kv = kvBytesPerToken(model_, typeKv, typeV(typeKv)) * nCtx;
+
+    // Without flash attention, the attention scores of a layer are n_ubatch x n_ctx per head
+    const size_t scores = !flashAttn(typeKv)
+        ? size_t{nUbatch} * nCtx * static_cast<size_t>(llama_model_n_head(model_)) * sizeof(float) : 0;
+
+    // Logits and activations
+    const size_t work = size_t{nUbatch} * static_cast<size_t>(llama_vocab_n_tokens(llama_model_get_vocab(model_))
+                                                            + 4 * llama_model_n_embd(model_)) * sizeof(float);
+    return kv + scores + work;
+}
+
+optional<LlamaCtxImpl::ContextPlan> LlamaCtxImpl::planContext(initializer_list<uint32_t> sizes) const {
+    static constexpr auto kv_types = to_array<ggml_type>({GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0});
+    static constexpr auto ubatches = to_array<uint32_t>({512, 256, 128});
+
+    // What the settings leave open
+    const auto types = kv_type_ ? span<const ggml_type>{&*kv_type_, 1} : span<const ggml_type>{kv_types};
+    const auto n_ubatches = n_ubatch_ ? span<const uint32_t>{&n_ubatch_, 1} : span<const uint32_t>{ubatches};
+
+    const auto budget = memoryBudget();
+    if (!budget || llama_model_is_recurrent(model_)) {
+        return ContextPlan{.n_ctx = *sizes.begin(), .n_ubatch = n_ubatches.front(), .type_kv = types.front()};
+    }
+
+    // A quantized cache costs less quality than a smaller context
+    for (const auto n_ctx : sizes) {
+        for (const auto type : types) {
+            for (const auto n_ubatch : n_ubatches) {
+                if (contextBytes(n_ctx, n_ubatch, type) <= *budget) {
+                    return ContextPlan{.n_ctx = n_ctx, .n_ubatch = n_ubatch, .type_kv = type};
+                }
+            }
+        }
+    }
+
+    const auto min_ctx = *std::min_element(sizes.begin(), sizes.end());
+    LOG_WARN_N << "A llama_context for " << min_ctx << " tokens needs "
+               << contextBytes(min_ctx, n_ubatches.back(), types.back()) / (1024 * 1024)
+               << " MB, but only " << *budget / (1024 * 1024) << " MB are available";
+    return nullopt;
+}
+
+int LlamaCtxImpl::maxContextTokensImpl() const {
+    // The most compact layout the settings allow
+    const auto type = kv_type_.value_or(GGML_TYPE_Q4_0);
+    const auto budget = memoryBudget(true);
+    const auto per_token = kvBytesPerToken(model_, type, typeV(type));
+    if (!budget || per_token == 0 || llama_model_is_recurrent(model_)) {
+        return 0;
+    }
+
+    // Nothing fits. 0 would mean no limit.
+    const auto work = contextBytes(0, n_ubatch_ ? n_ubatch_ : 128, type);
+    if (work >= *budget) {
+        return 1;
+    }
+    return static_cast<int>(std::min<size_t>((*budget - work) / per_token / 256 * 256,
+                                             numeric_limits<int>::max()));
+}
+
+llama_context * LlamaCtxImpl::acquireContext(int nCtx, int nSeq, int minCtx) {
+    const auto want = static_cast<uint32_t>(std::max(nCtx, ctx_size_));
+
+    {
+        lock_guard lock{pool_mutex_};
+
+        // The smallest idle context that is large enough
+        auto best = idle_contexts_.end();
+        for (auto it = idle_contexts_.begin(); it != idle_contexts_.end(); ++it) {
+            if (llama_n_ctx(*it) >= want
+                && static_cast<int>(llama_n_seq_max(*it)) == nSeq
+                && (best == idle_contexts_.end() || llama_n_ctx(*it) < llama_n_ctx(*best))) {
+                best = it;
+            }
+        }
+
+        if (best != idle_contexts_.end()) {
+            auto * ctx = *best;
+            idle_contexts_.erase(best);
+            ++contexts_reused_;
+            llama_memory_clear(llama_get_memory(ctx), true);
+            LOG_DEBUG_N << "Reusing llama_context n_ctx=" << llama_n_ctx(ctx) << " for " << want
+                        << " tokens. Pool: idle=" << idle_contexts_.size()
+                        << ", created=" << contexts_created_ << ", reused=" << contexts_reused_;
+            return ctx;
+        }
+    }
+
+    // Power of two buckets above the configured size
+    const auto bucket = (want > static_cast<uint32_t>(ctx_size_)) ? std::bit_ceil(want) : want;
+    const auto sizes = {bucket, want, (minCtx > 0) ? std::min<uint32_t>(minCtx, want) : want};
+    const auto tight = [&](const optional<ContextPlan>& plan) {
+        return !plan || plan->n_ctx < bucket || (!kv_type_ && plan->type_kv != GGML_TYPE_F16);
+    };
+
+    auto plan = planContext(sizes);
+
+    // The idle contexts didn't match, but their memory may be enough for this one
+    if (tight(plan)) {
+        if (const auto freed = freeIdleContexts()) {
+            LOG_DEBUG_N << "Freed " << freed << " idle llama_context(s) to make room for " << want << " tokens";
+            plan = planContext(sizes);
+        }
+    }
+
+    if (!plan) {
+        LOG_ERROR_N << "Not enough memory for a llama_context for " << want << " tokens";
+        return nullptr;
+    }
+    if (tight(plan)) {
+        LOG_INFO << "LlamaEngine Memory is tight. Planned n_ctx=" << plan->n_ctx << " (asked for " << want
+                 << "), n_ubatch=" << plan->n_ubatch << ", KV cache " << ggml_type_name(plan->type_kv)
+                 << ", " << contextBytes(plan->n_ctx, plan->n_ubatch, plan->type_kv) / (1024 * 1024)
+                 << " MB of " << memoryBudget().value_or(0) / (1024 * 1024) << " MB";
+    }
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx = plan->n_ctx;
+
+    // Optional, but nice: pick a sane batch default for large ctx
+    // (you still won’t crash because evalTokens chunks)
+    cparams.n_batch = std::min<uint32_t>(cparams.n_ctx, max_batch_tokens);
+    cparams.n_ubatch = std::min(cparams.n_batch, plan->n_ubatch);
+
+    cparams.type_k = plan->type_kv;
+    cparams.type_v = typeV(plan->type_kv);
+    switch (flash_attn_) {
+    case LlamaEngineLoadParams::FlashAttn::On:
+        cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        break;
+    case LlamaEngineLoadParams::FlashAttn::Off:
+        cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        break;
+    case LlamaEngineLoadParams::FlashAttn::Auto:
+        // A quantized V cache requires it
+        cparams.flash_attn_type = (cparams.type_v != GGML_TYPE_F16)
+            ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_AUTO;
+        break;
+    }
+
+    cparams.offload_kqv = offload_kqv_;
+    cparams.defrag_thold = defrag_thold_;
+
+    cparams.n_seq_max = static_cast<uint32_t>(nSeq);
+    cparams.kv_unified = nSeq > 1;
+
+    if (threads_ > 0) {
+        cparams.n_threads = threads_;
+        cparams.n_threads_batch = threads_;
+    }
+
+    auto * ctx = llama_init_from_model(model_, cparams);
+    if (!ctx) {
+        LOG_ERROR_N << "Failed to create llama_context n_ctx=" << cparams.n_ctx;
+        return nullptr;
+    }
+
+    lock_guard lock{pool_mutex_};
+    context_bytes_[ctx] = contextBytes(plan->n_ctx, plan->n_ubatch, plan->type_kv);
+    ++contexts_created_;
+    LOG_DEBUG_N << "Created llama_context n_ctx=" << llama_n_ctx(ctx) << ", n_seq=" << nSeq
+                << ", n_ubatch=" << llama_n_ubatch(ctx) << ", KV cache " << ggml_type_name(cparams.type_k)
+                << "/" << ggml_type_name(cparams.type_v) << " for " << want
+                << " tokens. Pool: idle=" << idle_contexts_.size()
+                << ", created=" << contexts_created_ << ", reused=" << contexts_reused_;
+    return ctx;
+}
+
+void LlamaCtxImpl::releaseContext(llama_context * ctx) noexcept {
+    if (!ctx) {
+        return;
+    }
+
+    {
+        lock_guard lock{pool_mutex_};
+        if (idle_contexts_.size() < max_idle_contexts_) {
+            idle_contexts_.push_back(ctx);
+            return;
+        }
+        context_bytes_.erase(ctx);
+    }
+
+    llama_free(ctx);
+}
+
 // -------------------------
 // LlamaSessionCtxImpl
 // -------------------------
@@ -342,11 +1153,23 @@ LlamaSessionCtxImpl::LlamaSessionCtxImpl(shared_ptr<LlamaCtxImpl> modelCtx)
     vocab_ = llama_model_get_vocab(model_);
     assert(vocab_);
 
+    batch_ = llama_batch_init(max_batch_tokens, /*embd*/ 0, /*n_seq_max*/ 1);
+
     if (!resetContext()) {
         throw runtime_error("Failed to create llama_context");
     }
 }
 
+LlamaSessionCtxImpl::~LlamaSessionCtxImpl() {
+    setDraftModelImpl({}, 0);
+    if (sampler_) {
+        llama_sampler_free(sampler_);
+    }
+    llama_batch_free(batch_);
+    model_ctx_->releaseContext(ctx_);
+    ctx_ = nullptr;
+}
+
 bool LlamaSessionCtxImpl::appendAndCallback(string_view piece) {
     final_text_.append(piece);
     if (on_partial_text_callback_) {
@@ -358,83 +1181,76 @@ bool LlamaSessionCtxImpl::appendAndCallback(string_view piece) {
     return true;
 }
 
-bool LlamaSessionCtxImpl::evalTokens(span<const llama_token> toks) {
+bool LlamaSessionCtxImpl::evalTokens(span<const llama_token> toks, bool allLogits) {
     if (toks.empty()) return true;
 
-    const int32_t n_batch = llama_n_batch(ctx_);
-    if (n_batch <= 0) {
-        LOG_ERROR_N << "llama_n_batch(ctx_) returned " << n_batch;
-        return false;
-    }
+    const auto started = chrono::steady_clock::now();
+    const auto done = decodeTokens(ctx_, batch_, toks, n_past_, allLogits);
+    decode_time_ += chrono::steady_clock::now() - started;
 
-    int32_t offset = 0;
-    while (offset < (int32_t)toks.size()) {
-        const int32_t n_this = std::min<int32_t>(n_batch, (int32_t)toks.size() - offset);
-
-        llama_batch batch = llama_batch_init(n_this, /*embd*/ 0, /*n_seq_max*/ 1);
-        batch.n_tokens = n_this;
-
-        for (int32_t i = 0; i < n_this; ++i) {
-            batch.token[i]     = toks[(size_t)offset + (size_t)i];
-            batch.pos[i]       = n_past_ + i;
-
-            batch.n_seq_id[i]  = 1;
-            batch.seq_id[i][0] = 0;
-
-            batch.logits[i]    = (i == n_this - 1) ? 1 : 0;
-        }
-
-        last_logits_idx_ = n_this - 1;
-
-        const int rc = llama_decode(ctx_, batch);
-        llama_batch_free(batch);
-
-        if (rc != 0) {
-            LOG_ERROR_N << "llama_decode failed rc=" << rc;
-            return false;
-        }
-
-        n_past_ += n_this;
-        offset += n_this;
+    n_past_ += done;
+    history_.insert(history_.end(), toks.begin(), toks.begin() + done);
+    if (done > 0) {
+        last_token_ = toks[static_cast<size_t>(done) - 1];
+        last_logits_idx_ = allLogits ? done - 1 : 0;
     }
 
-    return true;
+    return done == static_cast<int32_t>(toks.size());
 }
 
-bool LlamaSessionCtxImpl::promptImpl(string_view text, const Params & params) {
-    final_text_.clear();
-    partial_text_.clear();
+bool LlamaSessionCtxImpl::prefill(span<const llama_token> toks) {
+    auto& cache = model_ctx_->prefixCache();
+    if (!cache.enabled() || n_past_ != 0 || toks.empty()) {
+        return evalTokens(toks);
+    }
 
-    // NOTE:
-    // - Auto-resize + retry is safe only for "fresh start" prompts.
-    // - If continue_conversation=true, we must not reset context / retry,
-    //   otherwise we'd duplicate history and break state.
-    const bool can_retry = !params.continue_conversation;
+    size_t done = 0;
+    size_t restored = 0;
+    if (const auto entry = cache.find(toks)) {
+        if (llama_state_seq_set_data(ctx_, entry->state.data(), entry->state.size(), 0) != 0) {
+            done = restored = entry->tokens.size();
+            n_past_ = static_cast<int32_t>(done);
+            history_.assign(entry->tokens.begin(), entry->tokens.end());
+            last_token_ = history_.back();
+        } else {
+            LOG_WARN_N << "Failed to restore a cached prompt prefix of " << entry->tokens.size() << " tokens";
+            llama_memory_clear(llama_get_memory(ctx_), true);
+        }
+    }
 
-    if (!params.continue_conversation) {
-        // Always start from a clean context for this prompt.
-        if (!resetContext()) {
-            LOG_ERROR_N << "Failed to reset context for new conversation";
+    // Save the part this prompt shares with recent prompts, if we don't have it
+    if (const auto len = cache.snapshotLength(toks); len > done) {
+        if (!evalTokens(toks.subspan(done, len - done))) {
             return false;
         }
-        LOG_DEBUG_N << "Starting new conversation.";
-    } else {
-        LOG_DEBUG_N << "Continuing conversation, n_past=" << n_past_;
+        done = len;
+
+        auto entry = make_shared<PrefixCache::Entry>();
+        entry->tokens.assign(toks.begin(), toks.begin() + static_cast<ptrdiff_t>(len));
+        entry->state.resize(llama_state_seq_get_size(ctx_, 0));
+        if (llama_state_seq_get_data(ctx_, entry->state.data(), entry->state.size(), 0) == entry->state.size()) {
+            LOG_DEBUG_N << "Caching prompt prefix of " << len << " tokens (" << entry->state.size() << " bytes)";
+            cache.insert(std::move(entry));
+        }
     }
 
-    LOG_DEBUG_N << "Prompting Llama model with text bytes=" << text.size();
+    const auto stats = cache.stats();
+    LOG_DEBUG_N << "Prefill of " << toks.size() << " tokens, " << restored
+                << " restored from the prefix cache. Cache: entries=" << stats.entries
+                << ", bytes=" << stats.bytes << ", hits=" << stats.hits << ", misses=" << stats.misses;
 
-    // -------------------------
-    // 1) Tokenize prompt once (vocab-based API)
-    // -------------------------
-    std::vector<llama_token> prompt_tokens(text.size() + 8);
+    return evalTokens(toks.subspan(done));
+}
+
+bool LlamaSessionCtxImpl::tokenize(string_view text, vector<llama_token> & tokens) const {
+    tokens.resize(text.size() + 8);
 
     int32_t n_prompt = llama_tokenize(
         vocab_,
         text.data(),
         (int32_t)text.size(),
-        prompt_tokens.data(),
-        (int32_t)prompt_tokens.size(),
+        tokens.data(),
+        (int32_t)tokens.size(),
         /*add_special*/ false,
         /*parse_special*/ true
         );
@@ -442,14 +1258,14 @@ bool LlamaSessionCtxImpl::promptImpl(string_view text, const Params & params) {
     // In newer llama.cpp, a negative return often means "buffer too small" and -n is required
     if (n_prompt < 0) {
         const int32_t need = -n_prompt;
-        prompt_tokens.resize((size_t)need);
+        tokens.resize((size_t)need);
 
         n_prompt = llama_tokenize(
             vocab_,
             text.data(),
             (int32_t)text.size(),
-            prompt_tokens.data(),
-            (int32_t)prompt_tokens.size(),
+            tokens.data(),
+            (int32_t)tokens.size(),
             /*add_special*/ false,
             /*parse_special*/ true
             );
@@ -460,11 +1276,40 @@ bool LlamaSessionCtxImpl::promptImpl(string_view text, const Params & params) {
         return false;
     }
 
-    prompt_tokens.resize((size_t)n_prompt);
+    tokens.resize((size_t)n_prompt);
     LOG_DEBUG_N << "Tokenized prompt into " << n_prompt << " tokens";
+    return true;
+}
+
+bool LlamaSessionCtxImpl::promptImpl(string_view text, const Params & params) {
+    final_text_.clear();
+    partial_text_.clear();
+    truncated_ = false;
+
+    // NOTE:
+    // - Extending the output budget is only done for "fresh start" prompts.
+    // - If continue_conversation=true, the history stays in the context. It is
+    //   only moved to a larger context when it runs out of room.
+    const bool can_extend = !params.continue_conversation;
+
+    if (!params.continue_conversation) {
+        LOG_DEBUG_N << "Starting new conversation.";
+    } else {
+        LOG_DEBUG_N << "Continuing conversation, n_past=" << n_past_;
+    }
+
+    LOG_DEBUG_N << "Prompting Llama model with text bytes=" << text.size();
+
+    // -------------------------
+    // 1) Tokenize prompt once (vocab-based API)
+    // -------------------------
+    std::vector<llama_token> prompt_tokens;
+    if (!tokenize(text, prompt_tokens)) {
+        return false;
+    }
 
     // -------------------------
-    // 2) Retry loop: scale output + ctx if result looks partial
+    // 2) Size the context, prefill and generate
     // -------------------------
     auto roundUp = [](int v, int multiple) -> int {
         if (multiple <= 0) return v;
@@ -484,186 +1329,782 @@ bool LlamaSessionCtxImpl::promptImpl(string_view text, const Params & params) {
     // Safety margins
     const int ctx_margin        = 128;    // extra room beyond prompt+out
     const int room_margin       = 16;     // keep a little headroom in generation
-    const int max_attempts      = can_retry ? 6 : 1;
 
     // Hard caps (tune as you like)
     const int hard_max_out      = 16384;  // maximum output tokens we'll try for auto-scaling
     const int hard_max_ctx      = 131072; // maximum context we'll request (prevents runaway)
 
-    std::string last_stop_reason = "unknown";
+    // Room for the prompt and the expected output. If the output turns out to be
+    // longer, the KV cache is moved to a larger context and generation goes on,
+    // so no token is evaluated twice.
+    const int history = params.continue_conversation ? n_past_ : 0;
+    const int want_ctx = std::min(roundUp(history + pt + target_out + ctx_margin, 256), hard_max_ctx);
+
+    // With little memory, a conversation can go on in a smaller context if it holds
+    // the prompt and max_tokens of output. A new prompt must fit its expected output,
+    // as max_tokens is far too small for a rewrite. When it doesn't fit, the prompt
+    // fails, so the caller can split the work.
+    const int min_out = params.continue_conversation ? params.max_tokens : target_out;
+    const int min_ctx = std::min(want_ctx, roundUp(history + pt + min_out + ctx_margin, 256));
+
+    if (!params.continue_conversation) {
+        if (!resetContext(want_ctx, min_ctx)) {
+            LOG_ERROR_N << "Failed to reset context for new conversation, n_ctx=" << want_ctx;
+            return false;
+        }
+    } else if (n_past_ + pt + ctx_margin > static_cast<int>(llama_n_ctx(ctx_))) {
+        if (!growContext(want_ctx, min_ctx)) {
+            LOG_ERROR_N << "The conversation does not fit in a context of n_ctx=" << want_ctx;
+            return false;
+        }
+    }
+
+    // Prefill prompt tokens
+    const bool use_cache = params.use_prefix_cache && !params.continue_conversation;
+    const auto prefill_started = chrono::steady_clock::now();
+    if (!(use_cache ? prefill(prompt_tokens) : evalTokens(prompt_tokens))) {
+        LOG_ERROR_N << "Failed to eval prompt tokens";
+        return false;
+    }
+    const auto prefill_time = chrono::steady_clock::now() - prefill_started;
+
+    LOG_DEBUG_N << "Starting generation for up to " << target_out
+              << " tokens (params.max_tokens=" << params.max_tokens
+              << ", n_ctx=" << llama_n_ctx(ctx_)
+              << ", n_past=" << n_past_ << ")";
+
+    // The sampler chain lives for the whole generation, also when the
+    // context is replaced, so the repeat penalties see all the output.
+    llama_sampler * smpl = sampler(params);
+    if (!smpl) {
+        LOG_ERROR_N << "Failed to create the sampler chain";
+        return false;
+    }
+
+    const llama_vocab * vocab = vocab_;
+
+    // Room for the expected output, so appending doesn't reallocate
+    final_text_.reserve(static_cast<size_t>(target_out) * 4);
+
+    // Per token accounting. The wrapper overhead is what is left after decode and sampling.
+    using clock_type = chrono::steady_clock;
+    decode_time_ = {};
+    clock_type::duration sample_time{};
+    const auto gen_started = clock_type::now();
 
-    for (int attempt = 0; attempt < max_attempts; ++attempt) {
+    clock_type::duration draft_time{};
+    const auto spec_before = spec_stats_;
 
-        // If we can retry, we always run from a clean context each attempt
-        if (can_retry) {
-            // Compute required n_ctx for (prompt + target_out + margin)
-            int want_ctx = (int)prompt_tokens.size() + target_out + ctx_margin;
-            want_ctx = std::min(want_ctx, hard_max_ctx);
-            want_ctx = roundUp(want_ctx, 256);
+    bool saw_eog = false;
+    int generated = 0;
+    int context_moves = 0;
+    std::string stop_reason = "unknown";
 
-            // Apply override and recreate context
-            ctx_size_override_ = std::max(want_ctx, model_ctx_->ctxSize());
-            if (!resetContext()) {
-                LOG_ERROR_N << "Failed to recreate context for attempt=" << attempt
-                          << " n_ctx=" << ctx_size_override_;
-                return false;
+    // Sampled while verifying drafted tokens, but not evaluated yet
+    llama_token pending = LLAMA_TOKEN_NULL;
+
+    // -------------------------
+    // Generation loop
+    // -------------------------
+    while (true) {
+        if (generated >= target_out) {
+            // Looks partial. Keep what we have and allow more output.
+            if (!can_extend || target_out >= hard_max_out) {
+                stop_reason = "max_tokens";
+                break;
             }
+
+            // Scale up (doubling works well; you can do 1.5x if you want)
+            target_out = std::min(hard_max_out, target_out * 2);
+            final_text_.reserve(static_cast<size_t>(target_out) * 4);
+            LOG_DEBUG_N << "No end of generation after " << generated
+                        << " tokens. Continuing with target_out=" << target_out;
         }
 
-        // Prefill prompt tokens
-        if (!evalTokens(prompt_tokens)) {
-            LOG_ERROR_N << "Failed to eval prompt tokens";
-            return false;
+        if (n_past_ + room_margin >= static_cast<int>(llama_n_ctx(ctx_))) {
+            // Out of room. Continue in a larger context.
+            const int want = std::min(roundUp(n_past_ + (target_out - generated) + ctx_margin, 256), hard_max_ctx);
+            const int bigger = static_cast<int>(llama_n_ctx(ctx_)) + 256;
+            if (want <= static_cast<int>(llama_n_ctx(ctx_)) || !growContext(want, std::min(want, bigger))) {
+                stop_reason = "ctx_full";
+                break;
+            }
+            ++context_moves;
         }
 
-        // Determine how many tokens we can actually generate in this ctx
-        const int n_ctx = llama_n_ctx(ctx_);
-        const int room  = std::max(0, n_ctx - n_past_ - 1);
+        llama_token id = pending;
+        pending = LLAMA_TOKEN_NULL;
+        if (id == LLAMA_TOKEN_NULL) {
+            const auto sample_started = clock_type::now();
+            id = llama_sampler_sample(smpl, ctx_, -1);
+            llama_sampler_accept(smpl, id);
+            sample_time += clock_type::now() - sample_started;
+        }
+
+        if (llama_vocab_is_eog(vocab, id)) {
+            saw_eog = true;
+            stop_reason = "eog";
+            break;
+        }
 
-        // Use target_out, but never exceed room (minus margin)
-        int effective_max_tokens = target_out;
-        effective_max_tokens = std::min(effective_max_tokens, std::max(0, room - room_margin));
+        const auto piece = model_ctx_->piece(id);
+        if (!appendAndCallback(piece)) {
+            stop_reason = "callback_failed";
+            break;
+        }
+        ++generated;
+
+        // Speculative decoding. The batch that evaluates id also verifies the
+        // tokens we expect next, copied from earlier text (prompt lookup) or from
+        // the draft model. Our own sampler picks every token, so a drafted token
+        // is only kept if it is the one we would have sampled.
+        const int max_draft = std::min({std::max(draft_model_ ? draft_tokens_ : 0, params.prompt_lookup_tokens),
+                                        target_out - generated,
+                                        static_cast<int>(llama_n_ctx(ctx_)) - n_past_ - room_margin - 2});
+        if (max_draft > 0) {
+            const auto draft_started = clock_type::now();
+            auto drafts = lookup(id, std::min(max_draft, params.prompt_lookup_tokens));
+            if (drafts.empty() && draft_model_) {
+                drafts = draft(id, std::min(max_draft, draft_tokens_));
+            }
+            draft_time += clock_type::now() - draft_started;
+
+            if (!drafts.empty()) {
+                verify_.clear();
+                verify_.push_back(id);
+                verify_.insert(verify_.end(), drafts.begin(), drafts.end());
+
+                const auto base = n_past_;
+                if (!evalTokens(verify_, true)) {
+                    stop_reason = "eval_failed";
+                    break;
+                }
+
+                size_t accepted = 0;
+                const auto sample_started = clock_type::now();
+                for (size_t i = 0;; ++i) {
+                    const auto tok = llama_sampler_sample(smpl, ctx_, static_cast<int32_t>(i));
+                    llama_sampler_accept(smpl, tok);
+                    if (i < drafts.size() && tok == drafts[i]) {
+                        // Never EOG; the draft stops before that
+                        appendAndCallback(model_ctx_->piece(tok));
+                        ++generated;
+                        ++accepted;
+                        continue;
+                    }
+                    pending = tok;
+                    break;
+                }
+                sample_time += clock_type::now() - sample_started;
+
+                ++spec_stats_.rounds;
+                spec_stats_.drafted += drafts.size();
+                spec_stats_.accepted += accepted;
+
+                // Drop the rejected tokens from the KV cache
+                if (accepted < drafts.size()) {
+                    const auto keep = base + 1 + static_cast<int32_t>(accepted);
+                    if (!llama_memory_seq_rm(llama_get_memory(ctx_), 0, keep, -1)) {
+                        LOG_ERROR_N << "Failed to remove rejected draft tokens from the KV cache";
+                        stop_reason = "eval_failed";
+                        break;
+                    }
+                    n_past_ = keep;
+                    history_.resize(static_cast<size_t>(keep));
+                    last_token_ = history_.back();
+
+                    // Also from the draft model's cache. If the next rounds use prompt lookup,
+                    // our cache gets past them, and draft() would not notice the stale tokens.
+                    if (draft_ctx_ && draft_n_past_ > keep) {
+                        llama_memory_seq_rm(llama_get_memory(draft_ctx_), 0, keep, -1);
+                        draft_n_past_ = keep;
+                    }
+                }
+                continue;
+            }
+        }
 
-        LOG_DEBUG_N << "Starting generation attempt=" << attempt
-                  << " for up to " << effective_max_tokens
-                  << " tokens (target_out=" << target_out
-                  << ", params.max_tokens=" << params.max_tokens
-                  << ", n_ctx=" << n_ctx
-                  << ", n_past=" << n_past_
-                  << ", room=" << room << ")";
+        const llama_token toks[1] = { id };
+        if (!evalTokens(std::span{toks, 1})) {
+            stop_reason = "eval_failed";
+            break;
+        }
+    }
 
-        // Fresh output buffers each attempt (important when retrying)
-        final_text_.clear();
-        partial_text_.clear();
+    if (generated > 0) {
+        using us = chrono::duration<double, micro>;
+        const auto total = clock_type::now() - gen_started;
+        const auto overhead = total - decode_time_ - sample_time - draft_time;
+        LOG_DEBUG_N << "Per token: decode=" << us(decode_time_).count() / generated
+                    << " us, sampling=" << us(sample_time).count() / generated
+                    << " us, drafting=" << us(draft_time).count() / generated
+                    << " us, wrapper overhead=" << us(overhead).count() / generated << " us";
+    }
 
-        // Build sampler chain (fresh per attempt!)
-        auto sparams = llama_sampler_chain_default_params();
-        llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    if (spec_stats_.rounds != spec_before.rounds) {
+        const auto drafted = spec_stats_.drafted - spec_before.drafted;
+        const auto accepted = spec_stats_.accepted - spec_before.accepted;
+        LOG_DEBUG_N << "Speculative decoding: rounds=" << spec_stats_.rounds - spec_before.rounds
+                    << ", drafted=" << drafted << ", accepted=" << accepted
+                    << ", acceptance=" << (drafted ? 100.0 * static_cast<double>(accepted) / static_cast<double>(drafted) : 0.0)
+                    << "%";
+    }
 
-        llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
-                                          /*penalty_last_n*/ -1,
-                                          /*penalty_repeat*/ params.repeat_penalty,
-                                          /*penalty_freq*/   0.0f,
-                                          /*penalty_present*/0.0f));
+    using secs = chrono::duration<double>;
+    const auto perSecond = [](int tokens, clock_type::duration time) {
+        const auto s = secs(time).count();
+        return (s > 0.0) ? tokens / s : 0.0;
+    };
 
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.top_k));
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.top_p, /*min_keep*/ 1));
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
+    LOG_INFO << "LlamaEngine Generation stopped: " << stop_reason
+             << " generated=" << generated
+             << " target_out=" << target_out
+             << " context_moves=" << context_moves
+             << " n_past=" << n_past_
+             << " n_ctx=" << llama_n_ctx(ctx_)
+             << " prompt_tps=" << perSecond(pt, prefill_time)
+             << " gen_tps=" << perSecond(generated, clock_type::now() - gen_started)
+             << " rss_mb=" << residentMemory() / (1024 * 1024);
+
+    // Success condition: model ended on its own
+    if (saw_eog) {
+        return true;
+    }
 
-        // Terminal sampler that chooses token
-        llama_sampler_chain_add(smpl, llama_sampler_init_dist(/*seed*/ 1234));
-        // (or llama_sampler_init_greedy() for debugging)
+    if (stop_reason == "eval_failed") {
+        return false;
+    }
 
-        llama_sampler_reset(smpl);
+    // The output was cut short. Callers that need all of it can check truncated().
+    truncated_ = stop_reason == "ctx_full" || stop_reason == "max_tokens";
+    if (can_extend && stop_reason != "callback_failed") {
+        LOG_WARN_N << "Stopped (" << stop_reason << ") without EOG after " << generated
+                   << " tokens. Returning best effort partial result.";
+    }
+    return true;
+}
 
-        const llama_vocab * vocab = llama_model_get_vocab(model_);
+llama_sampler * LlamaSessionCtxImpl::sampler(const Params & params) {
+    if (sampler_
+        && sampler_params_.temperature == params.temperature
+        && sampler_params_.top_k == params.top_k
+        && sampler_params_.top_p == params.top_p
+        && sampler_params_.repeat_penalty == params.repeat_penalty) {
+        llama_sampler_reset(sampler_);
+        return sampler_;
+    }
 
-        bool saw_eog = false;
-        int generated = 0;
-        std::string stop_reason = "unknown";
+    if (sampler_) {
+        llama_sampler_free(sampler_);
+    }
 
-        // -------------------------
-        // Generation loop
-        // -------------------------
-        for (int i = 0; i < effective_max_tokens; ++i) {
-            llama_token id = llama_sampler_sample(smpl, ctx_, -1);
-            llama_sampler_accept(smpl, id);
+    sampler_ = makeSampler(params);
+    sampler_params_ = params;
+    return sampler_;
+}
 
-            if (llama_vocab_is_eog(vocab, id)) {
-                saw_eog = true;
-                stop_reason = "eog";
-                break;
-            }
+bool LlamaSessionCtxImpl::promptFanOutImpl(string_view prefix, span<const string> suffixes,
+                                           const Params & params, vector<string> & results) {
+    constexpr size_t max_sequences = 64;
 
-            const auto piece = tokenToPiece(vocab, id);
-            if (!appendAndCallback(piece)) {
-                stop_reason = "callback_failed";
-                break;
+    results.assign(suffixes.size(), {});
+    truncated_sequences_.clear();
+    if (suffixes.empty()) {
+        return true;
+    }
+    if (suffixes.size() > max_sequences) {
+        LOG_ERROR_N << "Cannot fan out to " << suffixes.size() << " sequences. The limit is " << max_sequences;
+        return false;
+    }
+
+    const auto n_seq = static_cast<int>(suffixes.size());
+    LOG_DEBUG_N << "Fan-out prompt with " << n_seq << " sequences, prefix bytes=" << prefix.size();
+
+    vector<llama_token> prefix_tokens;
+    if (!tokenize(prefix, prefix_tokens) || prefix_tokens.empty()) {
+        return false;
+    }
+
+    // Each sequence starts with the last token of the prefix, so that each one gets its own logits
+    vector<vector<llama_token>> tails(suffixes.size());
+    for (size_t i = 0; i < suffixes.size(); ++i) {
+        if (!tokenize(suffixes[i], tails[i])) {
+            return false;
+        }
+        tails[i].insert(tails[i].begin(), prefix_tokens.back());
+    }
+    prefix_tokens.pop_back();
+
+    // Output budget per sequence estimated like in promptImpl(), from the prefix and its
+    // suffix, as either may hold the text to process. The prefix is only stored once.
+    // The context must hold all of it. If memory is short, this fails, so the caller
+    // can send fewer or smaller suffixes.
+    const int pt = static_cast<int>(prefix_tokens.size());
+    const int hard_max_ctx = 131072;
+    vector<int> target_out(suffixes.size());
+    int want_ctx = pt + 128;
+    for (size_t i = 0; i < tails.size(); ++i) {
+        const auto tail = static_cast<int>(tails[i].size());
+        target_out[i] = std::clamp(std::max(0, pt + tail - 256) + 256, params.max_tokens, 16384);
+        want_ctx += tail + target_out[i];
+    }
+    want_ctx = std::min(want_ctx, hard_max_ctx);
+
+    auto * ctx = model_ctx_->acquireContext(want_ctx, n_seq, want_ctx);
+    if (!ctx) {
+        return false;
+    }
+
+    vector<llama_sampler *> samplers;
+    samplers.reserve(suffixes.size());
+    const auto cleanup = [&] {
+        for (auto * smpl : samplers) {
+            llama_sampler_free(smpl);
+        }
+        model_ctx_->releaseContext(ctx);
+    };
+
+    // Prefill the shared prefix once, and let all the sequences use its cells
+    const auto started = chrono::steady_clock::now();
+    auto * mem = llama_get_memory(ctx);
+    if (decodeTokens(ctx, batch_, prefix_tokens, 0, false) != pt) {
+        cleanup();
+        return false;
+    }
+    for (llama_seq_id seq = 1; seq < n_seq; ++seq) {
+        llama_memory_seq_cp(mem, 0, seq, -1, -1);
+    }
+
+    // The suffixes, except their last token which goes into the first step
+    vector<int32_t> pos(suffixes.size(), pt);
+    vector<llama_token> next(suffixes.size(), LLAMA_TOKEN_NULL);
+    int32_t used = pt;
+    for (llama_seq_id seq = 0; seq < n_seq; ++seq) {
+        const auto i = static_cast<size_t>(seq);
+        const auto body = span<const llama_token>{tails[i]}.first(tails[i].size() - 1);
+        auto * smpl = makeSampler(params);
+        if (smpl) {
+            samplers.push_back(smpl);
+        }
+        if (!smpl || decodeTokens(ctx, batch_, body, pt, false, seq) != static_cast<int32_t>(body.size())) {
+            cleanup();
+            return false;
+        }
+        pos[i] += static_cast<int32_t>(body.size());
+        used += static_cast<int32_t>(body.size());
+        next[i] = tails[i].back();
+    }
+
+    const auto prefilled = chrono::steady_clock::now();
+
+    // One llama_decode per step, with the next token of each active sequence
+    const auto n_ctx = static_cast<int32_t>(llama_n_ctx(ctx));
+    vector<int> generated(suffixes.size());
+    vector<int32_t> out_idx(suffixes.size());
+    int active = n_seq;
+    int steps = 0;
+    bool ok = true;
+    while (active > 0) {
+        if (used + active + 16 >= n_ctx) {
+            LOG_WARN_N << "The fan-out context is full after " << steps << " steps. Returning best effort results.";
+            for (size_t i = 0; i < suffixes.size(); ++i) {
+                if (next[i] != LLAMA_TOKEN_NULL) {
+                    truncated_sequences_.push_back(i);
+                    if (on_sequence_text_callback_) {
+                        on_sequence_text_callback_(i, results[i]);
+                    }
+                }
             }
-            ++generated;
+            break;
+        }
 
-            const llama_token toks[1] = { id };
-            if (!evalTokens(std::span{toks, 1})) {
-                stop_reason = "eval_failed";
-                break;
+        batch_.n_tokens = 0;
+        for (llama_seq_id seq = 0; seq < n_seq; ++seq) {
+            const auto i = static_cast<size_t>(seq);
+            out_idx[i] = -1;
+            if (next[i] == LLAMA_TOKEN_NULL) {
+                continue;
             }
+            const auto b = batch_.n_tokens++;
+            batch_.token[b]     = next[i];
+            batch_.pos[b]       = pos[i]++;
+            batch_.n_seq_id[b]  = 1;
+            batch_.seq_id[b][0] = seq;
+            batch_.logits[b]    = 1;
+            out_idx[i] = b;
         }
+        used += batch_.n_tokens;
 
-        if (stop_reason == "unknown" && generated >= effective_max_tokens) {
-            // We hit the generation cap or ran out of room
-            stop_reason = "max_tokens";
+        if (const int rc = llama_decode(ctx, batch_); rc != 0) {
+            LOG_ERROR_N << "llama_decode failed rc=" << rc << " in fan-out step " << steps;
+            ok = false;
+            break;
         }
+        ++steps;
 
-        llama_sampler_free(smpl);
+        for (size_t i = 0; i < suffixes.size(); ++i) {
+            if (out_idx[i] < 0) {
+                continue;
+            }
 
-        last_stop_reason = stop_reason;
+            const llama_token id = llama_sampler_sample(samplers[i], ctx, out_idx[i]);
+            llama_sampler_accept(samplers[i], id);
+
+            const bool eog = llama_vocab_is_eog(vocab_, id);
+            if (eog || ++generated[i] > target_out[i]) {
+                if (!eog) {
+                    truncated_sequences_.push_back(i);
+                }
+                next[i] = LLAMA_TOKEN_NULL;
+                --active;
+                if (on_sequence_text_callback_) {
+                    on_sequence_text_callback_(i, results[i]);
+                }
+                continue;
+            }
+
+            const auto piece = model_ctx_->piece(id);
+            results[i].append(piece);
+            next[i] = id;
+            if (on_sequence_text_callback_ && shouldFlushNow(piece, results[i])) {
+                on_sequence_text_callback_(i, results[i]);
+            }
+        }
+    }
+
+    cleanup();
+    std::ranges::sort(truncated_sequences_);
+
+    using secs = chrono::duration<double>;
+    const auto done = chrono::steady_clock::now();
+    LOG_INFO << "LlamaEngine Fan-out: sequences=" << n_seq << ", prefix=" << pt << " tokens"
+             << ", truncated=" << truncated_sequences_.size()
+             << ", steps=" << steps << ", prefill=" << secs(prefilled - started).count()
+             << "s, generation=" << secs(done - prefilled).count() << "s";
+    return ok;
+}
+
+bool LlamaSessionCtxImpl::setDraftModelImpl(shared_ptr<LlamaCtx> draft, int draftTokens) {
+    if (draft_model_) {
+        draft_model_->releaseContext(draft_ctx_);
+        draft_ctx_ = nullptr;
+        draft_model_.reset();
+        draft_n_past_ = 0;
+    }
+    if (draft_sampler_) {
+        llama_sampler_free(draft_sampler_);
+        draft_sampler_ = nullptr;
+    }
+
+    if (!draft) {
+        return true;
+    }
+
+    auto impl = dynamic_pointer_cast<LlamaCtxImpl>(draft);
+    if (!impl || impl == model_ctx_) {
+        LOG_WARN_N << "Invalid draft model";
+        return false;
+    }
+
+    // Rejected drafts are removed from the KV cache, which recurrent models can't do
+    if (llama_model_is_recurrent(model_)) {
+        LOG_WARN_N << "Speculative decoding is not supported for recurrent models";
+        return false;
+    }
+
+    if (!vocabsMatch(vocab_, llama_model_get_vocab(impl->model()))) {
+        LOG_WARN_N << "Draft model " << impl->modelId() << " cannot be used with " << model_ctx_->modelId();
+        return false;
+    }
+
+    // The draft model proposes its most likely tokens
+    draft_sampler_ = llama_sampler_init_greedy();
+    draft_model_ = std::move(impl);
+    draft_tokens_ = std::clamp(draftTokens, 1, 64);
+    LOG_INFO << "Using draft model " << draft_model_->modelId() << " for " << model_ctx_->modelId()
+             << " with up to " << draft_tokens_ << " draft tokens";
+    return true;
+}
 
-        LOG_INFO << "LlamaEngine Generation stopped: " << stop_reason
-                 << " generated=" << generated
-                 << " effective_max_tokens=" << effective_max_tokens
-                 << " n_past=" << n_past_
-                 << " n_ctx=" << llama_n_ctx(ctx_);
+span<const llama_token> LlamaSessionCtxImpl::draft(llama_token id, int n) {
+    drafts_.clear();
 
-        // Success condition: model ended on its own
-        if (saw_eog) {
-            return true;
+    const auto need = n_past_ + n + 2;
+    if (!draft_ctx_ || static_cast<int>(llama_n_ctx(draft_ctx_)) < need) {
+        auto * ctx = draft_model_->acquireContext(std::max(need, static_cast<int>(llama_n_ctx(ctx_))));
+        if (!ctx) {
+            return {};
         }
+        draft_model_->releaseContext(draft_ctx_);
+        draft_ctx_ = ctx;
+        draft_n_past_ = 0;
+    }
+
+    // Catch up with our KV cache. Positions past it hold drafts from the last round.
+    if (draft_n_past_ > n_past_) {
+        llama_memory_seq_rm(llama_get_memory(draft_ctx_), 0, n_past_, -1);
+        draft_n_past_ = n_past_;
+    }
+    const auto pending = span<const llama_token>{history_}.subspan(static_cast<size_t>(draft_n_past_));
+    if (decodeTokens(draft_ctx_, batch_, pending, draft_n_past_, false) != static_cast<int32_t>(pending.size())) {
+        resetDraft();
+        return {};
+    }
+    draft_n_past_ = n_past_;
 
-        // Hard failures should not be retried
-        if (stop_reason == "eval_failed" || stop_reason == "callback_failed") {
-            return (stop_reason != "eval_failed"); // conservative: eval_failed => false
+    const auto n_vocab = llama_vocab_n_tokens(vocab_);
+    llama_token next = id;
+    for (int i = 0; i < n; ++i) {
+        if (decodeTokens(draft_ctx_, batch_, span{&next, 1}, draft_n_past_, false) != 1) {
+            resetDraft();
+            return {};
+        }
+        ++draft_n_past_;
+
+        next = llama_sampler_sample(draft_sampler_, draft_ctx_, -1);
+        if (next >= n_vocab || llama_vocab_is_eog(vocab_, next)) {
+            break;
         }
+        drafts_.push_back(next);
+    }
+
+    return drafts_;
+}
+
+span<const llama_token> LlamaSessionCtxImpl::lookup(llama_token id, int n) {
+    drafts_.clear();
+    if (n <= 0) {
+        return {};
+    }
+
+    // Longer n-grams first. They are less likely to match by accident.
+    constexpr size_t max_ngram = 4;
+    constexpr size_t min_ngram = 2;
 
-        // If we cannot retry (continue_conversation) return best effort
-        if (!can_retry) {
-            return true;
+    // The text so far is history_ followed by id
+    const auto size = history_.size() + 1;
+    const auto at = [&](size_t ix) { return ix < history_.size() ? history_[ix] : id; };
+
+    for (auto ngram = max_ngram; ngram >= min_ngram && drafts_.empty(); --ngram) {
+        if (size <= ngram) {
+            continue;
         }
 
-        // If we got here, we likely returned a partial result. Scale up and retry.
-        if (target_out >= hard_max_out) {
-            LOG_WARN_N << "Reached hard_max_out=" << hard_max_out
-                     << " without EOG. Returning best effort partial result.";
-            return true;
+        const auto tail = size - ngram;
+        for (auto start = tail; start-- > 0;) {
+            bool match = true;
+            for (size_t j = 0; j < ngram && match; ++j) {
+                match = history_[start + j] == at(tail + j);
+            }
+            if (!match) {
+                continue;
+            }
+
+            for (auto ix = start + ngram; ix < size && static_cast<int>(drafts_.size()) < n; ++ix) {
+                const auto tok = at(ix);
+                if (llama_vocab_is_eog(vocab_, tok)) {
+                    break;
+                }
+                drafts_.push_back(tok);
+            }
+            break;
+        }
+    }
+
+    return drafts_;
+}
+
+void LlamaSessionCtxImpl::resetDraft() {
+    if (draft_ctx_) {
+        llama_memory_clear(llama_get_memory(draft_ctx_), true);
+    }
+    draft_n_past_ = 0;
+}
+
+bool LlamaSessionCtxImpl::growContext(int nCtx, int minCtx) {
+    if (n_past_ <= 0 || last_token_ == LLAMA_TOKEN_NULL) {
+        return resetContext(nCtx, minCtx);
+    }
+
+    const auto started = chrono::steady_clock::now();
+    auto * bigger = model_ctx_->acquireContext(nCtx, 1, minCtx);
+    if (!bigger) {
+        return false;
+    }
+
+    // Sampling needs the logits of the last token, and they are not part of the
+    // saved state. So that token is evaluated again in the new context.
+    const auto last = last_token_;
+    if (!llama_memory_seq_rm(llama_get_memory(ctx_), 0, n_past_ - 1, -1)) {
+        LOG_WARN_N << "Cannot move the KV cache of this model to a larger context";
+        model_ctx_->releaseContext(bigger);
+        return false;
+    }
+    --n_past_;
+    history_.pop_back();
+
+    state_buffer_.resize(llama_state_seq_get_size(ctx_, 0));
+    const bool moved = llama_state_seq_get_data(ctx_, state_buffer_.data(), state_buffer_.size(), 0) == state_buffer_.size()
+                       && llama_state_seq_set_data(bigger, state_buffer_.data(), state_buffer_.size(), 0) != 0;
+    const auto from_ctx = llama_n_ctx(ctx_);
+    if (moved) {
+        model_ctx_->releaseContext(ctx_);
+        ctx_ = bigger;
+    } else {
+        LOG_WARN_N << "Failed to move " << n_past_ << " tokens of KV cache to a context of n_ctx=" << llama_n_ctx(bigger);
+        model_ctx_->releaseContext(bigger);
+    }
+
+    const llama_token toks[1] = { last };
+    if (!evalTokens(std::span{toks, 1})) {
+        return false;
+    }
+
+    if (moved) {
+        LOG_DEBUG_N << "Moved " << n_past_ << " tokens of KV cache (" << state_buffer_.size()
+                    << " bytes) from n_ctx=" << from_ctx << " to n_ctx=" << llama_n_ctx(ctx_) << " in "
+                    << chrono::duration<double, milli>(chrono::steady_clock::now() - started).count() << " ms";
+    }
+    return moved;
+}
+
+bool LlamaSessionCtxImpl::saveStateImpl(const filesystem::path & path) const {
+    const auto started = chrono::steady_clock::now();
+
+    vector<uint8_t> state(llama_state_seq_get_size(ctx_, 0));
+    if (llama_state_seq_get_data(ctx_, state.data(), state.size(), 0) != state.size()) {
+        LOG_ERROR_N << "Failed to get the state of the session";
+        return false;
+    }
+
+    const auto& model_id = model_ctx_->modelId();
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+    {
+        ofstream out{tmp_path, ios::binary | ios::trunc};
+        const bool ok = out
+                        && out.write(state_magic.data(), state_magic.size())
+                        && writeValue(out, static_cast<uint32_t>(model_id.size()))
+                        && out.write(model_id.data(), static_cast<streamsize>(model_id.size()))
+                        && writeValue(out, n_past_)
+                        && out.write(reinterpret_cast<const char *>(history_.data()),
+                                     static_cast<streamsize>(history_.size() * sizeof(llama_token)))
+                        && writeValue(out, static_cast<uint64_t>(state.size()))
+                        && out.write(reinterpret_cast<const char *>(state.data()), static_cast<streamsize>(state.size()))
+                        && out.flush();
+        if (!ok) {
+            LOG_ERROR_N << "Failed to write session state to " << tmp_path;
+            out.close();
+            error_code ec;
+            filesystem::remove(tmp_path, ec);
+            return false;
         }
+    }
 
-        // Scale up (doubling works well; you can do 1.5x if you want)
-        target_out = std::min(hard_max_out, target_out * 2);
+    error_code ec;
+    filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        LOG_ERROR_N << "Failed to rename " << tmp_path << " to " << path << ": " << ec.message();
+        filesystem::remove(tmp_path, ec);
+        return false;
     }
 
-    // If we exhausted attempts, return best effort
-    LOG_WARN_N << "Exhausted retry attempts. Last stop reason: " << last_stop_reason;
+    LOG_DEBUG_N << "Saved session state of " << n_past_ << " tokens (" << state.size() << " bytes) to "
+                << path << " in " << chrono::duration<double, milli>(chrono::steady_clock::now() - started).count()
+                << " ms";
     return true;
 }
 
+bool LlamaSessionCtxImpl::loadStateImpl(const filesystem::path & path) {
+    const auto started = chrono::steady_clock::now();
 
-bool LlamaSessionCtxImpl::resetContext() {
-    LOG_DEBUG_N << "Resetting llama_context for new session";
-    if (ctx_) {
-        llama_free(ctx_);
-        ctx_ = nullptr;
+    ifstream in{path, ios::binary};
+    if (!in) {
+        LOG_DEBUG_N << "No session state in " << path;
+        return false;
     }
 
-    auto cparams = llama_context_default_params();
-    const int desired_ctx = (ctx_size_override_ > 0) ? ctx_size_override_ : model_ctx_->ctxSize();
-    cparams.n_ctx = desired_ctx;
+    array<char, state_magic.size()> magic{};
+    uint32_t id_len{};
+    string model_id;
+    int32_t n_past{};
+    vector<llama_token> tokens;
+    uint64_t size{};
+    bool ok = in.read(magic.data(), magic.size())
+              && magic == state_magic
+              && readValue(in, id_len)
+              && id_len <= 4096;
+    if (ok) {
+        model_id.resize(id_len);
+        ok = in.read(model_id.data(), id_len)
+             && readValue(in, n_past)
+             && n_past > 0
+             && n_past <= 1024 * 1024;
+    }
+    if (ok) {
+        tokens.resize(static_cast<size_t>(n_past));
+        ok = in.read(reinterpret_cast<char *>(tokens.data()), static_cast<streamsize>(tokens.size() * sizeof(llama_token)))
+             && readValue(in, size);
+    }
+    if (!ok) {
+        LOG_WARN_N << "Ignoring invalid session state file " << path;
+        return false;
+    }
 
-    // Optional, but nice: pick a sane batch default for large ctx
-    // (you still won’t crash because evalTokens chunks)
-    cparams.n_batch = std::min(desired_ctx, 2048);
+    if (model_id != model_ctx_->modelId()) {
+        LOG_WARN_N << "The session state in " << path << " is for model " << model_id
+                   << ", not " << model_ctx_->modelId();
+        return false;
+    }
+
+    state_buffer_.resize(size);
+    if (!in.read(reinterpret_cast<char *>(state_buffer_.data()), static_cast<streamsize>(size))) {
+        LOG_WARN_N << "Truncated session state file " << path;
+        return false;
+    }
 
-    if (model_ctx_->threads() > 0) {
-        cparams.n_threads = model_ctx_->threads();
-        cparams.n_threads_batch = model_ctx_->threads();
+    // Some room for the next prompt. promptImpl() grows the context if it needs more.
+    if (!resetContext(n_past + 1024)) {
+        return false;
     }
 
-    ctx_ = llama_init_from_model(model_, cparams);
-    if (!ctx_) {
-        LOG_ERROR_N << "Failed to recreate llama_context";
+    if (llama_state_seq_set_data(ctx_, state_buffer_.data(), state_buffer_.size(), 0) == 0) {
+        LOG_WARN_N << "Failed to restore the session state from " << path;
+        resetContext();
         return false;
     }
 
+    n_past_ = n_past;
+    history_ = std::move(tokens);
+    last_token_ = history_.back();
+    final_text_.clear();
+    partial_text_.clear();
+
+    LOG_DEBUG_N << "Loaded session state of " << n_past_ << " tokens (" << size << " bytes) from "
+                << path << " in " << chrono::duration<double, milli>(chrono::steady_clock::now() - started).count()
+                << " ms";
+    return true;
+}
+
+bool LlamaSessionCtxImpl::resetContext(int nCtx, int minCtx) {
+    if (ctx_ && static_cast<int>(llama_n_ctx(ctx_)) >= std::max(nCtx, model_ctx_->ctxSize())) {
+        LOG_TRACE_N << "Clearing the KV cache of llama_context n_ctx=" << llama_n_ctx(ctx_);
+        llama_memory_clear(llama_get_memory(ctx_), true);
+    } else {
+        auto * ctx = model_ctx_->acquireContext(nCtx, 1, minCtx);
+        if (!ctx) {
+            LOG_ERROR_N << "Failed to get a llama_context for n_ctx=" << nCtx;
+            return false;
+        }
+        model_ctx_->releaseContext(ctx_);
+        ctx_ = ctx;
+    }
+
     n_past_ = 0;
     last_logits_idx_ = 0;
+    last_token_ = LLAMA_TOKEN_NULL;
+    history_.clear();
+    resetDraft();
 
     return true;
 }
@@ -683,6 +2124,18 @@ LlamaEngine::~LlamaEngine() = default;
 LlamaCtx::LlamaCtx() = default;
 LlamaCtx::~LlamaCtx() = default;
 
+LlamaCtx::PrefixCacheStats LlamaCtx::prefixCacheStats() const {
+    return prefixCacheStatsImpl();
+}
+
+void LlamaCtx::clearPrefixCache() {
+    clearPrefixCacheImpl();
+}
+
+int LlamaCtx::maxContextTokens() const {
+    return dynamic_cast<const LlamaCtxImpl&>(*this).maxContextTokensImpl();
+}
+
 LlamaSessionCtx::LlamaSessionCtx() = default;
 LlamaSessionCtx::~LlamaSessionCtx() = default;
 
@@ -699,4 +2152,37 @@ bool LlamaSessionCtx::prompt(std::string_view text, const Params& params) {
     return dynamic_cast<LlamaSessionCtxImpl&>(*this).promptImpl(text, params);
 }
 
+bool LlamaSessionCtx::saveState(const std::filesystem::path& path) const {
+    return dynamic_cast<const LlamaSessionCtxImpl&>(*this).saveStateImpl(path);
+}
+
+bool LlamaSessionCtx::loadState(const std::filesystem::path& path) {
+    return dynamic_cast<LlamaSessionCtxImpl&>(*this).loadStateImpl(path);
+}
+
+bool LlamaSessionCtx::promptFanOut(std::string_view prefix, std::span<const std::string> suffixes,
+                                   const Params& params, std::vector<std::string>& results) {
+    return dynamic_cast<LlamaSessionCtxImpl&>(*this).promptFanOutImpl(prefix, suffixes, params, results);
+}
+
+void LlamaSessionCtx::setOnSequenceTextCallback(sequence_text_cb_t cb) {
+    dynamic_cast<LlamaSessionCtxImpl&>(*this).setOnSequenceTextCallbackImpl(std::move(cb));
+}
+
+bool LlamaSessionCtx::setDraftModel(std::shared_ptr<LlamaCtx> draft, int draftTokens) {
+    return dynamic_cast<LlamaSessionCtxImpl&>(*this).setDraftModelImpl(std::move(draft), draftTokens);
+}
+
+LlamaSessionCtx::SpeculativeStats LlamaSessionCtx::speculativeStats() const {
+    return dynamic_cast<const LlamaSessionCtxImpl&>(*this).speculativeStatsImpl();
+}
+
+bool LlamaSessionCtx::truncated() const {
+    return dynamic_cast<const LlamaSessionCtxImpl&>(*this).truncatedImpl();
+}
+
+std::vector<size_t> LlamaSessionCtx::truncatedSequences() const {
+    return dynamic_cast<const LlamaSessionCtxImpl&>(*this).truncatedSequencesImpl();
+}
+
 } // namespace qvw
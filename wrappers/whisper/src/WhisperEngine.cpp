@@ -1,17 +1,30 @@
 
 #define LOGFAULT_FWD_ENABLE_LOGGING 1
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <format>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 #include "qvw/WhisperEngine.h"
 #include "qvw/log_wrapper.h"
 
 #include <whisper.h>
 
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#define QVW_WHISPER_RUSAGE 1
+#endif
+
 using namespace std;
 
 namespace qvw {
@@ -47,24 +60,487 @@ void whisperLogger(ggml_log_level level, const char *msg, void *) {
     }
 }
 
+// No speech: no text, or only segments that whisper thinks are not speech
+bool isSilence(const WhisperSessionCtx::Transcript& out, float noSpeechThold)
+{
+    return std::ranges::all_of(out.segments, [noSpeechThold](const auto& seg) {
+        return seg.no_speech_prob > noSpeechThold
+            || seg.text.find_first_not_of(" \t\r\n") == string::npos;
+    });
+}
+
+// Text with a low mean log-probability. Segments without speech don't count, and silence is not low confidence.
+bool looksLowConfidence(const WhisperSessionCtx::Transcript& out, float noSpeechThold)
+{
+    double logprob = 0.0;
+    int speech = 0;
+    for (const auto& seg : out.segments) {
+        if (seg.no_speech_prob > noSpeechThold || seg.text.find_first_not_of(" \t\r\n") == string::npos) {
+            continue;
+        }
+        logprob += seg.avg_logprob;
+        ++speech;
+    }
+    if (speech == 0) {
+        return false;
+    }
+
+    constexpr double min_avg_logprob = -1.0;
+    return logprob / speech < min_avg_logprob;
+}
+
+// Blocks read from storage so far (not from the page cache), in this thread where the
+// platform can tell. Elsewhere it is for the whole process, so other threads add to the difference.
+long blocksRead() noexcept
+{
+#ifdef QVW_WHISPER_RUSAGE
+#ifdef RUSAGE_THREAD
+    constexpr int who = RUSAGE_THREAD; // the model is read by the thread that loads it
+#else
+    constexpr int who = RUSAGE_SELF;
+#endif
+    rusage usage{};
+    if (getrusage(who, &usage) == 0) {
+        return usage.ru_inblock;
+    }
+#endif
+    return 0;
+}
+
+/*! Whisper's log-mel spectrogram, computed as the audio arrives.
+ *
+ *  Same as whisper_pcm_to_mel(): 25 ms periodic Hann windows with a 10 ms hop,
+ *  the power spectrum, Slaney mel filters and log10. A frame is computed as
+ *  soon as its window has all its input. The frames that overlap the zero
+ *  padding at the end, and the normalization, which depends on the largest
+ *  value of all the frames, are left for finish().
+ */
+class LogMelStream {
+public:
+    static constexpr int n_fft = WHISPER_N_FFT;
+    static constexpr int hop = WHISPER_HOP_LENGTH;
+    static constexpr int n_bins = n_fft / 2 + 1;
+    static constexpr int pad = n_fft / 2; // reflected at the start, zeros at the end
+
+    explicit LogMelStream(int nMel)
+        : n_mel_{nMel}, filters_{melFilters(nMel)} {}
+
+    int nMel() const noexcept {
+        return n_mel_;
+    }
+
+    size_t samples() const noexcept {
+        return pcm_.size();
+    }
+
+    void append(std::span<const float> pcm) {
+        pcm_.insert(pcm_.end(), pcm.begin(), pcm.end());
+
+        // Frame i covers the input from i * hop - pad to i * hop + pad.
+        // The reflection for the first frame needs pad + 1 samples.
+        while (pcm_.size() > static_cast<size_t>(pad)
+               && static_cast<size_t>(computed_ * hop + pad) <= pcm_.size()) {
+            computeFrame(computed_++);
+        }
+    }
+
+    void reset() {
+        pcm_.clear();
+        frames_.clear();
+        computed_ = 0;
+    }
+
+    /*! Returns the number of frames, with the normalized spectrogram in `mel`
+     *  as whisper_set_mel() takes it: [n_mel][n_len]. Like whisper, the input
+     *  is padded with 30 s of zeros.
+     *
+     *  Resets the stream.
+     */
+    int finish(vector<float>& mel) {
+        const auto n = static_cast<int64_t>(pcm_.size());
+        const auto n_len = static_cast<int>((n + static_cast<int64_t>(WHISPER_SAMPLE_RATE) * WHISPER_CHUNK_SIZE) / hop);
+
+        // The rest of the frames that see some of the input
+        const auto n_audio = std::min<int64_t>(n_len, (n + pad + hop - 1) / hop);
+        while (computed_ < n_audio) {
+            computeFrame(computed_++);
+        }
+
+        constexpr float log_zero = -10.0f; // log10(1e-10)
+        float mmax = log_zero;
+        for (const auto v : frames_) {
+            mmax = std::max(mmax, v);
+        }
+        mmax -= 8.0f;
+
+        const auto normalize = [mmax](float v) {
+            return (std::max(v, mmax) + 4.0f) / 4.0f;
+        };
+
+        mel.assign(static_cast<size_t>(n_mel_) * static_cast<size_t>(n_len), normalize(log_zero));
+        for (int64_t i = 0; i < computed_; ++i) {
+            for (int j = 0; j < n_mel_; ++j) {
+                mel[static_cast<size_t>(j) * static_cast<size_t>(n_len) + static_cast<size_t>(i)]
+                    = normalize(frames_[static_cast<size_t>(i * n_mel_ + j)]);
+            }
+        }
+
+        reset();
+        return n_len;
+    }
+
+private:
+    struct Tables {
+        std::vector<float> hann;
+        std::vector<float> cos; // [n_bins][n_fft]
+        std::vector<float> sin;
+    };
+
+    static const Tables& tables() {
+        static const Tables tables = [] {
+            Tables t;
+            t.hann.resize(n_fft);
+            t.cos.resize(static_cast<size_t>(n_bins) * n_fft);
+            t.sin.resize(static_cast<size_t>(n_bins) * n_fft);
+            for (int k = 0; k < n_fft; ++k) {
+                t.hann[k] = static_cast<float>(0.5 * (1.0 - std::cos(2.0 * M_PI * k / n_fft)));
+            }
+            for (int b = 0; b < n_bins; ++b) {
+                for (int k = 0; k < n_fft; ++k) {
+                    const double angle = 2.0 * M_PI * ((b * k) % n_fft) / n_fft;
+                    t.cos[static_cast<size_t>(b) * n_fft + k] = static_cast<float>(std::cos(angle));
+                    t.sin[static_cast<size_t>(b) * n_fft + k] = static_cast<float>(std::sin(angle));
+                }
+            }
+            return t;
+        }();
+        return tables;
+    }
+
+    // librosa.filters.mel(sr=16000, n_fft=400, n_mels=nMel), which is what whisper's filters are
+    static vector<float> melFilters(int nMel) {
+        constexpr double f_sp = 200.0 / 3.0;
+        constexpr double min_log_hz = 1000.0;
+        constexpr double min_log_mel = min_log_hz / f_sp;
+        const double logstep = std::log(6.4) / 27.0;
+
+        const auto hzToMel = [&](double hz) {
+            return hz < min_log_hz ? hz / f_sp : min_log_mel + std::log(hz / min_log_hz) / logstep;
+        };
+        const auto melToHz = [&](double mel) {
+            return mel < min_log_mel ? mel * f_sp : min_log_hz * std::exp(logstep * (mel - min_log_mel));
+        };
+
+        const double max_mel = hzToMel(WHISPER_SAMPLE_RATE / 2.0);
+        vector<double> mel_f(static_cast<size_t>(nMel) + 2);
+        for (size_t i = 0; i < mel_f.size(); ++i) {
+            mel_f[i] = melToHz(max_mel * static_cast<double>(i) / (nMel + 1));
+        }
+
+        vector<float> filters(static_cast<size_t>(nMel) * n_bins);
+        for (int j = 0; j < nMel; ++j) {
+            const auto& lo = mel_f[j];
+            const auto& center = mel_f[j + 1];
+            const auto& hi = mel_f[j + 2];
+            const double enorm = 2.0 / (hi - lo);
+            for (int b = 0; b < n_bins; ++b) {
+                const double f = static_cast<double>(WHISPER_SAMPLE_RATE) * b / n_fft;
+                const double w = std::min((f - lo) / (center - lo), (hi - f) / (hi - center));
+                filters[static_cast<size_t>(j) * n_bins + b] = static_cast<float>(std::max(0.0, w) * enorm);
+            }
+        }
+        return filters;
+    }
+
+    void computeFrame(int64_t frame) {
+        const auto& t = tables();
+        const auto n = static_cast<int64_t>(pcm_.size());
+        const int64_t first = frame * hop - pad;
+
+        std::array<float, n_fft> in{};
+        for (int k = 0; k < n_fft; ++k) {
+            const auto ix = first + k;
+            float v = 0.0f;
+            if (ix < 0) {
+                v = pcm_[static_cast<size_t>(std::min(-ix, n - 1))];
+            } else if (ix < n) {
+                v = pcm_[static_cast<size_t>(ix)];
+            }
+            in[k] = v * t.hann[k];
+        }
+
+        // A DFT over precomputed tables. n_fft is not a power of two, and the
+        // inner loops are plain dot products the compiler can vectorize.
+        std::array<float, n_bins> power{};
+        for (int b = 0; b < n_bins; ++b) {
+            const float *c = &t.cos[static_cast<size_t>(b) * n_fft];
+            const float *s = &t.sin[static_cast<size_t>(b) * n_fft];
+            float re = 0.0f;
+            float im = 0.0f;
+            for (int k = 0; k < n_fft; ++k) {
+                re += in[k] * c[k];
+                im += in[k] * s[k];
+            }
+            power[b] = re * re + im * im;
+        }
+
+        for (int j = 0; j < n_mel_; ++j) {
+            const float *f = &filters_[static_cast<size_t>(j) * n_bins];
+            double sum = 0.0;
+            for (int b = 0; b < n_bins; ++b) {
+                sum += static_cast<double>(power[b]) * f[b];
+            }
+            frames_.push_back(static_cast<float>(std::log10(std::max(sum, 1e-10))));
+        }
+    }
+
+    const int n_mel_;
+    const vector<float> filters_; // [n_mel][n_bins]
+    vector<float> pcm_;
+    vector<float> frames_;        // log10 mel, not normalized. [frame][n_mel]
+    int64_t computed_{};
+};
+
+/*! Admission control for whisperFull() calls from all the sessions of the engine.
+ *
+ *  A call holds a slot, with a share of the engine's threads, while it runs.
+ *  Only the first waiting call (by priority, then deadline, then arrival) can
+ *  be admitted, and only while there are free threads and free slots.
+ */
+class WhisperScheduler {
+public:
+    using clock_type = std::chrono::steady_clock;
+    using Priority = WhisperSessionCtx::WhisperFullParams::Priority;
+
+    class Slot {
+    public:
+        Slot(WhisperScheduler& scheduler, uint64_t id, Priority priority, int threads,
+             clock_type::time_point queued, optional<clock_type::time_point> deadline)
+            : scheduler_{scheduler}, id_{id}, priority_{priority}, threads_{threads}
+            , queued_{queued}, started_{clock_type::now()}, deadline_{deadline} {}
+
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+
+        ~Slot() {
+            scheduler_.release(*this);
+        }
+
+        int threads() const noexcept {
+            return threads_;
+        }
+
+        double queueMs() const noexcept {
+            return std::chrono::duration<double, std::milli>(started_ - queued_).count();
+        }
+
+        // So far
+        double runMs() const noexcept {
+            return std::chrono::duration<double, std::milli>(clock_type::now() - started_).count();
+        }
+
+    private:
+        friend class WhisperScheduler;
+
+        WhisperScheduler& scheduler_;
+        const uint64_t id_;
+        const Priority priority_;
+        const int threads_;
+        const clock_type::time_point queued_;
+        const clock_type::time_point started_;
+        const optional<clock_type::time_point> deadline_;
+    };
+
+    explicit WhisperScheduler(const WhisperEngine::WhisperCreateParams& params)
+        : total_threads_{params.threads > 0 ? params.threads : EngineBase::getThreads()}
+        , max_parallel_{std::max(1, params.max_parallel_jobs)}
+        , min_job_threads_{std::clamp(params.min_job_threads, 1, total_threads_)}
+        , free_threads_{total_threads_}
+    {
+        LOG_DEBUG << "Whisper scheduler: threads=" << total_threads_
+                  << ", max_parallel_jobs=" << max_parallel_
+                  << ", min_job_threads=" << min_job_threads_;
+    }
+
+    // Blocks until the call can run. `requestedThreads` <= 0 for the fair share.
+    Slot acquire(Priority priority, optional<clock_type::time_point> deadline, int requestedThreads) {
+        const auto queued = clock_type::now();
+        unique_lock lock{mutex_};
+        const Ticket ticket{++next_id_, priority, deadline};
+        waiting_.push_back(ticket);
+
+        cv_.wait(lock, [&] {
+            return running_ < max_parallel_ && free_threads_ >= min_job_threads_
+                   && ranges::none_of(waiting_, [&](const Ticket& t) { return before(t, ticket); });
+        });
+        std::erase_if(waiting_, [&](const Ticket& t) { return t.id == ticket.id; });
+
+        // A single session gets all the threads. With more, each gets a share,
+        // so a call from another session can start without waiting for this one.
+        const int share = total_threads_ / std::clamp(sessions_, 1, max_parallel_);
+        int threads = std::clamp(share, min_job_threads_, free_threads_);
+        if (requestedThreads > 0) {
+            threads = std::clamp(requestedThreads, 1, free_threads_);
+        }
+
+        free_threads_ -= threads;
+        ++running_;
+
+        LOG_TRACE << "Whisper job #" << ticket.id << " admitted with " << threads
+                  << " threads. running=" << running_ << ", queued=" << waiting_.size();
+        return Slot{*this, ticket.id, priority, threads, queued, deadline};
+    }
+
+    void addSession() {
+        lock_guard lock{mutex_};
+        ++sessions_;
+    }
+
+    void removeSession() {
+        lock_guard lock{mutex_};
+        assert(sessions_ > 0);
+        --sessions_;
+    }
+
+    WhisperEngine::SchedulerStats stats() const {
+        lock_guard lock{mutex_};
+        return {
+            .total_threads = total_threads_,
+            .free_threads = free_threads_,
+            .running = running_,
+            .queued = static_cast<int>(waiting_.size()),
+            .jobs = jobs_,
+            .missed_deadlines = missed_deadlines_,
+            .queue_ms = queue_ms_,
+            .run_ms = run_ms_
+        };
+    }
+
+private:
+    struct Ticket {
+        uint64_t id{};
+        Priority priority{};
+        optional<clock_type::time_point> deadline;
+    };
+
+    // True if `a` is to be admitted before `b`
+    static bool before(const Ticket& a, const Ticket& b) noexcept {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority;
+        }
+        if (a.deadline != b.deadline) {
+            // A job with a deadline goes before one without
+            return a.deadline && (!b.deadline || *a.deadline < *b.deadline);
+        }
+        return a.id < b.id;
+    }
+
+    void release(const Slot& slot) {
+        const auto queue_ms = slot.queueMs();
+        const auto run_ms = slot.runMs();
+        const bool missed = slot.deadline_ && clock_type::now() > *slot.deadline_;
+        {
+            lock_guard lock{mutex_};
+            free_threads_ += slot.threads_;
+            --running_;
+            ++jobs_;
+            queue_ms_ += queue_ms;
+            run_ms_ += run_ms;
+            if (missed) {
+                ++missed_deadlines_;
+            }
+        }
+        cv_.notify_all();
+
+        LOG_DEBUG << "Whisper job #" << slot.id_ << " (priority " << static_cast<int>(slot.priority_)
+                  << ") queued " << queue_ms << " ms, ran " << run_ms << " ms with "
+                  << slot.threads_ << " threads" << (missed ? ". Missed its deadline." : "");
+    }
+
+    const int total_threads_;
+    const int max_parallel_;
+    const int min_job_threads_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Ticket> waiting_;
+    uint64_t next_id_{};
+    int free_threads_;
+    int running_{};
+    int sessions_{};
+    uint64_t jobs_{};
+    uint64_t missed_deadlines_{};
+    double queue_ms_{};
+    double run_ms_{};
+};
+
 class WhisperSessionCtxImpl final : public WhisperSessionCtx {
 public:
-    WhisperSessionCtxImpl(shared_ptr<WhisperCtxImpl> modelCtx, whisper_state *state);
+    WhisperSessionCtxImpl(shared_ptr<WhisperCtxImpl> modelCtx, whisper_state *state, bool reused);
+    ~WhisperSessionCtxImpl() override;
     void setOnPartialTextCallback(std::function<void (const std::string &)> callback) override {
         on_partial_text_callback_ = std::move(callback);
     }
 
+    void setOnSegmentCallback(segment_cb_t callback) override {
+        on_segment_callback_ = std::move(callback);
+    }
+
+    void setOnProgressCallback(progress_cb_t callback) override {
+        on_progress_callback_ = std::move(callback);
+    }
+
     string getFullTextResult() const override {
         return final_text_;
     }
 
     bool whisperFull(std::span<const float> data, const WhisperFullParams &params, Transcript& out) override;
 
+    string pinnedLanguage() const override {
+        return pinned_language_;
+    }
+
+    void streamAppend(std::span<const float> data) override;
+    bool whisperFullStreamed(const WhisperFullParams &params, Transcript& out) override;
+
+    void streamReset() override {
+        if (stream_) {
+            stream_->reset();
+        }
+    }
+
 private:
+    struct DetectedLanguage {
+        string language;
+        float p{};
+    };
+
+    // `data` is empty when the mel spectrogram of the `samples` is already in the state
+    bool full(std::span<const float> data, size_t samples, const WhisperFullParams &params, Transcript& out);
+    DetectedLanguage detectLanguage(std::span<const float> data, int threads);
+    string languageFor(std::span<const float> data, size_t samples, const WhisperFullParams &params, int threads);
+    int fitAudioCtx(size_t samples, const WhisperFullParams &params) const;
+    bool looksDegraded(const Transcript& out, size_t samples, float noSpeechThold) const;
+    void collectResult(Transcript& out, bool collectTokens) const;
+    // Appends the tokens to `tokens`, if set
+    Segment segment(int index, Transcript *tokens) const;
+
+    static void onNewSegments(whisper_context *ctx, whisper_state *state, int nNew, void *self);
+    static void onProgress(whisper_context *ctx, whisper_state *state, int progress, void *self);
+
     shared_ptr<WhisperCtxImpl> model_ctx_;
     whisper_state *state_{nullptr};
+    // A reused state remembers the text context of its previous session
+    bool clear_context_{false};
+    int audio_ctx_fallbacks_in_row_{0};
+    bool fit_audio_ctx_disabled_{false};
+    std::string pinned_language_;
+    std::unique_ptr<LogMelStream> stream_;
+    std::vector<float> mel_;
     std::string final_text_;
     std::function<void (const std::string &)> on_partial_text_callback_;
+    segment_cb_t on_segment_callback_;
+    progress_cb_t on_progress_callback_;
 
     // SessionCtx interface
 };
@@ -72,8 +548,12 @@ private:
 
 class WhisperCtxImpl final : public WhisperCtx, public enable_shared_from_this<WhisperCtxImpl> {
 public:
-    WhisperCtxImpl(WhisperImpl& engine, string_view modelId, whisper_context *ctx)
+    WhisperCtxImpl(WhisperImpl& engine, string_view modelId, whisper_context *ctx,
+                   const WhisperEngineLoadParams& params)
         : engine_{engine}, model_id_{modelId}, ctx_{ctx}
+        , max_idle_states_{std::max(0, params.max_idle_states)}
+        , max_idle_bytes_{params.max_idle_state_bytes}
+        , state_bytes_{estimateStateBytes(ctx)}
     {
         assert(ctx_ != nullptr);
     }
@@ -105,14 +585,81 @@ public:
 
         LOG_DEBUG << "Creating new Whisper session for model " << model_id_;
 
+        {
+            lock_guard lock{mutex_};
+            if (!idle_states_.empty()) {
+                auto *state = idle_states_.back();
+                idle_states_.pop_back();
+                ++in_use_;
+                ++reused_;
+                LOG_DEBUG << "Reusing pooled Whisper state. idle=" << idle_states_.size()
+                          << ", in_use=" << in_use_;
+                return make_shared<WhisperSessionCtxImpl>(shared_from_this(), state, true);
+            }
+        }
+
+        // Allocating the KV caches and compute buffers is the expensive part
         if (auto state = whisper_init_state(ctx_)) {
-            auto s = make_shared<WhisperSessionCtxImpl>(shared_from_this(), state);
-            return s;
+            lock_guard lock{mutex_};
+            ++in_use_;
+            ++created_;
+            LOG_DEBUG << "Created Whisper state #" << created_ << " (about "
+                      << (state_bytes_ / (1024 * 1024)) << " MB). in_use=" << in_use_;
+            return make_shared<WhisperSessionCtxImpl>(shared_from_this(), state, false);
         }
 
         return {};
     }
 
+    // Called when a session ends
+    void returnState(whisper_state *state) {
+        assert(state != nullptr);
+        {
+            lock_guard lock{mutex_};
+            assert(in_use_ > 0);
+            --in_use_;
+            const auto idle_bytes = (idle_states_.size() + 1) * state_bytes_;
+            if (static_cast<int>(idle_states_.size()) < max_idle_states_
+                && (max_idle_bytes_ == 0 || idle_bytes <= max_idle_bytes_)) {
+                idle_states_.push_back(state);
+                return;
+            }
+        }
+
+        LOG_TRACE << "Freeing Whisper state. The pool is full.";
+        whisper_free_state(state);
+    }
+
+    LoadStats loadStats() const override {
+        return load_stats_;
+    }
+
+    void setLoadStats(const LoadStats& stats) {
+        load_stats_ = stats;
+    }
+
+    StatePoolStats statePoolStats() const override {
+        lock_guard lock{mutex_};
+        return {
+            .idle = static_cast<int>(idle_states_.size()),
+            .in_use = in_use_,
+            .created = created_,
+            .reused = reused_,
+            .state_bytes = state_bytes_
+        };
+    }
+
+    void releaseIdleStates() override {
+        vector<whisper_state *> states;
+        {
+            lock_guard lock{mutex_};
+            states.swap(idle_states_);
+        }
+        for (auto *state : states) {
+            whisper_free_state(state);
+        }
+    }
+
     whisper_context *ctx() noexcept override {
         return ctx_;
     };
@@ -122,14 +669,42 @@ public:
     };
 
 private:
+    // The KV caches, with the padding whisper.cpp uses. F16 elements.
+    static size_t estimateStateBytes(whisper_context *ctx) {
+        const auto pad = [](int n) { return static_cast<size_t>((n + 255) / 256 * 256); };
+        const auto text_state = static_cast<size_t>(whisper_model_n_text_state(ctx));
+        const auto text_layers = static_cast<size_t>(whisper_model_n_text_layer(ctx));
+        const auto audio_state = static_cast<size_t>(whisper_model_n_audio_state(ctx));
+        const auto text_ctx = pad(whisper_model_n_text_ctx(ctx));
+        const auto audio_ctx = pad(whisper_model_n_audio_ctx(ctx));
+
+        constexpr size_t kv = 2; // keys and values
+        constexpr size_t f16 = 2;
+        const auto self = kv * text_state * text_layers * text_ctx * f16;
+        const auto cross = kv * text_state * text_layers * audio_ctx * f16;
+        const auto kv_pad = kv * audio_state * audio_ctx * f16;
+        return self + cross + kv_pad;
+    }
+
     WhisperImpl& engine_;
     const std::string model_id_;
     whisper_context *ctx_{nullptr};
+
+    mutable std::mutex mutex_;
+    std::vector<whisper_state *> idle_states_;
+    int in_use_{};
+    uint64_t created_{};
+    uint64_t reused_{};
+    const int max_idle_states_;
+    const size_t max_idle_bytes_;
+    const size_t state_bytes_;
+    LoadStats load_stats_;
 };
 
 class WhisperImpl final : public WhisperEngine {
 public:
     WhisperImpl(const WhisperCreateParams& params)
+        : scheduler_{params}
     {
         LOG_DEBUG << "Creating Whisper engine";
 
@@ -168,9 +743,7 @@ public:
     shared_ptr<ModelCtx> load(const string &modelId, const filesystem::path &modelPath, const EngineLoadParams &params) override {
         WhisperEngineLoadParams wp;
         if (auto *wparams = dynamic_cast<const WhisperEngineLoadParams*>(&params)) {
-            wp.use_gpu = wparams->use_gpu;
-            wp.flash_attn = wparams->flash_attn;
-            wp.gpu_device = wparams->gpu_device;
+            wp = *wparams;
         }
 
         return loadWhisper(modelId, modelPath, wp);
@@ -201,8 +774,22 @@ public:
         cparams.flash_attn = params.flash_attn;
         cparams.gpu_device = params.gpu_device;
 
+        const auto start = chrono::steady_clock::now();
+        const auto blocks = blocksRead();
+        WhisperCtx::LoadStats stats;
+        std::error_code ec;
+        stats.file_bytes = filesystem::file_size(modelPath, ec);
+
         if (auto *ctx = whisper_init_from_file_with_params_no_state(modelPath.c_str(), cparams)) {
-            auto modelCtx = make_shared<WhisperCtxImpl>(*this, modelId, ctx);
+            stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            stats.blocks_read = blocksRead() - blocks;
+            LOG_INFO << "Loaded Whisper model " << modelId << " (" << (stats.file_bytes / (1024 * 1024))
+                     << " MB) in " << stats.seconds << " seconds, "
+                     << (stats.seconds > 0.0 ? static_cast<double>(stats.file_bytes) / (1024.0 * 1024.0) / stats.seconds : 0.0)
+                     << " MB/s, blocks_read=" << stats.blocks_read;
+
+            auto modelCtx = make_shared<WhisperCtxImpl>(*this, modelId, ctx, params);
+            modelCtx->setLoadStats(stats);
             num_loaded_models_++;
 
             return modelCtx; // When the shared pointer goes out of scope, the model context is unloaded
@@ -217,6 +804,14 @@ public:
         --num_loaded_models_;
     }
 
+    WhisperScheduler& scheduler() noexcept {
+        return scheduler_;
+    }
+
+    SchedulerStats schedulerStats() const override {
+        return scheduler_.stats();
+    }
+
     void setLogger(logfault_fwd::logfault_callback_t cb, logfault_fwd::Level level) override {
         logfault_fwd::setCallback(std::move(cb), "[whisper]");
         logfault_fwd::setLevel(level);
@@ -237,9 +832,13 @@ private:
 
     string error_;
     atomic_int num_loaded_models_{0};
+    WhisperScheduler scheduler_;
 };
 
 WhisperCtxImpl::~WhisperCtxImpl() {
+    // Sessions hold a reference to the context, so all states are idle by now
+    assert(in_use_ == 0);
+    releaseIdleStates();
     if (ctx_) {
         whisper_free(ctx_);
         ctx_ = nullptr;
@@ -261,16 +860,60 @@ const EngineBase &WhisperCtxImpl::engine() const noexcept
     return engine_;
 }
 
-WhisperSessionCtxImpl::WhisperSessionCtxImpl(shared_ptr<WhisperCtxImpl> modelCtx, whisper_state *state)
-    : model_ctx_{std::move(modelCtx)}, state_{state}
+WhisperSessionCtxImpl::WhisperSessionCtxImpl(shared_ptr<WhisperCtxImpl> modelCtx, whisper_state *state, bool reused)
+    : model_ctx_{std::move(modelCtx)}, state_{state}, clear_context_{reused}
 {
     LOG_DEBUG << "Created Whisper session context";
     assert(model_ctx_ != nullptr);
     assert(state_ != nullptr);
+    model_ctx_->wengine().scheduler().addSession();
+}
+
+WhisperSessionCtxImpl::~WhisperSessionCtxImpl()
+{
+    model_ctx_->wengine().scheduler().removeSession();
+    if (state_) {
+        model_ctx_->returnState(state_);
+        state_ = nullptr;
+    }
 }
 
 bool WhisperSessionCtxImpl::whisperFull(std::span<const float> data, const WhisperFullParams &params, Transcript& out) {
-    auto p = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    return full(data, data.size(), params, out);
+}
+
+void WhisperSessionCtxImpl::streamAppend(std::span<const float> data)
+{
+    if (!stream_) {
+        stream_ = make_unique<LogMelStream>(whisper_model_n_mels(model_ctx_->ctx()));
+    }
+    stream_->append(data);
+}
+
+bool WhisperSessionCtxImpl::whisperFullStreamed(const WhisperFullParams &params, Transcript &out)
+{
+    if (!stream_ || stream_->samples() == 0) {
+        LOG_WARN << "whisperFullStreamed() called without any audio";
+        return false;
+    }
+
+    const auto start = chrono::steady_clock::now();
+    const auto samples = stream_->samples();
+    const auto n_len = stream_->finish(mel_);
+    if (whisper_set_mel_with_state(model_ctx_->ctx(), state_, mel_.data(), n_len, stream_->nMel()) != 0) {
+        LOG_ERROR << "Failed to set the mel spectrogram";
+        return false;
+    }
+    LOG_TRACE << "Finished the mel spectrogram for " << samples << " samples in "
+              << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms";
+
+    return full({}, samples, params, out);
+}
+
+bool WhisperSessionCtxImpl::full(std::span<const float> data, size_t samples, const WhisperFullParams &params, Transcript& out) {
+    const bool beam_search = params.sampling == WhisperFullParams::Sampling::BeamSearch;
+    auto p = whisper_full_default_params(beam_search ? WHISPER_SAMPLING_BEAM_SEARCH
+                                                     : WHISPER_SAMPLING_GREEDY);
 
     LOG_TRACE << "Starting full whisper processing with "
               << (params.language.empty() ? "auto-detect language" : format("language='{}'", params.language))
@@ -300,13 +943,54 @@ bool WhisperSessionCtxImpl::whisperFull(std::span<const float> data, const Whisp
     if (!params.vocabulary.empty()) {
         p.initial_prompt = params.vocabulary.c_str();
     }
+    if (params.best_of.has_value()) {
+        p.greedy.best_of = params.best_of.value();
+    }
+    if (params.beam_size.has_value()) {
+        p.beam_search.beam_size = params.beam_size.value();
+    }
+    if (params.temperature.has_value()) {
+        p.temperature = params.temperature.value();
+    }
+    if (params.temperature_inc.has_value()) {
+        p.temperature_inc = params.temperature_inc.value();
+    }
+    if (params.entropy_thold.has_value()) {
+        p.entropy_thold = params.entropy_thold.value();
+    }
+    if (params.logprob_thold.has_value()) {
+        p.logprob_thold = params.logprob_thold.value();
+    }
+    if (params.no_speech_thold.has_value()) {
+        p.no_speech_thold = params.no_speech_thold.value();
+    }
+    if (params.no_timestamps.has_value()) {
+        p.no_timestamps = params.no_timestamps.value();
+    }
+    if (params.suppress_blank.has_value()) {
+        p.suppress_blank = params.suppress_blank.value();
+    }
+    if (params.suppress_nst.has_value()) {
+        p.suppress_nst = params.suppress_nst.value();
+    }
 
-    p.n_threads = EngineBase::getThreads(params.threads);
+    // Waits here while other sessions use the threads
+    const auto slot = model_ctx_->wengine().scheduler().acquire(params.priority, params.deadline, params.threads);
+    p.n_threads = slot.threads();
 
-    if (!params.language.empty()) {
-        p.language = params.language.c_str();
+    // The first call with a pooled state must not be conditioned on the text
+    // from its previous session. That is all a fresh state would differ in.
+    if (clear_context_) {
+        p.no_context = true;
+        clear_context_ = false;
     }
 
+    // whisper.cpp's default is "en". "auto" makes it detect the language in each call.
+    const auto language = params.language.empty()
+        ? languageFor(data, samples, params, p.n_threads)
+        : params.language;
+    p.language = language.empty() ? "auto" : language.c_str();
+
     LOG_TRACE << "Whisper full params: "
                 << "language='" << (p.language ? p.language : "auto") << "', "
                 << "n_threads=" << p.n_threads << ", "
@@ -316,47 +1000,304 @@ bool WhisperSessionCtxImpl::whisperFull(std::span<const float> data, const Whisp
                 << "single_segment=" << p.single_segment << ", "
                 << "print_progress=" << p.print_progress << ", "
                 << "print_timestamps=" << p.print_timestamps << ", "
-                << "print_realtime=" << p.print_realtime;
+                << "print_realtime=" << p.print_realtime << ", "
+                << "strategy=" << (beam_search ? "beam_search" : "greedy") << ", "
+                << "best_of=" << p.greedy.best_of << ", "
+                << "beam_size=" << p.beam_search.beam_size << ", "
+                << "temperature=" << p.temperature << ", "
+                << "temperature_inc=" << p.temperature_inc << ", "
+                << "entropy_thold=" << p.entropy_thold << ", "
+                << "logprob_thold=" << p.logprob_thold << ", "
+                << "no_speech_thold=" << p.no_speech_thold << ", "
+                << "no_timestamps=" << p.no_timestamps << ", "
+                << "suppress_blank=" << p.suppress_blank << ", "
+                << "suppress_nst=" << p.suppress_nst;
+
+    if (params.audio_ctx.has_value()) {
+        p.audio_ctx = params.audio_ctx.value();
+    }
+
+    if (data.empty()) {
+        // The mel spectrogram includes 30 s of padding. Don't decode that.
+        p.duration_ms = static_cast<int>(samples * 1000 / WHISPER_SAMPLE_RATE);
+    }
+
+    const int fitted_ctx = params.fit_audio_ctx ? fitAudioCtx(samples, params) : 0;
+    if (fitted_ctx > 0) {
+        p.audio_ctx = fitted_ctx;
+    }
+
+    // Stream the segments and progress while decoding
+    if (on_segment_callback_ || on_partial_text_callback_) {
+        p.new_segment_callback = &WhisperSessionCtxImpl::onNewSegments;
+        p.new_segment_callback_user_data = this;
+    }
+    if (on_progress_callback_) {
+        p.progress_callback = &WhisperSessionCtxImpl::onProgress;
+        p.progress_callback_user_data = this;
+    }
 
-    auto rc = whisper_full_with_state(model_ctx_->ctx(), state_, p, data.data(), static_cast<int>(data.size()));
-    if (rc != 0) {
+    auto decode = [&]() -> bool {
+        final_text_.clear();
+        if (whisper_full_with_state(model_ctx_->ctx(), state_, p, data.empty() ? nullptr : data.data(),
+                                    static_cast<int>(data.size())) != 0) {
+            return false;
+        }
+        collectResult(out, params.collect_tokens);
+        return true;
+    };
+
+    if (!decode()) {
         return false;
     }
 
+    out.audio_ctx = p.audio_ctx;
+    out.audio_ctx_fallback = false;
+
+    // Silence says nothing about the audio_ctx, so it neither counts as a fallback nor resets the count
+    if (fitted_ctx > 0 && !isSilence(out, p.no_speech_thold)) {
+        if (looksDegraded(out, samples, p.no_speech_thold)) {
+            LOG_DEBUG << "Output with audio_ctx=" << fitted_ctx
+                      << " looks degraded. Decoding again with the full context.";
+
+            // The rejected text is now in the decoder's context. Don't condition on it.
+            p.audio_ctx = 0;
+            p.no_context = true;
+            if (!decode()) {
+                return false;
+            }
+            out.audio_ctx = 0;
+            out.audio_ctx_fallback = true;
+
+            // Some audio (or model) just doesn't work with a short context
+            constexpr int max_fallbacks_in_row = 3;
+            if (++audio_ctx_fallbacks_in_row_ >= max_fallbacks_in_row) {
+                LOG_INFO << "Disabling audio_ctx fitting for this session after "
+                         << audio_ctx_fallbacks_in_row_ << " fallbacks in a row";
+                fit_audio_ctx_disabled_ = true;
+            }
+        } else {
+            audio_ctx_fallbacks_in_row_ = 0;
+        }
+    }
+
+    // A pinned language may be wrong, for example if the speaker changed language
+    const auto min_detect_samples = static_cast<size_t>(std::max(0, params.min_detect_ms)) * WHISPER_SAMPLE_RATE / 1000;
+    if (params.language.empty() && !pinned_language_.empty()
+        && samples >= min_detect_samples && looksLowConfidence(out, p.no_speech_thold)) {
+        if (const auto detected = detectLanguage(data, p.n_threads);
+            !detected.language.empty() && detected.language != pinned_language_
+            && detected.p >= params.min_detect_p) {
+            LOG_INFO << "Low confidence output in '" << pinned_language_ << "'. Switching to '"
+                     << detected.language << "' (p=" << detected.p << ")";
+            pinned_language_ = detected.language;
+            p.language = pinned_language_.c_str();
+            p.no_context = true;
+            if (!decode()) {
+                return false;
+            }
+        }
+    }
+
+    if (p.language && string_view{p.language} != "auto") {
+        out.language = p.language;
+    } else if (const auto id = whisper_full_lang_id_from_state(state_); id >= 0) {
+        out.language = whisper_lang_str(id);
+    } else {
+        out.language.clear();
+    }
+
+    final_text_ = out.full_text;
+    out.threads = slot.threads();
+    out.queue_ms = slot.queueMs();
+    out.run_ms = slot.runMs();
+    return true;
+}
+
+WhisperSessionCtxImpl::DetectedLanguage WhisperSessionCtxImpl::detectLanguage(std::span<const float> data, int threads)
+{
+    const auto start = std::chrono::steady_clock::now();
+    auto *ctx = model_ctx_->ctx();
+    if (!data.empty()
+        && whisper_pcm_to_mel_with_state(ctx, state_, data.data(), static_cast<int>(data.size()), threads) != 0) {
+        LOG_WARN << "Failed to compute the mel spectrogram for language detection";
+        return {};
+    }
+
+    vector<float> probs(static_cast<size_t>(whisper_lang_max_id() + 1));
+    const auto id = whisper_lang_auto_detect_with_state(ctx, state_, 0, threads, probs.data());
+    if (id < 0) {
+        LOG_WARN << "Language detection failed";
+        return {};
+    }
+
+    DetectedLanguage detected{whisper_lang_str(id), probs.at(static_cast<size_t>(id))};
+    LOG_DEBUG << "Detected language '" << detected.language << "' (p=" << detected.p
+              << ") in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+              << " seconds";
+    return detected;
+}
+
+string WhisperSessionCtxImpl::languageFor(std::span<const float> data, size_t samples, const WhisperFullParams &params, int threads)
+{
+    if (!params.pin_language || !pinned_language_.empty()) {
+        return pinned_language_;
+    }
+
+    const auto min_detect_samples = static_cast<size_t>(std::max(0, params.min_detect_ms)) * WHISPER_SAMPLE_RATE / 1000;
+    if (samples < min_detect_samples) {
+        return {}; // Too short to trust. Let whisper detect for this call only.
+    }
+
+    if (auto detected = detectLanguage(data, threads); !detected.language.empty()) {
+        if (detected.p >= params.min_detect_p) {
+            LOG_INFO << "Pinning language '" << detected.language << "' (p=" << detected.p
+                     << ") for the rest of the session";
+            pinned_language_ = std::move(detected.language);
+        } else {
+            // Use it for this call, but don't pin an uncertain guess
+            return detected.language;
+        }
+    }
+
+    return pinned_language_;
+}
+
+int WhisperSessionCtxImpl::fitAudioCtx(size_t samples, const WhisperFullParams &params) const
+{
+    if (fit_audio_ctx_disabled_) {
+        return 0;
+    }
+
+    const int full_ctx = whisper_model_n_audio_ctx(model_ctx_->ctx());
+
+    // One encoder frame per two mel frames (WHISPER_HOP_LENGTH samples each)
+    constexpr size_t samples_per_frame = WHISPER_HOP_LENGTH * 2;
+    const auto frames = static_cast<int>(std::min<size_t>((samples + samples_per_frame - 1) / samples_per_frame,
+                                                          static_cast<size_t>(full_ctx)));
+
+    // Some margin, rounded up to a multiple of 64 frames (1.28 s)
+    constexpr int margin = 64;
+    constexpr int multiple = 64;
+    const int ctx = std::max(params.min_audio_ctx, (frames + margin + multiple - 1) / multiple * multiple);
+    if (ctx >= full_ctx) {
+        return 0;
+    }
+    return ctx;
+}
+
+bool WhisperSessionCtxImpl::looksDegraded(const Transcript &out, size_t samples, float noSpeechThold) const
+{
+    // Truncated contexts tend to fail by looping on a phrase, which gives far
+    // more text than anyone can speak, or by low confidence everywhere.
+    // Silence is a valid result, also with a short context.
+    if (isSilence(out, noSpeechThold)) {
+        return false;
+    }
+    if (looksLowConfidence(out, noSpeechThold)) {
+        return true;
+    }
+
+    const double seconds = std::max(0.5, static_cast<double>(samples) / WHISPER_SAMPLE_RATE);
+    constexpr double max_chars_per_second = 40.0;
+    return static_cast<double>(out.full_text.size()) / seconds > max_chars_per_second;
+}
+
+void WhisperSessionCtxImpl::collectResult(Transcript &out, bool collectTokens) const
+{
     // Handle transcript output
     out.segments.clear();
     out.full_text.clear();
+    out.tokens.clear();
+    out.token_text.clear();
 
     const int n = whisper_full_n_segments_from_state(state_);
     out.segments.reserve(std::max(0, n));
 
     for (int i = 0; i < n; ++i) {
-        Segment seg{};
-        seg.t0_ms = whisper_full_get_segment_t0_from_state(state_, i) * 10; // whisper uses 10ms units
-        seg.t1_ms = whisper_full_get_segment_t1_from_state(state_, i) * 10;
+        auto seg = segment(i, collectTokens ? &out : nullptr);
+        out.full_text += seg.text;
+        out.segments.push_back(std::move(seg));
+    }
+}
+
+WhisperSessionCtx::Segment WhisperSessionCtxImpl::segment(int index, Transcript *tokens) const
+{
+    Segment seg{};
+    seg.t0_ms = whisper_full_get_segment_t0_from_state(state_, index) * 10; // whisper uses 10ms units
+    seg.t1_ms = whisper_full_get_segment_t1_from_state(state_, index) * 10;
 
-        const char* txt = whisper_full_get_segment_text_from_state(state_, i);
-        if (txt) {
-            seg.text.assign(txt);
-            out.full_text += seg.text;
+    if (const char* txt = whisper_full_get_segment_text_from_state(state_, index)) {
+        seg.text.assign(txt);
+    }
+
+    // Tokens at or above EOT are special (sot, language, timestamps, ...)
+    const auto eot = whisper_token_eot(model_ctx_->ctx());
+
+    // whisper.cpp has no per-segment avg_logprob, so derive it from the text tokens
+    double sum_logprob = 0.0;
+    int text_tokens = 0;
+    const int n_tokens = whisper_full_n_tokens_from_state(state_, index);
+    if (tokens) {
+        seg.first_token = static_cast<uint32_t>(tokens->tokens.size());
+    }
+    for (int t = 0; t < n_tokens; ++t) {
+        const auto td = whisper_full_get_token_data_from_state(state_, index, t);
+        if (td.id >= eot) {
+            continue;
         }
+        sum_logprob += td.plog;
+        ++text_tokens;
+
+        if (tokens) {
+            const string_view text = whisper_full_get_token_text_from_state(model_ctx_->ctx(), state_, index, t);
+            tokens->tokens.push_back({
+                .id = td.id,
+                .p = td.p,
+                .plog = td.plog,
+                .t0_ms = td.t0 * 10,
+                .t1_ms = td.t1 * 10,
+                .text_offset = static_cast<uint32_t>(tokens->token_text.size()),
+                .text_size = static_cast<uint32_t>(text.size())
+            });
+            tokens->token_text += text;
+        }
+    }
+    if (tokens) {
+        seg.token_count = static_cast<uint32_t>(tokens->tokens.size()) - seg.first_token;
+    }
+    if (text_tokens > 0) {
+        seg.avg_logprob = static_cast<float>(sum_logprob / text_tokens);
+    }
 
-        // seg.avg_logprob = whisper_full_get_segment_avg_logprob_from_state(state_, i);
-        seg.no_speech_prob = whisper_full_get_segment_no_speech_prob_from_state(state_, i);
-        out.segments.push_back(std::move(seg));
+    seg.no_speech_prob = whisper_full_get_segment_no_speech_prob_from_state(state_, index);
+    return seg;
+}
+
+void WhisperSessionCtxImpl::onNewSegments(whisper_context *, whisper_state *state, int nNew, void *self)
+{
+    auto& session = *static_cast<WhisperSessionCtxImpl *>(self);
+    assert(state == session.state_);
+    const int n = whisper_full_n_segments_from_state(state);
+    for (int i = std::max(0, n - nNew); i < n; ++i) {
+        const auto seg = session.segment(i, nullptr);
+        session.final_text_ += seg.text;
+        if (session.on_segment_callback_) {
+            session.on_segment_callback_(seg);
+        }
     }
 
-    // Optional: expose the language you used / detected
-    // If you forced language, you already know it:
-    if (!params.language.empty()) {
-        out.language = params.language;
-    } else {
-        // Some builds expose language id; if available, map it to a string here.
-        // Otherwise leave empty or set "auto".
-        out.language.clear();
+    if (session.on_partial_text_callback_) {
+        session.on_partial_text_callback_(session.final_text_);
     }
+}
 
-    return true;
+void WhisperSessionCtxImpl::onProgress(whisper_context *, whisper_state *, int progress, void *self)
+{
+    auto& session = *static_cast<WhisperSessionCtxImpl *>(self);
+    if (session.on_progress_callback_) {
+        session.on_progress_callback_(progress);
+    }
 }
 
 } // anon ns